@@ -0,0 +1,320 @@
+#!/usr/bin/perl -w
+
+# File system benchmarks run through the FUSE mounts of yfs_client.
+#
+# Starts an extent_server, a lock_server (or -l replicas of it) and -n
+# yfs_client mounts under the current directory, runs the workloads and
+# prints one JSON object per workload on stdout, e.g.
+#
+#   {"workload":"create","clients":2,"ops":400,"secs":1.93,
+#    "ops_per_sec":207.3,"bytes_per_sec":0,"p50_ms":4.102, ...}
+#
+# Workloads (-w, comma separated, all by default):
+#   create  every client creates -c empty files in one shared directory
+#   small   every client writes and reads back -c files of -s bytes, each
+#           in a directory of its own; an op is one write or one read
+#   seq     client 0 writes a file of -m MB in 64 KB writes, then reads it
+#           back; an op is one 64 KB read or write
+#   shared  every client creates and unlinks -c files in one shared
+#           directory while the others do the same, so the directory lock
+#           moves between clients
+#
+# With -d dir1,dir2,... the workloads run in those directories, one per
+# client, and nothing is started. The directories must show the same
+# file system, e.g. the two mounts made by start.sh, or one local
+# directory given twice for a baseline.
+#
+# usage: bench-fs.pl [-n clients] [-l lock servers] [-w workloads]
+#                    [-c count] [-s small file bytes] [-m seq MB]
+#                    [-d dir1,dir2,...]
+
+use strict;
+use Getopt::Std;
+use POSIX ":sys_wait_h";
+use Time::HiRes qw(time sleep);
+use Fcntl;
+
+$| = 1;
+
+my %opts;
+getopts('n:l:w:c:s:m:d:', \%opts)
+  or die "usage: $0 [-n clients] [-l lock servers] [-w workloads] [-c count] [-s bytes] [-m MB] [-d dirs]\n";
+
+my $nclients = $opts{n} || 2;
+my $nls = $opts{l} || 1;
+my @workloads = split(/,/, $opts{w} || "create,small,seq,shared");
+my $count = $opts{c} || 200;
+my $smallsize = defined $opts{s} ? $opts{s} : 4096;
+my $seqmb = $opts{m} || 16;
+my $chunk = 64 * 1024;
+
+my @pids;
+my @mounts;
+my @dirs;
+my $tag = $$;	# names the files of this run; $$ differs in the clients
+
+use sigtrap 'handler' => \&cleanup, 'HUP', 'INT', 'ABRT', 'QUIT', 'TERM';
+
+sub spawn {
+  my ($log, @cmd) = @_;
+  my $pid = fork();
+  die "$0: fork failed\n" unless defined $pid;
+  if ($pid == 0) {
+    open(STDOUT, ">", $log) or die "$0: cannot write $log\n";
+    open(STDERR, ">&STDOUT");
+    exec(@cmd) or die "$0: cannot run @cmd\n";
+  }
+  push(@pids, $pid);
+  return $pid;
+}
+
+sub mounted {
+  my $dir = shift;
+  open(M, "mount |") or return 0;
+  my $found = grep { / on \Q$dir\E / } <M>;
+  close(M);
+  return $found;
+}
+
+sub cleanup {
+  my $umount = "umount";
+  foreach my $d ("/usr/local/bin", "/usr/bin", "/bin") {
+    $umount = "fusermount -u" if -x "$d/fusermount";
+  }
+  foreach my $m (@mounts) {
+    system("$umount $m > /dev/null 2>&1");
+  }
+  kill('TERM', @pids) if @pids;
+  foreach my $p (@pids) {
+    waitpid($p, 0);
+  }
+  @pids = ();
+  @mounts = ();
+  exit(1) if @_;
+}
+
+sub start {
+  my $base = 2000 + int(rand(30000));
+  my $extent_port = $base;
+  my $lock_port = $base + 2;
+
+  if ($nls > 1) {
+    open(C, ">", "config") or die "$0: cannot write config\n";
+    for (my $i = 0; $i < $nls; $i++) {
+      print C $lock_port + 2 * $i, "\n";
+    }
+    close(C);
+  }
+  for (my $i = 0; $i < $nls; $i++) {
+    spawn("bench-lock_server$i.log", "./lock_server", $lock_port,
+	  $lock_port + 2 * $i);
+  }
+  spawn("bench-extent_server.log", "./extent_server", $extent_port);
+
+  my $pwd = `pwd -P`;
+  chomp($pwd);
+  for (my $i = 0; $i < $nclients; $i++) {
+    my $dir = "$pwd/bench$i";
+    mkdir($dir);
+    spawn("bench-yfs_client$i.log", "./yfs_client", $dir, $extent_port,
+	  $lock_port);
+    push(@mounts, $dir);
+  }
+  # wait for the mounts rather than for a fixed time
+  my $deadline = time() + 30;
+  foreach my $dir (@mounts) {
+    while (!mounted($dir)) {
+      if (time() > $deadline) {
+	cleanup();
+	die "$0: $dir did not get mounted\n";
+      }
+      sleep(0.1);
+    }
+  }
+  return @mounts;
+}
+
+sub writefile {
+  my ($path, $data) = @_;
+  sysopen(F, $path, O_WRONLY | O_CREAT | O_TRUNC) or die "$0: cannot create $path: $!\n";
+  defined(syswrite(F, $data)) or die "$0: cannot write $path: $!\n";
+  close(F);
+}
+
+sub readfile {
+  my ($path, $len) = @_;
+  my $data = "";
+  sysopen(F, $path, O_RDONLY) or die "$0: cannot open $path: $!\n";
+  while (length($data) < $len) {
+    my $n = sysread(F, $data, $len - length($data), length($data));
+    die "$0: cannot read $path: $!\n" unless defined $n;
+    last if $n == 0;
+  }
+  close(F);
+  return $data;
+}
+
+# Runs $body->($client, $dir, $lat) in one process per client, or in
+# client 0 only if $one is set. $lat collects the latency of each op in
+# seconds. Returns the latencies of all clients and the elapsed time.
+sub runclients {
+  my ($name, $one, $body) = @_;
+  my @kids;
+  my $n = $one ? 1 : scalar(@dirs);
+  my $t0 = time();
+  for (my $c = 0; $c < $n; $c++) {
+    my $pid = fork();
+    die "$0: fork failed\n" unless defined $pid;
+    if ($pid == 0) {
+      # the servers and mounts belong to the parent
+      @pids = ();
+      @mounts = ();
+      my @lat;
+      $body->($c, $dirs[$c], \@lat);
+      open(L, ">", "bench-$name-$c.lat") or die "$0: cannot write latencies\n";
+      print L join("\n", @lat), "\n";
+      close(L);
+      exit(0);
+    }
+    push(@kids, $pid);
+  }
+  my $failed = 0;
+  foreach my $pid (@kids) {
+    waitpid($pid, 0);
+    $failed = 1 if $? != 0;
+  }
+  my $secs = time() - $t0;
+  die "$0: workload $name failed\n" if $failed;
+
+  my @lat;
+  for (my $c = 0; $c < $n; $c++) {
+    open(L, "<", "bench-$name-$c.lat") or die "$0: no latencies from client $c\n";
+    while (<L>) {
+      chomp;
+      push(@lat, $_) if $_ ne "";
+    }
+    close(L);
+    unlink("bench-$name-$c.lat");
+  }
+  return (\@lat, $secs, $n);
+}
+
+sub timed {
+  my ($lat, $f) = @_;
+  my $t = time();
+  $f->();
+  push(@$lat, time() - $t);
+}
+
+sub percentile {
+  my ($sorted, $p) = @_;
+  return 0 unless @$sorted;
+  my $i = int($p / 100 * scalar(@$sorted) + 0.5) - 1;
+  $i = 0 if $i < 0;
+  $i = $#$sorted if $i > $#$sorted;
+  return $sorted->[$i];
+}
+
+sub report {
+  my ($name, $lat, $secs, $n, $bytes) = @_;
+  my @s = sort { $a <=> $b } @$lat;
+  my $ops = scalar(@s);
+  my $sum = 0;
+  $sum += $_ foreach @s;
+  printf("{\"workload\":\"%s\",\"clients\":%d,\"ops\":%d,\"secs\":%.3f,"
+	 . "\"ops_per_sec\":%.1f,\"bytes_per_sec\":%.0f,\"avg_ms\":%.3f,"
+	 . "\"p50_ms\":%.3f,\"p90_ms\":%.3f,\"p99_ms\":%.3f,\"max_ms\":%.3f}\n",
+	 $name, $n, $ops, $secs, $secs > 0 ? $ops / $secs : 0,
+	 $secs > 0 ? $bytes / $secs : 0, $ops ? 1000 * $sum / $ops : 0,
+	 1000 * percentile(\@s, 50), 1000 * percentile(\@s, 90),
+	 1000 * percentile(\@s, 99), $ops ? 1000 * $s[-1] : 0);
+}
+
+my %bench = (
+  create => sub {
+    my $d = "$dirs[0]/create$tag";
+    mkdir($d) or die "$0: cannot mkdir $d: $!\n";
+    my ($lat, $secs, $n) = runclients("create", 0, sub {
+      my ($c, $dir, $lat) = @_;
+      for (my $i = 0; $i < $count; $i++) {
+	timed($lat, sub { writefile("$dir/create$tag/c$c-$i", ""); });
+      }
+    });
+    report("create", $lat, $secs, $n, 0);
+  },
+
+  small => sub {
+    my $data = "x" x $smallsize;
+    for (my $c = 0; $c < @dirs; $c++) {
+      mkdir("$dirs[0]/small$tag-$c") or die "$0: cannot mkdir: $!\n";
+    }
+    my ($lat, $secs, $n) = runclients("small", 0, sub {
+      my ($c, $dir, $lat) = @_;
+      for (my $i = 0; $i < $count; $i++) {
+	timed($lat, sub { writefile("$dir/small$tag-$c/f$i", $data); });
+      }
+      for (my $i = 0; $i < $count; $i++) {
+	timed($lat, sub {
+	  readfile("$dir/small$tag-$c/f$i", $smallsize) eq $data
+	    or die "$0: small: f$i has the wrong content\n";
+	});
+      }
+    });
+    report("small", $lat, $secs, $n, scalar(@$lat) * $smallsize);
+  },
+
+  seq => sub {
+    my $nchunks = $seqmb * 1024 * 1024 / $chunk;
+    my $data = "s" x $chunk;
+    my ($lat, $secs, $n) = runclients("seq", 1, sub {
+      my ($c, $dir, $lat) = @_;
+      my $path = "$dir/seq$tag";
+      sysopen(F, $path, O_WRONLY | O_CREAT | O_TRUNC) or die "$0: cannot create $path: $!\n";
+      for (my $i = 0; $i < $nchunks; $i++) {
+	timed($lat, sub {
+	  syswrite(F, $data) == $chunk or die "$0: seq: short write: $!\n";
+	});
+      }
+      close(F);
+      sysopen(F, $path, O_RDONLY) or die "$0: cannot open $path: $!\n";
+      for (my $i = 0; $i < $nchunks; $i++) {
+	my $buf;
+	timed($lat, sub {
+	  sysread(F, $buf, $chunk) == $chunk or die "$0: seq: short read: $!\n";
+	});
+      }
+      close(F);
+    });
+    report("seq", $lat, $secs, $n, 2 * $nchunks * $chunk);
+  },
+
+  shared => sub {
+    my $d = "$dirs[0]/shared$tag";
+    mkdir($d) or die "$0: cannot mkdir $d: $!\n";
+    my ($lat, $secs, $n) = runclients("shared", 0, sub {
+      my ($c, $dir, $lat) = @_;
+      for (my $i = 0; $i < $count; $i++) {
+	my $f = "$dir/shared$tag/s$c-$i";
+	timed($lat, sub { writefile($f, ""); });
+	timed($lat, sub { unlink($f) or die "$0: cannot unlink $f: $!\n"; });
+      }
+    });
+    report("shared", $lat, $secs, $n, 0);
+  },
+);
+
+foreach my $w (@workloads) {
+  die "$0: unknown workload $w\n" unless defined $bench{$w};
+}
+
+if (defined $opts{d}) {
+  @dirs = split(/,/, $opts{d});
+} else {
+  @dirs = start();
+}
+
+foreach my $w (@workloads) {
+  $bench{$w}->();
+}
+
+cleanup();
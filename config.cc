@@ -1,9 +1,11 @@
 #include <sstream>
 #include <iostream>
 #include <stdio.h>
+#include <math.h>
 #include "config.h"
 #include "paxos.h"
 #include "handle.h"
+#include "method_thread.h"
 
 // The config module maintains views. As a node joins or leaves a
 // view, the next view will be the same as previous view, except with
@@ -25,10 +27,11 @@
 //
 // The RSM module informs config to add nodes. The config module
 // runs a heartbeater thread that checks in with nodes.  If a node
-// doesn't respond, the config module will invoke Paxos's proposer to
-// remove the node.  Higher layers will learn about this change when a
-// Paxos acceptor accepts the new proposed value through
-// paxos_commit().
+// stops responding for longer than its past answers make plausible
+// (see the failure detector in config.h), the config module will
+// invoke Paxos's proposer to remove the node.  Higher layers will
+// learn about this change when a Paxos acceptor accepts the new
+// proposed value through paxos_commit().
 //
 // To be able to bring other nodes up to date to the latest formed
 // view, each node will have a complete history of all view numbers
@@ -37,6 +40,8 @@
 // all views, the other nodes can bring this re-joined node up to
 // date.
 
+const double config::phimax = 8;
+
 static void *
 heartbeatthread(void *x)
 {
@@ -46,8 +51,13 @@ heartbeatthread(void *x)
 }
 
 config::config(std::string _first, std::string _me, config_view_change *_vc) 
-  : myvid (0), first (_first), me (_me), vc (_vc)
+  : myvid (0), first (_first), me (_me), vc (_vc), leasevid (0),
+    nsuspected (0), nfalse (0), detectsum (0), detectmax (0)
 {
+  leaseend.tv_sec = 0;
+  leaseend.tv_usec = 0;
+  gettimeofday(&started, NULL);
+
   assert (pthread_mutex_init(&cfg_mutex, NULL) == 0);
   assert(pthread_cond_init(&config_cond, NULL) == 0);  
 
@@ -235,31 +245,93 @@ config::remove_wo(std::string m)
   return r;
 }
 
+void
+config::set_leaseholder(std::string m)
+{
+  assert(pthread_mutex_lock(&cfg_mutex)==0);
+  if (m != leaseholder) {
+    leaseholder = m;
+    leasevid = 0;
+  }
+  assert(pthread_mutex_unlock(&cfg_mutex)==0);
+}
+
+bool
+config::haslease()
+{
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  assert(pthread_mutex_lock(&cfg_mutex)==0);
+  bool r = leaseholder == me && leasevid == myvid && timercmp(&now, &leaseend, <);
+  assert(pthread_mutex_unlock(&cfg_mutex)==0);
+  return r;
+}
+
+static double
+ms_between(const struct timeval &a, const struct timeval &b)
+{
+  return (b.tv_sec - a.tv_sec) * 1000.0 + (b.tv_usec - a.tv_usec) / 1000.0;
+}
+
+// caller should hold cfg_mutex
+double
+config::phi(hbstate &s, const struct timeval &now)
+{
+  double silence = ms_between(s.last, now);
+  if (s.intervals.size() < minsamples)
+    return silence >= failms ? phimax : 0;
+  double n = s.intervals.size();
+  double mean = s.sum / n;
+  double var = s.sumsq / n - mean * mean;
+  double sd = var > 0 ? sqrt(var) : 0;
+  if (sd < minstdms)
+    sd = minstdms;
+  // P(interval > silence) for a normal distribution
+  double p = 0.5 * erfc((silence - mean - pausems) / (sd * M_SQRT2));
+  if (p < 1e-300)
+    return 300;
+  return -log10(p);
+}
+
+std::string
+config::hbstats()
+{
+  char buf[256];
+  assert(pthread_mutex_lock(&cfg_mutex)==0);
+  snprintf(buf, sizeof(buf), "suspected %u (false %u), detection avg %.0f "
+	   "ms max %.0f ms", nsuspected, nfalse,
+	   nsuspected ? detectsum / nsuspected : 0.0, detectmax);
+  assert(pthread_mutex_unlock(&cfg_mutex)==0);
+  return buf;
+}
+
 void
 config::heartbeater()
 {
   struct timeval now;
   struct timespec next_timeout;
   std::string m;
-  heartbeat_t h;
   bool stable;
+  unsigned rounds = 0;
 
   assert(pthread_mutex_lock(&cfg_mutex)==0);
   
   while (1) {
 
     gettimeofday(&now, NULL);
-    next_timeout.tv_sec = now.tv_sec + 3;
-    next_timeout.tv_nsec = 0;
-    printf("heartbeater: go to sleep\n");
+    next_timeout.tv_sec = now.tv_sec + (now.tv_usec / 1000 + hbperiod) / 1000;
+    next_timeout.tv_nsec = ((now.tv_usec / 1000 + hbperiod) % 1000) * 1000000;
     pthread_cond_timedwait(&config_cond, &cfg_mutex, &next_timeout);
 
-    stable = true;
-
-    printf("heartbeater: current membership %s\n", print_members(mems).c_str());
+    if (++rounds % 20 == 0) {
+      printf("heartbeater: current membership %s\n", print_members(mems).c_str());
+      assert(pthread_mutex_unlock(&cfg_mutex)==0);
+      printf("heartbeater: %s\n", hbstats().c_str());
+      printf("heartbeater: peers\n%s", mgr.health().c_str());
+      assert(pthread_mutex_lock(&cfg_mutex)==0);
+    }
 
     if (!isamember(me, mems)) {
-      printf("heartbeater: not member yet; skip hearbeat\n");
       continue;
     }
 
@@ -270,21 +342,97 @@ config::heartbeater()
 	m = mems[i];
     }
 
-    if (m == me) {
-      //if i am the one with smallest id, ping the rest of the nodes
+    //if i am the one with smallest id or the lease holder, ping the
+    //rest of the nodes; the rest of the nodes ping the one with
+    //smallest id
+    std::vector<std::string> watch;
+    if (m == me || leaseholder == me) {
       for (unsigned i = 0; i < mems.size(); i++) {
-	if (mems[i] != me) {
-	  if ((h = doheartbeat(mems[i])) != OK) {
-	    stable = false;
-	    m = mems[i];
-	    break;
-	  }
-	}
+	if (mems[i] != me)
+	  watch.push_back(mems[i]);
       }
     } else {
-      //the rest of the nodes ping the one with smallest id
-	if ((h = doheartbeat(m)) != OK) 
-	    stable = false;
+      watch.push_back(m);
+    }
+
+    // forget members we no longer watch; if we watch them again, their
+    // silence in between does not count
+    std::map<std::string, hbstate>::iterator it = hbs.begin();
+    while (it != hbs.end()) {
+      if (isamember(it->first, watch))
+	it++;
+      else
+	hbs.erase(it++);
+    }
+
+    gettimeofday(&now, NULL);
+    for (unsigned i = 0; i < watch.size(); i++) {
+      if (!hbs.count(watch[i])) {
+	hbstate &s = hbs[watch[i]];
+	s.last = now;
+	s.acked.tv_sec = s.acked.tv_usec = 0;
+	s.ackvid = 0;
+	s.inflight = s.viewerr = s.suspected = false;
+	s.sum = s.sumsq = 0;
+      }
+      hbstate &s = hbs[watch[i]];
+      if (!s.inflight) {
+	s.inflight = true;
+	s.sent = now;
+	method_thread(this, true, &config::ping, watch[i], myvid, now);
+      }
+    }
+
+    if (leaseholder == me) {
+      // everybody heard from us after the oldest of their last answered
+      // heartbeats was sent
+      struct timeval oldest = now;
+      bool all = true;
+      for (unsigned i = 0; i < watch.size() && all; i++) {
+	hbstate &s = hbs[watch[i]];
+	if (s.ackvid != myvid)
+	  all = false;
+	else if (timercmp(&s.acked, &oldest, <))
+	  oldest = s.acked;
+      }
+      if (all) {
+	leasevid = myvid;
+	leaseend = oldest;
+	leaseend.tv_sec += leasetime - 1;
+      }
+    }
+
+    stable = true;
+    for (unsigned i = 0; i < watch.size(); i++) {
+      hbstate &s = hbs[watch[i]];
+      double p = phi(s, now);
+      if (s.viewerr || p >= phimax) {
+	if (!s.suspected) {
+	  double silence = ms_between(s.last, now);
+	  s.suspected = true;
+	  nsuspected++;
+	  detectsum += silence;
+	  if (silence > detectmax)
+	    detectmax = silence;
+	  printf("heartbeater: suspect %s, phi %.1f after %.0f ms%s\n",
+		 watch[i].c_str(), p, silence, s.viewerr ? " (view error)" : "");
+	}
+	stable = false;
+	m = watch[i];
+	break;
+      }
+    }
+
+    if (!stable && m == leaseholder) {
+      // we may have acknowledged a heartbeat before a restart
+      struct timeval expiry = lastheard.count(m) ? lastheard[m] : started;
+      expiry.tv_sec += leasetime;
+      gettimeofday(&now, NULL);
+      if (timercmp(&now, &expiry, <)) {
+	printf("heartbeater: lease of %s still holds, not removing it yet\n",
+	       m.c_str());
+	stable = true;
+      }
     }
 
     if (!stable) {
@@ -301,39 +449,79 @@ config::heartbeat(std::string m, unsigned vid, int &r)
   assert(pthread_mutex_lock(&cfg_mutex)==0);
   int ret = paxos_protocol::ERR;
   r = (int) myvid;
-  printf("heartbeat from %s(%d) myvid %d\n", m.c_str(), vid, myvid);
   if (vid == myvid) {
     ret = paxos_protocol::OK;
   } else if (pro->isrunning()) {
     assert (vid == myvid + 1 || vid + 1 == myvid);
     ret = paxos_protocol::OK;
   } else {
+    printf("heartbeat from %s(%d) myvid %d\n", m.c_str(), vid, myvid);
     ret = paxos_protocol::ERR;
   }
+  if (ret == paxos_protocol::OK)
+    gettimeofday(&lastheard[m], NULL);
   assert(pthread_mutex_unlock(&cfg_mutex)==0);
   return ret;
 }
 
+// Runs in its own thread, one per outstanding heartbeat, and feeds the
+// answer to the failure detector.
+void
+config::ping(std::string m, unsigned vid, struct timeval sent)
+{
+  heartbeat_t h = doheartbeat(m, vid);
+  struct timeval now;
+  gettimeofday(&now, NULL);
+
+  assert(pthread_mutex_lock(&cfg_mutex)==0);
+  std::map<std::string, hbstate>::iterator it = hbs.find(m);
+  if (it != hbs.end() && it->second.inflight &&
+      timercmp(&it->second.sent, &sent, ==)) {
+    hbstate &s = it->second;
+    s.inflight = false;
+    if (h == OK) {
+      double d = ms_between(s.last, now);
+      s.last = now;
+      s.acked = sent;
+      s.ackvid = vid;
+      s.intervals.push_back(d);
+      s.sum += d;
+      s.sumsq += d * d;
+      if (s.intervals.size() > window) {
+	d = s.intervals.front();
+	s.intervals.pop_front();
+	s.sum -= d;
+	s.sumsq -= d * d;
+      }
+      if (s.suspected && isamember(m, mems)) {
+	printf("ping: %s answered after it was suspected\n", m.c_str());
+	nfalse++;
+	s.suspected = false;
+      }
+    } else if (h == VIEWERR) {
+      s.viewerr = true;
+    }
+  }
+  assert(pthread_mutex_unlock(&cfg_mutex)==0);
+}
+
 config::heartbeat_t
-config::doheartbeat(std::string m)
+config::doheartbeat(std::string m, unsigned vid)
 {
   int ret = rpc_const::timeout_failure;
-  int r;
-  unsigned vid = myvid;
+  int r = 0;
   heartbeat_t res = OK;
 
-  printf("doheartbeater to %s (%d)\n", m.c_str(), vid);
   handle h(m);
   if (h.get_rpcc()) {
-    assert(pthread_mutex_unlock(&cfg_mutex)==0);
     ret = h.get_rpcc()->call(paxos_protocol::heartbeat, me, vid, r, 
 			 rpcc::to(1000));
-    assert(pthread_mutex_lock(&cfg_mutex)==0);
   } 
   if (ret != paxos_protocol::OK) {
     if (ret == rpc_const::atmostonce_failure || 
 	ret == rpc_const::oldsrv_failure) {
       mgr.delete_handle(m);
+      res = FAILURE;
     } else {
       printf("doheartbeat: problem with %s (%d) my vid %d his vid %d\n", 
 	     m.c_str(), ret, vid, r);
@@ -341,7 +529,5 @@ config::doheartbeat(std::string m)
       else res = VIEWERR;
     }
   }
-  printf("doheartbeat done %d\n", res);
   return res;
 }
-
@@ -3,6 +3,9 @@
 
 #include <string>
 #include <vector>
+#include <map>
+#include <list>
+#include <sys/time.h>
 #include "paxos.h"
 
 class config_view_change {
@@ -24,6 +27,54 @@ class config : public paxos_change {
   pthread_mutex_t cfg_mutex;
   pthread_cond_t heartbeat_cond;
   pthread_cond_t config_cond;
+
+  // Read lease. The lease holder pings every member; a round in which all
+  // members answer gives it a lease for leasetime-1 seconds. A member
+  // does not try to remove the lease holder until leasetime seconds after
+  // it last heard from it, so no view without the lease holder can form
+  // while the lease holds.
+  static const int leasetime = 5;
+  std::string leaseholder;
+  unsigned leasevid;
+  struct timeval leaseend;
+  std::map<std::string, struct timeval> lastheard;
+  struct timeval started;
+
+  // Failure detector (phi accrual). Heartbeats go out every hbperiod ms,
+  // concurrently, one outstanding per member. For each member the
+  // intervals between its answers give a mean and a deviation, and phi =
+  // -log10(probability of an interval as long as the current silence).
+  // A member is suspected once phi exceeds phimax, so a member that
+  // answers irregularly gets more slack than one that answers like
+  // clockwork. The expected interval is padded by pausems so that a
+  // pause of a second (a loaded machine, a long stall) is not taken for a
+  // crash. Until there are minsamples intervals, a member is suspected
+  // after failms of silence.
+  static const int hbperiod = 500;
+  static const int pausems = 1000;
+  static const int failms = 3000;
+  static const int minstdms = 200;
+  static const unsigned window = 100;
+  static const unsigned minsamples = 3;
+  static const double phimax;
+  struct hbstate {
+    struct timeval last;	// last answer, or when we started to watch
+    struct timeval sent;	// the outstanding heartbeat, if inflight
+    struct timeval acked;	// when the last heartbeat answered was sent
+    unsigned ackvid;	// and the view it was sent in
+    bool inflight;
+    bool viewerr;	// answered from another view
+    bool suspected;
+    std::list<double> intervals;	// ms, at most window of them
+    double sum, sumsq;
+  };
+  std::map<std::string, hbstate> hbs;
+  unsigned nsuspected;	// members suspected
+  unsigned nfalse;	// of those, members that answered afterwards
+  double detectsum;	// ms of silence before suspecting, summed
+  double detectmax;
+  double phi(hbstate &s, const struct timeval &now);
+  void ping(std::string m, unsigned vid, struct timeval sent);
   paxos_protocol::status heartbeat(std::string m, unsigned instance, int &r);
   std::string value(std::vector<std::string> mems);
   std::vector<std::string> members(std::string v);
@@ -35,7 +86,7 @@ class config : public paxos_change {
     VIEWERR,	// response but different view #
     FAILURE,	// no response
   } heartbeat_t;
-  heartbeat_t doheartbeat(std::string m);
+  heartbeat_t doheartbeat(std::string m, unsigned vid);
  public:
   config(std::string _first, std::string _me, config_view_change *_vc);
   unsigned vid() { return myvid; }
@@ -51,6 +102,9 @@ class config : public paxos_change {
   void paxos_commit(unsigned instance, std::string v);
   rpcs *get_rpcs() { return acc->get_rpcs(); }
   void breakpoint(int b) { pro->breakpoint(b); }
+  void set_leaseholder(std::string m);
+  bool haslease();
+  std::string hbstats();
 };
 
 #endif
@@ -1,27 +1,38 @@
 // RPC stubs for clients to talk to extent_server
 
 #include "extent_client.h"
+#include "jsl_log.h"
 #include <sstream>
 #include <iostream>
 #include <stdio.h>
 #include <unistd.h>
 #include <time.h>
+#include <assert.h>
 
 // The calls assume that the caller holds a lock on the extent
 
 extent_client::extent_client(std::string dst)
+    : nextInum(0), lastInum(0)
 {
+  pthread_mutex_init(&allocMutex, NULL);
+  pthread_mutex_init(&writebackMutex, NULL);
+  pthread_cond_init(&writebackCond, NULL);
+
   sockaddr_in dstsock;
         make_sockaddr(dst.c_str(), &dstsock);
   cl = new rpcc(dstsock);
   if (cl->bind() != 0) {
     printf("extent_client: bind failed\n");
   }
+
+  pthread_t th;
+  int r = pthread_create(&th, NULL, &writebackthread, (void *) this);
+  assert (r == 0);
 }
 
 extent_protocol::status extent_client::create(extent_protocol::extentid_t id)
 {
-    printf("extent_client::create(id=%lld)\n", id);
+    jsl_log(JSL_DBG_4, "extent_client::create(id=%lld)\n", id);
     pthread_mutex_lock(&localExtents[id].mutex);
 
     if (localExtents[id].existLocally)
@@ -32,21 +43,34 @@ extent_protocol::status extent_client::create(extent_protocol::extentid_t id)
             return extent_protocol::IOERR;
         }
 
-        localExtents[id].buffer = std::string();
+        localExtents[id].data = extent_data();
         localExtents[id].attrs.mtime = localExtents[id].attrs.atime = localExtents[id].attrs.ctime = time(NULL);
         localExtents[id].attrs.size = 0;
-        localExtents[id].isDirty=true;
+        localExtents[id].attrs.nlink = 1;
+        dirtied(id);
         localExtents[id].existLocally=true;
         localExtents[id].isRemote=false;
 
+        // nothing to fetch for a new extent
+        localExtents[id].remoteSize=0;
+        localExtents[id].minSize=0;
+        localExtents[id].loadedChunks.clear();
+        localExtents[id].dirtyChunks.clear();
+
+        // new extent has no directory entries
+        localExtents[id].dirIndex.clear();
+        localExtents[id].dirLog.clear();
+        localExtents[id].hasErase=false;
+        localExtents[id].isIndexed=true;
+
     pthread_mutex_unlock(&localExtents[id].mutex);
 
     return extent_protocol::OK;
 }
 
-extent_protocol::status extent_client::update(extent_protocol::extentid_t id, std::string buf, int offset, int size, int & bytesWritten)
+extent_protocol::status extent_client::update(extent_protocol::extentid_t id, std::string buf, unsigned long long offset, int size, int & bytesWritten)
 {
-    printf("extent_client::update(id=%lld, buf=%s, offset=%d, size=%d)\n", id, buf.c_str(), offset, size);
+    jsl_log(JSL_DBG_4, "extent_client::update(id=%lld, offset=%llu, size=%d)\n", id, offset, size);
 
     pthread_mutex_lock(&localExtents[id].mutex);
         // check if extent exists
@@ -60,15 +84,22 @@ extent_protocol::status extent_client::update(extent_protocol::extentid_t id, st
             }
         }
 
-        // resize string
-        if (offset + size > localExtents[id].buffer.size())
+        // chunks which are only partially overwritten have to be fetched
+        extent_protocol::status ret=loadchunks(id, offset, size, true);
+        if(ret !=extent_protocol::OK)
         {
-            reallocateString(localExtents[id].buffer, offset + size);
-            localExtents[id].attrs.size = offset + size;
+            pthread_mutex_unlock(&localExtents[id].mutex);
+            return ret;
         }
 
-        // update data in the extent
-        localExtents[id].buffer.replace(offset, size, buf);
+        // raw writes replace directory content
+        compactdir(localExtents[id]);
+        localExtents[id].isIndexed=false;
+
+        // update data in the extent, writing past the end leaves a hole
+        localExtents[id].data.write(offset, std::string(buf, 0, size));
+        localExtents[id].attrs.size = localExtents[id].data.size();
+        markdirty(localExtents[id], offset, size);
 
         // setting modification time
         localExtents[id].attrs.mtime = time(NULL);
@@ -76,7 +107,7 @@ extent_protocol::status extent_client::update(extent_protocol::extentid_t id, st
         // return number of actual bytes written
         bytesWritten = size;
 
-        localExtents[id].isDirty=true;
+        dirtied(id);
     pthread_mutex_unlock(&localExtents[id].mutex);
 
     return extent_protocol::OK;
@@ -84,7 +115,7 @@ extent_protocol::status extent_client::update(extent_protocol::extentid_t id, st
 
 extent_protocol::status extent_client::updateAll(extent_protocol::extentid_t id, std::string buf)
 {
-    printf("extent_client::updateAll(id=%lld, buf=%s)\n", id, buf.c_str());
+    jsl_log(JSL_DBG_4, "extent_client::updateAll(id=%lld, size=%u)\n", id, (unsigned) buf.size());
 
     pthread_mutex_lock(&localExtents[id].mutex);
         // check if extent exists
@@ -98,23 +129,30 @@ extent_protocol::status extent_client::updateAll(extent_protocol::extentid_t id,
             }
         }
 
-        // update data in the extent
-        localExtents[id].buffer = buf;
+        // raw writes replace directory content
+        localExtents[id].dirLog.clear();
+        localExtents[id].hasErase=false;
+        localExtents[id].isIndexed=false;
+
+        // update data in the extent, nothing of the old content is needed
+        resize(localExtents[id], 0);
+        localExtents[id].data.assign(buf);
         localExtents[id].attrs.size = buf.size();
+        markdirty(localExtents[id], 0, buf.size());
 
         // setting modification times
         localExtents[id].attrs.mtime = time(NULL);
         localExtents[id].attrs.ctime = time(NULL);
 
-        localExtents[id].isDirty=true;
+        dirtied(id);
     pthread_mutex_unlock(&localExtents[id].mutex);
 
     return extent_protocol::OK;
 }
 
-extent_protocol::status extent_client::retrieve(extent_protocol::extentid_t id, int offset, int size, std::string &buf)
+extent_protocol::status extent_client::retrieve(extent_protocol::extentid_t id, unsigned long long offset, int size, std::string &buf)
 {
-    printf("extent_client::retrieve(id=%lld, offset=%d, size=%d)\n", id, offset, size);
+    jsl_log(JSL_DBG_4, "extent_client::retrieve(id=%lld, offset=%llu, size=%d)\n", id, offset, size);
 
     pthread_mutex_lock(&localExtents[id].mutex);
         // check if extent exists
@@ -143,8 +181,16 @@ extent_protocol::status extent_client::retrieve(extent_protocol::extentid_t id,
             // filled with '\0' at positions beyond the file?
             size = localExtents[id].attrs.size - offset;
 
+        extent_protocol::status ret=loadchunks(id, offset, size, false);
+        if(ret !=extent_protocol::OK)
+        {
+            pthread_mutex_unlock(&localExtents[id].mutex);
+            return ret;
+        }
+        compactdir(localExtents[id]);
+
         // get data from the extent map
-        buf = localExtents[id].buffer.substr(offset, size);
+        localExtents[id].data.read(offset, size, buf);
 
         // update access time (simulate relatime behaviour since this is default for
         // Linux since kernel version 2.6.30)
@@ -160,7 +206,7 @@ extent_protocol::status extent_client::retrieve(extent_protocol::extentid_t id,
 
 extent_protocol::status extent_client::retrieveAll(extent_protocol::extentid_t id, std::string &buf)
 {
-    printf("extent_client::retrieveAll(id=%lld)\n", id);
+    jsl_log(JSL_DBG_4, "extent_client::retrieveAll(id=%lld)\n", id);
 
     pthread_mutex_lock(&localExtents[id].mutex);
         // check if extent exists
@@ -174,7 +220,14 @@ extent_protocol::status extent_client::retrieveAll(extent_protocol::extentid_t i
             }
         }
 
-        buf=localExtents[id].buffer;
+        extent_protocol::status ret=loadchunks(id, 0, localExtents[id].attrs.size, false);
+        if(ret !=extent_protocol::OK)
+        {
+            pthread_mutex_unlock(&localExtents[id].mutex);
+            return ret;
+        }
+        compactdir(localExtents[id]);
+        buf=localExtents[id].data.str();
     pthread_mutex_unlock(&localExtents[id].mutex);
 
     return extent_protocol::OK;
@@ -182,7 +235,7 @@ extent_protocol::status extent_client::retrieveAll(extent_protocol::extentid_t i
 
 extent_protocol::status extent_client::getattr(extent_protocol::extentid_t id, extent_protocol::attr &a)
 {
-    printf("extent_client::getattr(id=%lld)\n", id);
+    jsl_log(JSL_DBG_4, "extent_client::getattr(id=%lld)\n", id);
 
     pthread_mutex_lock(&localExtents[id].mutex);
         // check if extent exists
@@ -199,7 +252,7 @@ extent_protocol::status extent_client::getattr(extent_protocol::extentid_t id, e
         // get attributes for the extent
         a = localExtents[id].attrs;
 
-        printf(" --> a.size=%d\n", a.size);
+        jsl_log(JSL_DBG_4, " --> a.size=%llu\n", a.size);
 
     pthread_mutex_unlock(&localExtents[id].mutex);
     return extent_protocol::OK;
@@ -207,7 +260,7 @@ extent_protocol::status extent_client::getattr(extent_protocol::extentid_t id, e
 
 extent_protocol::status extent_client::setattr(extent_protocol::extentid_t id, extent_protocol::attr a)
 {
-    printf("extent_client::setattr(id=%lld,a.size=%d)\n", id, a.size);
+    jsl_log(JSL_DBG_4, "extent_client::setattr(id=%lld,a.size=%llu)\n", id, a.size);
 
     pthread_mutex_lock(&localExtents[id].mutex);
         // check if extent exists
@@ -221,9 +274,9 @@ extent_protocol::status extent_client::setattr(extent_protocol::extentid_t id, e
             }
         }
 
-        // reallocate data buffer if size have changed
+        // resize data, growing only creates a hole
         if (a.size != localExtents[id].attrs.size)
-            reallocateString(localExtents[id].buffer, a.size);
+            resize(localExtents[id], a.size);
 
         // get attributes for the extent
         localExtents[id].attrs = a;
@@ -231,7 +284,7 @@ extent_protocol::status extent_client::setattr(extent_protocol::extentid_t id, e
         // setting modification time
         localExtents[id].attrs.mtime = time(NULL);
 
-        localExtents[id].isDirty=true;
+        dirtied(id);
 
     pthread_mutex_unlock(&localExtents[id].mutex);
     return extent_protocol::OK;
@@ -239,63 +292,637 @@ extent_protocol::status extent_client::setattr(extent_protocol::extentid_t id, e
 
 extent_protocol::status extent_client::remove(extent_protocol::extentid_t id)
 {
-    printf("extent_client::remove(id=%lld)\n", id);
+    jsl_log(JSL_DBG_4, "extent_client::remove(id=%lld)\n", id);
 
     pthread_mutex_lock(&localExtents[id].mutex);
         localExtents[id].existLocally=true;
         localExtents[id].isRemoved=true;
-        localExtents[id].isDirty=true;
+        dirtied(id);
     pthread_mutex_unlock(&localExtents[id].mutex);
     return extent_protocol::OK;
 }
 
 extent_protocol::status extent_client::fetch(extent_protocol::extentid_t id)
 {
+    // only attributes are fetched, data follows chunk by chunk on access
     extent_protocol::status ret;
-    ret = cl->call(extent_protocol::retrieveAll, id, localExtents[id].buffer);
+    ret = cl->call(extent_protocol::getattr, id, localExtents[id].attrs);
     if (ret!=extent_protocol::OK)
         return ret;
-    ret = cl->call(extent_protocol::getattr, id, localExtents[id].attrs);
-    if (ret==extent_protocol::OK)
+
+    localExtents[id].data = extent_data();
+    localExtents[id].data.resize(localExtents[id].attrs.size);
+    localExtents[id].remoteSize = localExtents[id].attrs.size;
+    localExtents[id].minSize = localExtents[id].attrs.size;
+    localExtents[id].loadedChunks.clear();
+    localExtents[id].dirtyChunks.clear();
+    localExtents[id].isRemote=true;
+    localExtents[id].existLocally=true;
+    localExtents[id].isIndexed=false;
+    return extent_protocol::OK;
+}
+
+extent_protocol::status extent_client::loadchunks(extent_protocol::extentid_t id, unsigned long long offset, unsigned long long size, bool forWrite)
+{
+    extent_t &e = localExtents[id];
+    unsigned long long chunkSize = extent_protocol::chunksize;
+
+    if (size == 0)
+        return extent_protocol::OK;
+
+    std::vector<chunkjob_t> jobs;
+    for (unsigned long long c = offset / chunkSize; c * chunkSize < offset + size; c++)
     {
-        localExtents[id].isRemote=true;
-        localExtents[id].existLocally=true;
+        if (e.loadedChunks.count(c) > 0)
+            continue;
+
+        // server has nothing valid beyond minSize, and chunks overwritten
+        // completely do not need their old content
+        unsigned long long start = c * chunkSize;
+        if (start >= e.minSize || (forWrite && start >= offset && start + chunkSize <= offset + size))
+        {
+            e.loadedChunks.insert(c);
+            continue;
+        }
+
+        chunkjob_t job;
+        job.id = id;
+        job.chunkNo = c;
+        job.isPut = false;
+        jobs.push_back(job);
+    }
+
+    if (jobs.empty())
+        return extent_protocol::OK;
+
+    extent_protocol::status ret = transfer(jobs);
+    if (ret != extent_protocol::OK)
+        return ret;
+
+    for (std::vector<chunkjob_t>::iterator it = jobs.begin(); it != jobs.end(); it++)
+    {
+        unsigned long long start = it->chunkNo * chunkSize;
+        if (start + it->part.size() > e.minSize)
+            it->part.resize(e.minSize - start);
+        e.data.replace(start, it->part);
+        e.loadedChunks.insert(it->chunkNo);
     }
+
+    return extent_protocol::OK;
+}
+
+extent_protocol::status extent_client::transfer(std::vector<chunkjob_t> &jobs)
+{
+    jsl_log(JSL_DBG_4, "extent_client::transfer %u chunks\n", (unsigned) jobs.size());
+
+    chunkqueue_t queue;
+    queue.ec = this;
+    queue.jobs = &jobs;
+    queue.next = 0;
+    queue.trace = trace_current();
+    pthread_mutex_init(&queue.mutex, NULL);
+
+    // the calling thread works on the queue too
+    std::vector<pthread_t> threads;
+    for (unsigned int i = 1; i < maxStreams && i < jobs.size(); i++)
+    {
+        pthread_t th;
+        if (pthread_create(&th, NULL, &chunkthread, (void *) &queue) == 0)
+            threads.push_back(th);
+    }
+    chunkthread((void *) &queue);
+    for (std::vector<pthread_t>::iterator it = threads.begin(); it != threads.end(); it++)
+        pthread_join(*it, NULL);
+
+    pthread_mutex_destroy(&queue.mutex);
+
+    for (std::vector<chunkjob_t>::const_iterator it = jobs.begin(); it != jobs.end(); it++)
+        if (it->ret != extent_protocol::OK)
+            return it->ret;
+    return extent_protocol::OK;
+}
+
+void *extent_client::chunkthread(void *arg)
+{
+    chunkqueue_t *queue = (chunkqueue_t *) arg;
+    // the chunk RPCs belong to the trace of the transfer
+    trace_set(queue->trace);
+
+    while (true)
+    {
+        pthread_mutex_lock(&queue->mutex);
+        if (queue->next == queue->jobs->size())
+        {
+            pthread_mutex_unlock(&queue->mutex);
+            break;
+        }
+        chunkjob_t &job = (*queue->jobs)[queue->next++];
+        pthread_mutex_unlock(&queue->mutex);
+
+        if (job.isPut)
+        {
+            int r;
+            job.ret = queue->ec->cl->call(extent_protocol::putchunk, job.id, job.chunkNo, job.part, r);
+        }
+        else
+            job.ret = queue->ec->cl->call(extent_protocol::getchunk, job.id, job.chunkNo, job.part);
+    }
+
+    return NULL;
+}
+
+void extent_client::markdirty(extent_t &e, unsigned long long offset, unsigned long long size)
+{
+    unsigned long long chunkSize = extent_protocol::chunksize;
+    for (unsigned long long c = offset / chunkSize; c * chunkSize < offset + size; c++)
+        e.dirtyChunks.insert(c);
+}
+
+void extent_client::resize(extent_t &e, unsigned long long newSize)
+{
+    e.data.resize(newSize);
+    if (newSize < e.minSize)
+        e.minSize = newSize;
+}
+
+std::string extent_client::direntry(std::string name, extent_protocol::extentid_t inum)
+{
+    std::ostringstream ost;
+    ost << name << ":" << inum;
+    return ost.str();
+}
+
+extent_protocol::status extent_client::indexdir(extent_protocol::extentid_t id)
+{
+    extent_t &e = localExtents[id];
+    if (e.isIndexed)
+        return extent_protocol::OK;
+
+    extent_protocol::status ret = loadchunks(id, 0, e.data.size(), false);
+    if (ret != extent_protocol::OK)
+        return ret;
+
+    // parse the directory content once per lock tenure
+    e.dirIndex.clear();
+    std::string buf = e.data.str();
+    size_t pos = 0;
+    while (pos < buf.size())
+    {
+        size_t nameEnd = buf.find(':', pos);
+        assert(nameEnd != std::string::npos);
+        size_t inumEnd = buf.find(':', nameEnd + 1);
+        if (inumEnd == std::string::npos)
+            inumEnd = buf.size();
+
+        std::istringstream ist(buf.substr(nameEnd + 1, inumEnd - nameEnd - 1));
+        extent_protocol::extentid_t inum;
+        ist >> inum;
+        e.dirIndex[buf.substr(pos, nameEnd - pos)] = inum;
+
+        pos = inumEnd + 1;
+    }
+    e.isIndexed = true;
+    return extent_protocol::OK;
+}
+
+void extent_client::compactdir(extent_t &e)
+{
+    if (e.dirLog.empty())
+        return;
+
+    jsl_log(JSL_DBG_4, "extent_client::compactdir %u operations, hasErase=%d\n", (unsigned) e.dirLog.size(), e.hasErase);
+
+    if (!e.hasErase)
+    {
+        // only inserts since the last compaction, so just append them
+        for (std::vector<dirop_t>::const_iterator it = e.dirLog.begin(); it != e.dirLog.end(); it++)
+        {
+            std::string entry = direntry(it->name, it->inum);
+            if (e.data.size() > 0)
+                entry = ":" + entry;
+            markdirty(e, e.data.size(), entry.size());
+            e.data.write(e.data.size(), entry);
+        }
+    }
+    else
+    {
+        // entries were erased, write the whole directory from the index
+        std::string dirContent;
+        for (std::map<std::string, extent_protocol::extentid_t>::const_iterator it = e.dirIndex.begin(); it != e.dirIndex.end(); it++)
+        {
+            if (!dirContent.empty())
+                dirContent.append(":");
+            dirContent.append(direntry(it->first, it->second));
+        }
+        resize(e, 0);
+        e.data.assign(dirContent);
+        markdirty(e, 0, dirContent.size());
+    }
+
+    e.attrs.size = e.data.size();
+    e.dirLog.clear();
+    e.hasErase = false;
+}
+
+extent_protocol::status extent_client::dirlookup(extent_protocol::extentid_t id, std::string name, extent_protocol::extentid_t &inum)
+{
+    jsl_log(JSL_DBG_4, "extent_client::dirlookup(id=%lld, name=%s)\n", id, name.c_str());
+
+    pthread_mutex_lock(&localExtents[id].mutex);
+        // check if extent exists
+        if (! localExtents[id].existLocally)
+        {
+            extent_protocol::status ret=fetch(id);
+            if(ret !=extent_protocol::OK)
+            {
+                pthread_mutex_unlock(&localExtents[id].mutex);
+                return ret;
+            }
+        }
+
+        extent_protocol::status ret=indexdir(id);
+        if(ret !=extent_protocol::OK)
+        {
+            pthread_mutex_unlock(&localExtents[id].mutex);
+            return ret;
+        }
+
+        std::map<std::string, extent_protocol::extentid_t>::const_iterator it = localExtents[id].dirIndex.find(name);
+        if (it == localExtents[id].dirIndex.end())
+        {
+            pthread_mutex_unlock(&localExtents[id].mutex);
+            return extent_protocol::NOENT;
+        }
+        inum = it->second;
+
+    pthread_mutex_unlock(&localExtents[id].mutex);
+    return extent_protocol::OK;
+}
+
+extent_protocol::status extent_client::dirinsert(extent_protocol::extentid_t id, std::string name, extent_protocol::extentid_t inum)
+{
+    jsl_log(JSL_DBG_4, "extent_client::dirinsert(id=%lld, name=%s, inum=%lld)\n", id, name.c_str(), inum);
+
+    pthread_mutex_lock(&localExtents[id].mutex);
+        // check if extent exists
+        if (! localExtents[id].existLocally)
+        {
+            extent_protocol::status ret=fetch(id);
+            if(ret !=extent_protocol::OK)
+            {
+                pthread_mutex_unlock(&localExtents[id].mutex);
+                return ret;
+            }
+        }
+
+        extent_protocol::status ret=indexdir(id);
+        if(ret !=extent_protocol::OK)
+        {
+            pthread_mutex_unlock(&localExtents[id].mutex);
+            return ret;
+        }
+
+        if (localExtents[id].dirIndex.count(name) > 0)
+        {
+            pthread_mutex_unlock(&localExtents[id].mutex);
+            return extent_protocol::IOERR;
+        }
+        localExtents[id].dirIndex[name] = inum;
+
+        dirop_t op;
+        op.isInsert = true;
+        op.name = name;
+        op.inum = inum;
+        localExtents[id].dirLog.push_back(op);
+
+        // keep the size equal to the one of the compacted content
+        if (localExtents[id].attrs.size > 0)
+            localExtents[id].attrs.size++;
+        localExtents[id].attrs.size += direntry(name, inum).size();
+
+        // setting modification times
+        localExtents[id].attrs.mtime = time(NULL);
+        localExtents[id].attrs.ctime = time(NULL);
+
+        dirtied(id);
+    pthread_mutex_unlock(&localExtents[id].mutex);
+
+    return extent_protocol::OK;
+}
+
+extent_protocol::status extent_client::direrase(extent_protocol::extentid_t id, std::string name, extent_protocol::extentid_t &inum)
+{
+    jsl_log(JSL_DBG_4, "extent_client::direrase(id=%lld, name=%s)\n", id, name.c_str());
+
+    pthread_mutex_lock(&localExtents[id].mutex);
+        // check if extent exists
+        if (! localExtents[id].existLocally)
+        {
+            extent_protocol::status ret=fetch(id);
+            if(ret !=extent_protocol::OK)
+            {
+                pthread_mutex_unlock(&localExtents[id].mutex);
+                return ret;
+            }
+        }
+
+        extent_protocol::status ret=indexdir(id);
+        if(ret !=extent_protocol::OK)
+        {
+            pthread_mutex_unlock(&localExtents[id].mutex);
+            return ret;
+        }
+
+        std::map<std::string, extent_protocol::extentid_t>::iterator it = localExtents[id].dirIndex.find(name);
+        if (it == localExtents[id].dirIndex.end())
+        {
+            pthread_mutex_unlock(&localExtents[id].mutex);
+            return extent_protocol::NOENT;
+        }
+        inum = it->second;
+        localExtents[id].dirIndex.erase(it);
+
+        dirop_t op;
+        op.isInsert = false;
+        op.name = name;
+        op.inum = inum;
+        localExtents[id].dirLog.push_back(op);
+        localExtents[id].hasErase = true;
+
+        // keep the size equal to the one of the compacted content
+        unsigned int entrySize = direntry(name, inum).size();
+        if (localExtents[id].attrs.size > entrySize)
+            entrySize++;
+        localExtents[id].attrs.size -= entrySize;
+
+        // setting modification times
+        localExtents[id].attrs.mtime = time(NULL);
+        localExtents[id].attrs.ctime = time(NULL);
+
+        dirtied(id);
+    pthread_mutex_unlock(&localExtents[id].mutex);
+
     return extent_protocol::OK;
 }
 
-void extent_client::reallocateString(std::string &str, unsigned newSize)
+extent_protocol::status extent_client::dirlist(extent_protocol::extentid_t id, std::map<std::string, extent_protocol::extentid_t> &entries)
 {
-    printf("extent_client::reallocateString, oldSize=%u, newSize=%u", str.size(), newSize);
-    if (str.size() > newSize)
-        str = std::string(str, 0, newSize);
-    else if (str.size() < newSize)
+    jsl_log(JSL_DBG_4, "extent_client::dirlist(id=%lld)\n", id);
+
+    pthread_mutex_lock(&localExtents[id].mutex);
+        // check if extent exists
+        if (! localExtents[id].existLocally)
+        {
+            extent_protocol::status ret=fetch(id);
+            if(ret !=extent_protocol::OK)
+            {
+                pthread_mutex_unlock(&localExtents[id].mutex);
+                return ret;
+            }
+        }
+
+        extent_protocol::status ret=indexdir(id);
+        if(ret !=extent_protocol::OK)
+        {
+            pthread_mutex_unlock(&localExtents[id].mutex);
+            return ret;
+        }
+        entries = localExtents[id].dirIndex;
+
+    pthread_mutex_unlock(&localExtents[id].mutex);
+    return extent_protocol::OK;
+}
+
+// Writes the changes of the extent to the server and keeps it in the
+// cache, as it is after a fetch. Must be called with the extent's mutex
+// held; removed extents are left to flush.
+extent_protocol::status extent_client::writeback_wo(extent_protocol::extentid_t id, extent_t &e)
+{
+    if (!e.isDirty || e.isRemoved)
+        return extent_protocol::OK;
+
+    int r;
+    extent_protocol::status ret = extent_protocol::OK;
+    compactdir(e);
+    extent_protocol::attr a = e.attrs;
+    if (!e.isRemote)
+        // creates the extent with its final attributes
+        ret = cl->call(extent_protocol::put,id,extent_data(),a,r);
+    else if (e.minSize < e.remoteSize)
+    {
+        // drop stale server data before writing new chunks
+        a.size = e.minSize;
+        ret = cl->call(extent_protocol::setattr,id,a,r);
+    }
+    if (ret != extent_protocol::OK)
+        return ret;
+
+    // stream changed chunks to the server
+    unsigned long long chunkSize = extent_protocol::chunksize;
+    std::vector<chunkjob_t> jobs;
+    for (std::set<unsigned long long>::const_iterator it = e.dirtyChunks.begin(); it != e.dirtyChunks.end(); it++)
     {
-        std::string newStr = std::string(newSize, '\0');
-        newStr.replace(0, str.size(), str);
-        str = newStr;
+        if (*it * chunkSize >= e.data.size())
+            break;
+        chunkjob_t job;
+        job.id = id;
+        job.chunkNo = *it;
+        job.isPut = true;
+        e.data.extract(*it * chunkSize, chunkSize, job.part);
+        jobs.push_back(job);
     }
-    printf(", updatedSize=%u\n", str.size());
+    jsl_log(JSL_DBG_4, "extent_client::writeback(id=%lld) %u chunks\n", id, (unsigned) jobs.size());
+    if (!jobs.empty() && (ret = transfer(jobs)) != extent_protocol::OK)
+        return ret;
+
+    if (e.isRemote && (ret = cl->call(extent_protocol::setattr,id,e.attrs,r)) != extent_protocol::OK)
+        return ret;
+
+    // the server now has the whole content, chunks not loaded yet can be
+    // fetched from it
+    e.isRemote = true;
+    e.remoteSize = e.minSize = e.data.size();
+    e.dirtyChunks.clear();
+    e.isDirty = false;
+    return extent_protocol::OK;
 }
 
 extent_protocol::status extent_client::flush(extent_protocol::extentid_t id)
 {
+    trace_span ts("extent_client::flush %llu", id);
     int r;
     extent_protocol::attr att;
+    extent_protocol::status ret = extent_protocol::OK;
     pthread_mutex_lock(&localExtents[id].mutex);
         if (localExtents[id].isDirty)
         {
-            if (localExtents[id].isRemoved && localExtents[id].isRemote)
-                cl->call(extent_protocol::remove,id,r);
+            if (localExtents[id].isRemoved)
+            {
+                // NOENT: removed by an earlier try whose reply was lost
+                if (localExtents[id].isRemote &&
+                    (ret = cl->call(extent_protocol::remove,id,r)) == extent_protocol::NOENT)
+                    ret = extent_protocol::OK;
+            }
             else
-                cl->call(extent_protocol::put,id,localExtents[id].buffer, localExtents[id].attrs,r);
+                ret = writeback_wo(id, localExtents[id]);
         }
-        localExtents[id].buffer="";
+
+        // the changes did not reach the server, keep them cached and dirty
+        // so that the next flush or write-back sends them again
+        if (ret != extent_protocol::OK)
+        {
+            printf("extent_client::flush(id=%lld): failed to write back\n", id);
+            pthread_mutex_unlock(&localExtents[id].mutex);
+            return ret;
+        }
+
+        localExtents[id].data=extent_data();
+        localExtents[id].loadedChunks.clear();
+        localExtents[id].dirtyChunks.clear();
         localExtents[id].attrs=att;
         localExtents[id].isDirty=false;
         localExtents[id].isRemote=false;
         localExtents[id].isRemoved=false;
         localExtents[id].existLocally=false;
+        localExtents[id].dirIndex.clear();
+        localExtents[id].dirLog.clear();
+        localExtents[id].hasErase=false;
+        localExtents[id].isIndexed=false;
+
+        // nothing left for the background write-back
+        pthread_mutex_lock(&writebackMutex);
+        dirtyExtents.erase(id);
+        writeSoon.erase(id);
+        pthread_mutex_unlock(&writebackMutex);
     pthread_mutex_unlock(&localExtents[id].mutex);
     return extent_protocol::OK;
 }
+
+// Records a change of the extent for the background write-back. Called
+// with the extent's mutex held.
+void extent_client::dirtied(extent_protocol::extentid_t id)
+{
+    dirty_t d;
+    d.e = &localExtents[id];
+    d.e->isDirty = true;
+    clock_gettime(CLOCK_REALTIME, &d.changed);
+
+    pthread_mutex_lock(&writebackMutex);
+        bool wasEmpty = dirtyExtents.empty();
+        dirtyExtents[id] = d;
+    pthread_mutex_unlock(&writebackMutex);
+
+    // the write-back thread sleeps until the first extent gets idle
+    if (wasEmpty)
+        pthread_cond_signal(&writebackCond);
+}
+
+void extent_client::writeback(extent_protocol::extentid_t id)
+{
+    pthread_mutex_lock(&writebackMutex);
+        writeSoon.insert(id);
+    pthread_mutex_unlock(&writebackMutex);
+    pthread_cond_signal(&writebackCond);
+}
+
+void *extent_client::writebackthread(void *arg)
+{
+    extent_client *ec = (extent_client *) arg;
+    ec->writebacker();
+    return NULL;
+}
+
+void extent_client::writebacker()
+{
+    pthread_mutex_lock(&writebackMutex);
+    while (true)
+    {
+        // extents with a revoke pending go first, then those that were
+        // not changed for idleMs
+        struct timespec now, wake;
+        clock_gettime(CLOCK_REALTIME, &now);
+        wake.tv_sec = 0;
+        std::vector<std::pair<extent_protocol::extentid_t, extent_t *> > todo;
+        std::map<extent_protocol::extentid_t, dirty_t>::iterator it;
+        for (it = dirtyExtents.begin(); it != dirtyExtents.end(); )
+        {
+            struct timespec idle = it->second.changed;
+            idle.tv_nsec += (idleMs % 1000) * 1000000;
+            idle.tv_sec += idleMs / 1000 + idle.tv_nsec / 1000000000;
+            idle.tv_nsec %= 1000000000;
+            bool isIdle = idle.tv_sec < now.tv_sec ||
+                (idle.tv_sec == now.tv_sec && idle.tv_nsec <= now.tv_nsec);
+            if (isIdle || writeSoon.count(it->first) > 0)
+            {
+                todo.push_back(std::make_pair(it->first, it->second.e));
+                dirtyExtents.erase(it++);
+                continue;
+            }
+            if (wake.tv_sec == 0 || idle.tv_sec < wake.tv_sec ||
+                (idle.tv_sec == wake.tv_sec && idle.tv_nsec < wake.tv_nsec))
+                wake = idle;
+            it++;
+        }
+        // a revoke for an extent that is clean needs nothing
+        writeSoon.clear();
+
+        if (todo.empty())
+        {
+            if (wake.tv_sec)
+                pthread_cond_timedwait(&writebackCond, &writebackMutex, &wake);
+            else
+                pthread_cond_wait(&writebackCond, &writebackMutex);
+            continue;
+        }
+        pthread_mutex_unlock(&writebackMutex);
+
+        // changes made meanwhile register the extent again and are
+        // written by this write-back or the next one
+        for (unsigned int i = 0; i < todo.size(); i++)
+        {
+            trace_span ts("extent_client::writeback %llu", todo[i].first);
+            pthread_mutex_lock(&todo[i].second->mutex);
+            if (writeback_wo(todo[i].first, *todo[i].second) != extent_protocol::OK)
+                printf("extent_client::writeback(id=%lld): failed, left to flush\n", todo[i].first);
+            pthread_mutex_unlock(&todo[i].second->mutex);
+        }
+
+        pthread_mutex_lock(&writebackMutex);
+    }
+}
+
+extent_protocol::status extent_client::allocate(extent_protocol::extentid_t &id)
+{
+    pthread_mutex_lock(&allocMutex);
+        // lease a new range of inode numbers if the current one is exhausted
+        if (nextInum == lastInum)
+        {
+            extent_protocol::extentid_t first;
+            unsigned int count = extent_protocol::inumlease;
+            extent_protocol::status ret = cl->call(extent_protocol::allocrange, count, first);
+            if (ret != extent_protocol::OK)
+            {
+                pthread_mutex_unlock(&allocMutex);
+                return ret;
+            }
+            nextInum = first;
+            lastInum = first + extent_protocol::inumlease;
+        }
+
+        id = nextInum++;
+    pthread_mutex_unlock(&allocMutex);
+
+    jsl_log(JSL_DBG_4, "extent_client::allocate -> %lld\n", id);
+    return extent_protocol::OK;
+}
+
+extent_protocol::status extent_client::getparent(extent_protocol::extentid_t id, extent_protocol::extentid_t &parent)
+{
+    return cl->call(extent_protocol::getparent, id, parent);
+}
+
+extent_protocol::status extent_client::setparent(extent_protocol::extentid_t id, extent_protocol::extentid_t parent)
+{
+    int r;
+    return cl->call(extent_protocol::setparent, id, parent, r);
+}
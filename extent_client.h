@@ -4,8 +4,13 @@
 #define extent_client_h
 
 #include <string>
+#include <map>
+#include <set>
+#include <vector>
 #include "extent_protocol.h"
+#include "extent_data.h"
 #include "rpc.h"
+#include "trace.h"
 
 
 
@@ -13,8 +18,15 @@ class extent_client {
  private:
   rpcc *cl;
 
+  /// Pending directory operation, applied to the content on compaction
+  struct dirop_t {
+      bool isInsert;
+      std::string name;
+      extent_protocol::extentid_t inum;
+  };
+
   struct extent_t {
-      std::string buffer;
+      extent_data data;
       extent_protocol::attr attrs;
       bool isRemote;
       bool isDirty;
@@ -22,34 +34,135 @@ class extent_client {
       bool isRemoved;
       pthread_mutex_t mutex;
 
+      /// Directory entries by name, built from the content on first use and
+      /// kept up to date by the operations from dirLog
+      std::map<std::string, extent_protocol::extentid_t> dirIndex;
+      bool isIndexed;
+
+      /// Directory operations done since the content was last compacted
+      std::vector<dirop_t> dirLog;
+      bool hasErase;
+
+      /// Chunks present in data, the others are fetched on first access
+      std::set<unsigned long long> loadedChunks;
+      /// Chunks changed since the extent was fetched
+      std::set<unsigned long long> dirtyChunks;
+      /// Size on the server when fetched and the smallest size since then.
+      /// Server content beyond minSize is stale.
+      unsigned long long remoteSize;
+      unsigned long long minSize;
+
       extent_t():
               isRemote(false),
               isDirty(false),
               existLocally(false),
-              isRemoved(false)
+              isRemoved(false),
+              isIndexed(false),
+              hasErase(false),
+              remoteSize(0),
+              minSize(0)
       {
           pthread_mutex_init(&mutex, NULL);
       }
   };
 
   std::map<extent_protocol::extentid_t, extent_t> localExtents; // data blocks
+
+  /// Range of inode numbers leased from the server [nextInum, lastInum)
+  extent_protocol::extentid_t nextInum;
+  extent_protocol::extentid_t lastInum;
+  pthread_mutex_t allocMutex;
+
+  /// Chunk transfer done by one of the streaming threads
+  struct chunkjob_t {
+      extent_protocol::extentid_t id;
+      unsigned long long chunkNo;
+      bool isPut;
+      extent_data part;
+      extent_protocol::status ret;
+  };
+
+  struct chunkqueue_t {
+      extent_client *ec;
+      std::vector<chunkjob_t> *jobs;
+      trace_ctx trace;
+      unsigned int next;
+      pthread_mutex_t mutex;
+  };
+
+  /// Maximal number of chunks transferred in parallel for one extent
+  static const unsigned int maxStreams = 4;
+
+  /// Background write-back: dirty extents are written to the server while
+  /// the lock is still held, once they were not changed for idleMs or as
+  /// soon as a revoke of their lock is pending, so that flush at release
+  /// only has to send what changed since. Extents are kept in the cache.
+  struct dirty_t {
+      extent_t *e;
+      struct timespec changed; // time of the last change
+  };
+  std::map<extent_protocol::extentid_t, dirty_t> dirtyExtents;
+  std::set<extent_protocol::extentid_t> writeSoon;
+  pthread_mutex_t writebackMutex;
+  pthread_cond_t writebackCond;
+  static const unsigned int idleMs = 500;
+  static void *writebackthread(void *arg);
+  void writebacker();
+  void dirtied(extent_protocol::extentid_t id);
+  extent_protocol::status writeback_wo(extent_protocol::extentid_t id, extent_t &e);
+
   extent_protocol::status fetch(extent_protocol::extentid_t id);
-  void reallocateString(std::string &str, unsigned newSize);
+  extent_protocol::status loadchunks(extent_protocol::extentid_t id, unsigned long long offset, unsigned long long size, bool forWrite);
+  extent_protocol::status transfer(std::vector<chunkjob_t> &jobs);
+  static void *chunkthread(void *arg);
+  void markdirty(extent_t &e, unsigned long long offset, unsigned long long size);
+  void resize(extent_t &e, unsigned long long newSize);
+  /* Directory format in the extent content:
+   *   filename1:inum1:filename2:inum2:filename3:inum3...
+   */
+  static std::string direntry(std::string name, extent_protocol::extentid_t inum);
+  extent_protocol::status indexdir(extent_protocol::extentid_t id);
+  void compactdir(extent_t &e);
 
 
  public:
   extent_client(std::string dst);
 
   extent_protocol::status create(extent_protocol::extentid_t id);
-  extent_protocol::status update(extent_protocol::extentid_t id, std::string buf, int offset, int size, int & bytesWritten);
+  extent_protocol::status update(extent_protocol::extentid_t id, std::string buf, unsigned long long offset, int size, int & bytesWritten);
   extent_protocol::status updateAll(extent_protocol::extentid_t id, std::string buf);
-  extent_protocol::status retrieve(extent_protocol::extentid_t id, int offset, int size, std::string &buf);
+  extent_protocol::status retrieve(extent_protocol::extentid_t id, unsigned long long offset, int size, std::string &buf);
   extent_protocol::status retrieveAll(extent_protocol::extentid_t id, std::string &buf);
   extent_protocol::status getattr(extent_protocol::extentid_t id, extent_protocol::attr &a);
   extent_protocol::status setattr(extent_protocol::extentid_t id, extent_protocol::attr a);
   extent_protocol::status remove(extent_protocol::extentid_t id);
 
+  /// Directory operations. Changes are recorded in the per-directory log
+  /// and written into the directory content only on flush, so they do not
+  /// depend on the directory size.
+  extent_protocol::status dirlookup(extent_protocol::extentid_t id, std::string name, extent_protocol::extentid_t &inum);
+  extent_protocol::status dirinsert(extent_protocol::extentid_t id, std::string name, extent_protocol::extentid_t inum);
+  extent_protocol::status direrase(extent_protocol::extentid_t id, std::string name, extent_protocol::extentid_t &inum);
+  extent_protocol::status dirlist(extent_protocol::extentid_t id, std::map<std::string, extent_protocol::extentid_t> &entries);
+
+  /// Writes the extent's changes to the server and drops it from the
+  /// cache. If they could not be written, the extent stays cached and
+  /// dirty and the error is returned.
   extent_protocol::status flush(extent_protocol::extentid_t id);
+
+  /// Asks the background thread to write the extent back now, without
+  /// dropping it from the cache. Returns at once; called when a revoke of
+  /// the extent's lock is pending.
+  void writeback(extent_protocol::extentid_t id);
+
+  /// Returns a fresh inode number. Takes it from the locally leased range and
+  /// asks the server for a new range only when the current one is used up.
+  extent_protocol::status allocate(extent_protocol::extentid_t &id);
+
+  /// Parent of a directory. Not cached: it is read and written on the
+  /// server at once, so it can be read without the directory's lock.
+  extent_protocol::status getparent(extent_protocol::extentid_t id, extent_protocol::extentid_t &parent);
+  extent_protocol::status setparent(extent_protocol::extentid_t id, extent_protocol::extentid_t parent);
 };
 
 #endif 
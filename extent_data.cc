@@ -0,0 +1,191 @@
+// sparse extent content
+
+#include "extent_data.h"
+#include <stdio.h>
+#include <assert.h>
+
+extent_data::extent_data()
+    : m_size(0)
+{
+}
+
+unsigned long long extent_data::allocated() const
+{
+    unsigned long long res = 0;
+    for (std::map<unsigned long long, std::string>::const_iterator it = m_blocks.begin(); it != m_blocks.end(); it++)
+        res += it->second.size();
+    return res;
+}
+
+void extent_data::resize(unsigned long long newSize)
+{
+    if (newSize < m_size)
+    {
+        // drop blocks which are entirely beyond the new end
+        unsigned long long lastBlock = newSize / blocksize;
+        std::map<unsigned long long, std::string>::iterator it = m_blocks.lower_bound(lastBlock + 1);
+        m_blocks.erase(it, m_blocks.end());
+
+        // cut the block containing the new end
+        it = m_blocks.find(lastBlock);
+        if (it != m_blocks.end())
+        {
+            unsigned int keep = newSize % blocksize;
+            if (keep == 0)
+                m_blocks.erase(it);
+            else if (it->second.size() > keep)
+                it->second.resize(keep);
+        }
+    }
+
+    // growing just moves the end, the new part is a hole
+    m_size = newSize;
+}
+
+void extent_data::read(unsigned long long offset, unsigned long long size, std::string &buf) const
+{
+    buf.clear();
+    if (offset >= m_size)
+        return;
+    if (offset + size > m_size)
+        size = m_size - offset;
+
+    buf.assign(size, '\0');
+
+    // copy allocated parts of the blocks overlapping the range
+    std::map<unsigned long long, std::string>::const_iterator it = m_blocks.lower_bound(offset / blocksize);
+    for (; it != m_blocks.end() && it->first * blocksize < offset + size; it++)
+    {
+        unsigned long long blockStart = it->first * blocksize;
+        unsigned long long from = offset > blockStart ? offset : blockStart;
+        unsigned long long to = blockStart + it->second.size();
+        if (to > offset + size)
+            to = offset + size;
+        if (from < to)
+            buf.replace(from - offset, to - from, it->second, from - blockStart, to - from);
+    }
+}
+
+void extent_data::write(unsigned long long offset, const std::string &buf)
+{
+    unsigned long long pos = 0;
+    while (pos < buf.size())
+    {
+        unsigned long long blockNo = (offset + pos) / blocksize;
+        unsigned int blockOffset = (offset + pos) % blocksize;
+        unsigned int n = blocksize - blockOffset;
+        if (n > buf.size() - pos)
+            n = buf.size() - pos;
+
+        std::map<unsigned long long, std::string>::iterator it = m_blocks.find(blockNo);
+        if (it == m_blocks.end())
+        {
+            // writing zeros into a hole keeps it a hole
+            if (buf.find_first_not_of('\0', pos) >= pos + n)
+            {
+                pos += n;
+                continue;
+            }
+            it = m_blocks.insert(std::make_pair(blockNo, std::string())).first;
+        }
+
+        if (it->second.size() < blockOffset + n)
+            it->second.resize(blockOffset + n, '\0');
+        it->second.replace(blockOffset, n, buf, pos, n);
+        pos += n;
+    }
+
+    if (offset + buf.size() > m_size)
+        m_size = offset + buf.size();
+}
+
+void extent_data::assign(const std::string &buf)
+{
+    m_blocks.clear();
+    m_size = 0;
+    write(0, buf);
+}
+
+std::string extent_data::str() const
+{
+    std::string res;
+    read(0, m_size, res);
+    return res;
+}
+
+void extent_data::extract(unsigned long long offset, unsigned long long size, extent_data &part) const
+{
+    assert(offset % blocksize == 0);
+
+    part.m_blocks.clear();
+    part.m_size = 0;
+    if (offset >= m_size)
+        return;
+    if (offset + size > m_size)
+        size = m_size - offset;
+    part.m_size = size;
+
+    // copy blocks of the range, renumbering them from zero
+    unsigned long long first = offset / blocksize;
+    std::map<unsigned long long, std::string>::const_iterator it = m_blocks.lower_bound(first);
+    for (; it != m_blocks.end() && it->first * blocksize < offset + size; it++)
+    {
+        std::string &block = part.m_blocks[it->first - first];
+        block = it->second;
+        if ((it->first - first) * blocksize + block.size() > size)
+            block.resize(size - (it->first - first) * blocksize);
+    }
+}
+
+void extent_data::replace(unsigned long long offset, const extent_data &part)
+{
+    assert(offset % blocksize == 0);
+
+    unsigned long long first = offset / blocksize;
+    unsigned long long full = part.m_size / blocksize;
+    unsigned int rest = part.m_size % blocksize;
+
+    // drop blocks fully covered by part
+    m_blocks.erase(m_blocks.lower_bound(first), m_blocks.lower_bound(first + full));
+
+    // take over blocks of part, the last one may only cover the beginning of
+    // a block which has to keep its tail
+    for (std::map<unsigned long long, std::string>::const_iterator it = part.m_blocks.begin(); it != part.m_blocks.end(); it++)
+    {
+        if (it->first < full)
+            m_blocks[first + it->first] = it->second;
+    }
+    if (rest > 0)
+    {
+        std::map<unsigned long long, std::string>::const_iterator src = part.m_blocks.find(full);
+        std::string head = src != part.m_blocks.end() ? src->second : std::string();
+        head.resize(rest, '\0');
+
+        std::map<unsigned long long, std::string>::iterator dst = m_blocks.find(first + full);
+        if (dst != m_blocks.end())
+        {
+            if (dst->second.size() < rest)
+                dst->second.resize(rest, '\0');
+            dst->second.replace(0, rest, head);
+        }
+        else if (src != part.m_blocks.end())
+            m_blocks[first + full] = head;
+    }
+
+    if (offset + part.m_size > m_size)
+        m_size = offset + part.m_size;
+}
+
+marshall &operator<<(marshall &m, const extent_data &d)
+{
+    m << d.m_size;
+    m << d.m_blocks;
+    return m;
+}
+
+unmarshall &operator>>(unmarshall &u, extent_data &d)
+{
+    u >> d.m_size;
+    u >> d.m_blocks;
+    return u;
+}
@@ -0,0 +1,63 @@
+// sparse extent content shared by extent client and extent server
+
+#ifndef extent_data_h
+#define extent_data_h
+
+#include <string>
+#include <map>
+#include "rpc.h"
+
+// Content of an extent stored as a sorted map of allocated blocks. Blocks
+// which were never written (holes) are not stored and read as zeros, so
+// extending a file or seeking past its end does not allocate memory.
+class extent_data {
+ public:
+    static const unsigned int blocksize = 4096;
+
+    extent_data();
+
+    unsigned long long size() const { return m_size; }
+
+    /// Number of bytes actually allocated for the content
+    unsigned long long allocated() const;
+
+    /// Changes the size. Growing creates a hole, shrinking frees blocks.
+    void resize(unsigned long long newSize);
+
+    /// Reads up to size bytes from offset, holes are returned as zeros.
+    /// Reads beyond the end are clipped.
+    void read(unsigned long long offset, unsigned long long size, std::string &buf) const;
+
+    /// Writes buf at offset, extending the content if needed
+    void write(unsigned long long offset, const std::string &buf);
+
+    /// Replaces the whole content with buf
+    void assign(const std::string &buf);
+
+    /// Returns the whole content with holes filled with zeros
+    std::string str() const;
+
+    /// Copies at most size bytes starting at offset into part. Offset must be
+    /// a multiple of blocksize.
+    void extract(unsigned long long offset, unsigned long long size, extent_data &part) const;
+
+    /// Replaces part.size() bytes starting at offset with part, extending the
+    /// content if needed. Offset must be a multiple of blocksize.
+    void replace(unsigned long long offset, const extent_data &part);
+
+ private:
+    /* Block number -> block data. Data may be shorter than blocksize, the
+     * rest of the block is zero. No block holds data beyond m_size.
+     */
+    std::map<unsigned long long, std::string> m_blocks;
+    unsigned long long m_size;
+
+    friend marshall &operator<<(marshall &m, const extent_data &d);
+    friend unmarshall &operator>>(unmarshall &u, extent_data &d);
+};
+
+// Only allocated blocks are sent over the wire
+marshall &operator<<(marshall &m, const extent_data &d);
+unmarshall &operator>>(unmarshall &u, extent_data &d);
+
+#endif
@@ -19,15 +19,30 @@ class extent_protocol {
     retrieveAll,
     getattr,
     setattr,
-    remove
+    remove,
+    allocrange,
+    getchunk,
+    putchunk,
+    getparent,
+    setparent
   };
-  static const unsigned int maxextent = 8192*1000;
+
+  // file data is moved between client and server in chunks of this size,
+  // which bounds the size of a single RPC independently of the file size
+  static const unsigned int chunksize = 1024*1024;
+
+  // number of inode numbers leased to a client by a single allocrange call
+  static const unsigned int inumlease = 1024;
+
+  // inode numbers with this bit set belong to files, all others to directories
+  static const extentid_t inumtype = 0x8000000000000000ULL;
 
   struct attr {
     unsigned int atime;
     unsigned int mtime;
     unsigned int ctime;
-    unsigned int size;
+    unsigned long long size;
+    unsigned int nlink;
   };
 };
 
@@ -38,6 +53,7 @@ operator>>(unmarshall &u, extent_protocol::attr &a)
   u >> a.mtime;
   u >> a.ctime;
   u >> a.size;
+  u >> a.nlink;
   return u;
 }
 
@@ -48,6 +64,7 @@ operator<<(marshall &m, extent_protocol::attr a)
   m << a.mtime;
   m << a.ctime;
   m << a.size;
+  m << a.nlink;
   return m;
 }
 
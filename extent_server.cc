@@ -1,6 +1,8 @@
 // the extent server implementation
 
 #include "extent_server.h"
+#include "slock.h"
+#include "jsl_log.h"
 #include <sstream>
 #include <stdio.h>
 #include <unistd.h>
@@ -9,7 +11,11 @@
 #include <fcntl.h>
 
 extent_server::extent_server()
+    : m_nextInum(0x00000002)
 {
+    pthread_mutex_init(&m_allocMutex, NULL);
+    pthread_mutex_init(&m_mutex, NULL);
+
     int r;
     if (create(0x00000001, r) != extent_protocol::OK)
     {
@@ -21,7 +27,8 @@ extent_server::extent_server()
 
 int extent_server::create(extent_protocol::extentid_t id, int &)
 {
-    printf("extent_server::create(id=%lld)\n", id);
+    jsl_log(JSL_DBG_4, "extent_server::create(id=%lld)\n", id);
+    ScopedLock ml(&m_mutex);
     
     if (m_dataBlocks.find(id) != m_dataBlocks.end())
         // TODO: what should we do if the extent exists already?
@@ -29,9 +36,9 @@ int extent_server::create(extent_protocol::extentid_t id, int &)
 
     // create structure for the new extent
     extent_t e;
-    e.data = std::string();
     e.attrs.mtime = e.attrs.atime = e.attrs.ctime = time(NULL);
     e.attrs.size = 0;
+    e.attrs.nlink = 1;
 
     // save structure to the extent map
     m_dataBlocks[id] = e;
@@ -39,23 +46,18 @@ int extent_server::create(extent_protocol::extentid_t id, int &)
     return extent_protocol::OK;
 }
 
-int extent_server::update(extent_protocol::extentid_t id, std::string buf, unsigned offset, unsigned size, int & bytesWritten)
+int extent_server::update(extent_protocol::extentid_t id, std::string buf, unsigned long long offset, unsigned size, int & bytesWritten)
 {
-    printf("extent_server::update(id=%lld, buf=%s, offset=%d, size=%d)\n", id, buf.c_str(), offset, size);
+    jsl_log(JSL_DBG_4, "extent_server::update(id=%lld, offset=%llu, size=%u)\n", id, offset, size);
+    ScopedLock ml(&m_mutex);
 
     // check if extent exists
     if (m_dataBlocks.find(id) == m_dataBlocks.end())
         return extent_protocol::NOENT;
 
-    // resize string
-    if (offset + size > m_dataBlocks[id].data.size())
-    {
-        reallocateString(m_dataBlocks[id].data, offset + size);
-        m_dataBlocks[id].attrs.size = offset + size;
-    }
-
-    // update data in the extent
-    m_dataBlocks[id].data.replace(offset, size, buf);
+    // update data in the extent, writing past the end leaves a hole
+    m_dataBlocks[id].data.write(offset, std::string(buf, 0, size));
+    m_dataBlocks[id].attrs.size = m_dataBlocks[id].data.size();
 
     // setting modification time
     m_dataBlocks[id].attrs.mtime = time(NULL);
@@ -68,14 +70,15 @@ int extent_server::update(extent_protocol::extentid_t id, std::string buf, unsig
 
 int extent_server::updateAll(extent_protocol::extentid_t id, std::string buf, int &)
 {
-    printf("extent_server::updateAll(id=%lld, buf=%s)\n", id, buf.c_str());
+    jsl_log(JSL_DBG_4, "extent_server::updateAll(id=%lld, size=%u)\n", id, (unsigned) buf.size());
+    ScopedLock ml(&m_mutex);
 
     // check if extent exists
     if (m_dataBlocks.find(id) == m_dataBlocks.end())
         return extent_protocol::NOENT;
 
     // update data in the extent
-    m_dataBlocks[id].data = buf;
+    m_dataBlocks[id].data.assign(buf);
     m_dataBlocks[id].attrs.size = buf.size();
 
     // setting modification times
@@ -85,9 +88,10 @@ int extent_server::updateAll(extent_protocol::extentid_t id, std::string buf, in
     return extent_protocol::OK;
 }
 
-int extent_server::retrieve(extent_protocol::extentid_t id, unsigned offset, unsigned size, std::string &buf)
+int extent_server::retrieve(extent_protocol::extentid_t id, unsigned long long offset, unsigned size, std::string &buf)
 {
-    printf("extent_server::retrieve(id=%lld, offset=%d, size=%d)\n", id, offset, size);
+    jsl_log(JSL_DBG_4, "extent_server::retrieve(id=%lld, offset=%llu, size=%u)\n", id, offset, size);
+    ScopedLock ml(&m_mutex);
 
     // check if extent exists
     if (m_dataBlocks.find(id) == m_dataBlocks.end())
@@ -105,7 +109,7 @@ int extent_server::retrieve(extent_protocol::extentid_t id, unsigned offset, uns
         size = m_dataBlocks[id].attrs.size - offset;
 
     // get data from the extent map
-    buf = m_dataBlocks[id].data.substr(offset, size);
+    m_dataBlocks[id].data.read(offset, size, buf);
 
     // update access time (simulate relatime behaviour since this is default for
     // Linux since kernel version 2.6.30)
@@ -118,20 +122,24 @@ int extent_server::retrieve(extent_protocol::extentid_t id, unsigned offset, uns
     return extent_protocol::OK;
 }
 
-int extent_server::retrieveAll(extent_protocol::extentid_t id, std::string &buf)
+int extent_server::retrieveAll(extent_protocol::extentid_t id, extent_data &data)
 {
-    printf("extent_server::retrieveAll(id=%lld)\n", id);
+    jsl_log(JSL_DBG_4, "extent_server::retrieveAll(id=%lld)\n", id);
+    ScopedLock ml(&m_mutex);
 
     // check if extent exists
     if (m_dataBlocks.find(id) == m_dataBlocks.end())
         return extent_protocol::NOENT;
 
-    return retrieve(id, 0, m_dataBlocks[id].attrs.size, buf);
+    data = m_dataBlocks[id].data;
+
+    return extent_protocol::OK;
 }
 
 int extent_server::getattr(extent_protocol::extentid_t id, extent_protocol::attr &a)
 {
-    printf("extent_server::getattr(id=%lld)\n", id);
+    jsl_log(JSL_DBG_4, "extent_server::getattr(id=%lld)\n", id);
+    ScopedLock ml(&m_mutex);
 
     // check if extent exists
     if (m_dataBlocks.find(id) == m_dataBlocks.end())
@@ -140,35 +148,34 @@ int extent_server::getattr(extent_protocol::extentid_t id, extent_protocol::attr
     // get attributes for the extent
     a = m_dataBlocks[id].attrs;
 
-    printf(" --> a.size=%d\n", a.size);
+    jsl_log(JSL_DBG_4, " --> a.size=%llu\n", a.size);
 
     return extent_protocol::OK;
 }
 
 int extent_server::setattr(extent_protocol::extentid_t id, extent_protocol::attr a, int &)
 {
-    printf("extent_server::setattr(id=%lld,a.size=%d)\n", id, a.size);
+    jsl_log(JSL_DBG_4, "extent_server::setattr(id=%lld,a.size=%llu)\n", id, a.size);
+    ScopedLock ml(&m_mutex);
 
     // check if extent exists
     if (m_dataBlocks.find(id) == m_dataBlocks.end())
         return extent_protocol::NOENT;
 
-    // reallocate data buffer if size have changed
+    // resize data, growing only creates a hole
     if (a.size != m_dataBlocks[id].attrs.size)
-        reallocateString(m_dataBlocks[id].data, a.size);
+        m_dataBlocks[id].data.resize(a.size);
 
-    // get attributes for the extent
+    // get attributes for the extent, times are maintained by the client
     m_dataBlocks[id].attrs = a;
 
-    // setting modification time
-    m_dataBlocks[id].attrs.mtime = time(NULL);
-
     return extent_protocol::OK;
 }
 
 int extent_server::remove(extent_protocol::extentid_t id, int &)
 {
-    printf("extent_server::remove(id=%lld)\n", id);
+    jsl_log(JSL_DBG_4, "extent_server::remove(id=%lld)\n", id);
+    ScopedLock ml(&m_mutex);
 
     // check if extent exists
     if (m_dataBlocks.find(id) == m_dataBlocks.end())
@@ -176,31 +183,21 @@ int extent_server::remove(extent_protocol::extentid_t id, int &)
 
     // remove it from the extent map
     m_dataBlocks.erase(id);
+    m_parents.erase(id);
 
     return extent_protocol::OK;
 }
 
-void extent_server::reallocateString(std::string &str, unsigned newSize)
+int extent_server::put(extent_protocol::extentid_t id, extent_data data, extent_protocol::attr a, int &)
 {
-    printf("exten_server::reallocateString, oldSize=%u, newSize=%u", str.size(), newSize);
-    if (str.size() > newSize)
-        str = std::string(str, 0, newSize);
-    else if (str.size() < newSize)
-    {
-        std::string newStr = std::string(newSize, '\0');
-        newStr.replace(0, str.size(), str);
-        str = newStr;
-    }
-    printf(", updatedSize=%u\n", str.size());
-}
-
-int extent_server::put(extent_protocol::extentid_t id, std::string buf, extent_protocol::attr a, int &)
-{
-    printf("extent_server::put(id=%lld, buf=%s)\n", id, buf.c_str());
+    jsl_log(JSL_DBG_4, "extent_server::put(id=%lld, size=%llu, allocated=%llu)\n", id, data.size(), data.allocated());
+    ScopedLock ml(&m_mutex);
 
     // update data in the extent
-    m_dataBlocks[id].data = buf;
+    m_dataBlocks[id].data = data;
+    m_dataBlocks[id].data.resize(a.size);
     m_dataBlocks[id].attrs.size = a.size;
+    m_dataBlocks[id].attrs.nlink = a.nlink;
 
     // setting modification times
     m_dataBlocks[id].attrs.mtime = a.mtime;
@@ -209,3 +206,81 @@ int extent_server::put(extent_protocol::extentid_t id, std::string buf, extent_p
 
     return extent_protocol::OK;
 }
+
+int extent_server::getchunk(extent_protocol::extentid_t id, unsigned long long chunkNo, extent_data &part)
+{
+    jsl_log(JSL_DBG_4, "extent_server::getchunk(id=%lld, chunkNo=%llu)\n", id, chunkNo);
+    ScopedLock ml(&m_mutex);
+
+    // check if extent exists
+    if (m_dataBlocks.find(id) == m_dataBlocks.end())
+        return extent_protocol::NOENT;
+
+    unsigned long long chunkSize = extent_protocol::chunksize;
+    m_dataBlocks[id].data.extract(chunkNo * chunkSize, chunkSize, part);
+
+    return extent_protocol::OK;
+}
+
+int extent_server::putchunk(extent_protocol::extentid_t id, unsigned long long chunkNo, extent_data part, int &)
+{
+    jsl_log(JSL_DBG_4, "extent_server::putchunk(id=%lld, chunkNo=%llu, size=%llu)\n", id, chunkNo, part.size());
+    ScopedLock ml(&m_mutex);
+
+    // check if extent exists
+    if (m_dataBlocks.find(id) == m_dataBlocks.end())
+        return extent_protocol::NOENT;
+
+    if (part.size() > extent_protocol::chunksize)
+        return extent_protocol::FBIG;
+
+    // final size comes with setattr after all chunks are written
+    unsigned long long chunkSize = extent_protocol::chunksize;
+    m_dataBlocks[id].data.replace(chunkNo * chunkSize, part);
+    if (m_dataBlocks[id].data.size() > m_dataBlocks[id].attrs.size)
+        m_dataBlocks[id].attrs.size = m_dataBlocks[id].data.size();
+
+    return extent_protocol::OK;
+}
+
+int extent_server::allocrange(unsigned int count, extent_protocol::extentid_t &first)
+{
+    jsl_log(JSL_DBG_4, "extent_server::allocrange(count=%u)\n", count);
+
+    // the top bit is used by yfs_client to tell files from directories
+    pthread_mutex_lock(&m_allocMutex);
+    if (count == 0 || m_nextInum + count > extent_protocol::inumtype)
+    {
+        pthread_mutex_unlock(&m_allocMutex);
+        return extent_protocol::FBIG;
+    }
+
+    first = m_nextInum;
+    m_nextInum += count;
+    pthread_mutex_unlock(&m_allocMutex);
+
+    return extent_protocol::OK;
+}
+
+int extent_server::getparent(extent_protocol::extentid_t id, extent_protocol::extentid_t &parent)
+{
+    jsl_log(JSL_DBG_4, "extent_server::getparent(id=%lld)\n", id);
+    ScopedLock ml(&m_mutex);
+
+    std::map<extent_protocol::extentid_t, extent_protocol::extentid_t>::iterator it = m_parents.find(id);
+    if (it == m_parents.end())
+        return extent_protocol::NOENT;
+
+    parent = it->second;
+    return extent_protocol::OK;
+}
+
+int extent_server::setparent(extent_protocol::extentid_t id, extent_protocol::extentid_t parent, int &)
+{
+    jsl_log(JSL_DBG_4, "extent_server::setparent(id=%lld, parent=%lld)\n", id, parent);
+    ScopedLock ml(&m_mutex);
+
+    // kept apart from the extent, which may exist only in a client cache yet
+    m_parents[id] = parent;
+    return extent_protocol::OK;
+}
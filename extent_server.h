@@ -6,15 +6,21 @@
 #include <string>
 #include <map>
 #include "extent_protocol.h"
+#include "extent_data.h"
 
 struct extent_t {
-    std::string data;
+    extent_data data;
     extent_protocol::attr attrs;
 };
 
 class extent_server {
 
     std::map<extent_protocol::extentid_t, extent_t> m_dataBlocks; // data blocks
+    std::map<extent_protocol::extentid_t, extent_protocol::extentid_t> m_parents; // parent of each directory
+
+    extent_protocol::extentid_t m_nextInum; // first inum not leased to any client yet
+    pthread_mutex_t m_allocMutex; // protects m_nextInum
+    pthread_mutex_t m_mutex; // protects m_dataBlocks, chunks of one extent arrive in parallel
 
  public:
   extent_server();
@@ -23,16 +29,16 @@ class extent_server {
   int create(extent_protocol::extentid_t id, int &);
 
   // update extent content
-  int update(extent_protocol::extentid_t id, std::string buf, unsigned offset, unsigned size, int & bytesWritten);
+  int update(extent_protocol::extentid_t id, std::string buf, unsigned long long offset, unsigned size, int & bytesWritten);
 
   // update full extent content (with resize)
   int updateAll(extent_protocol::extentid_t id, std::string buf, int &);
 
   // get extent content
-  int retrieve(extent_protocol::extentid_t id, unsigned offset, unsigned size, std::string &buf);
+  int retrieve(extent_protocol::extentid_t id, unsigned long long offset, unsigned size, std::string &buf);
 
-  // get full extent content
-  int retrieveAll(extent_protocol::extentid_t id, std::string &buf);
+  // get full extent content, holes are not transferred
+  int retrieveAll(extent_protocol::extentid_t id, extent_data &data);
 
   // get extent attributes
   int getattr(extent_protocol::extentid_t id, extent_protocol::attr &);
@@ -44,10 +50,22 @@ class extent_server {
   int remove(extent_protocol::extentid_t id, int &);
 
   // put extent with attrs to server
-  int put(extent_protocol::extentid_t id, std::string buf, extent_protocol::attr a, int &);
+  int put(extent_protocol::extentid_t id, extent_data data, extent_protocol::attr a, int &);
+
+  // get chunk chunkNo of the extent content
+  int getchunk(extent_protocol::extentid_t id, unsigned long long chunkNo, extent_data &part);
+
+  // replace chunk chunkNo of the extent content
+  int putchunk(extent_protocol::extentid_t id, unsigned long long chunkNo, extent_data part, int &);
+
+  // lease a range of count unused inode numbers starting at first
+  int allocrange(unsigned int count, extent_protocol::extentid_t &first);
+
+  // get the parent of a directory, NOENT for the root
+  int getparent(extent_protocol::extentid_t id, extent_protocol::extentid_t &parent);
 
-private:
-  void reallocateString(std::string &str, unsigned newSize);
+  // set the parent of a directory
+  int setparent(extent_protocol::extentid_t id, extent_protocol::extentid_t parent, int &);
 };
 
 #endif 
@@ -35,6 +35,11 @@ main(int argc, char *argv[])
   server.reg(extent_protocol::setattr, &ls, &extent_server::setattr);
   server.reg(extent_protocol::remove, &ls, &extent_server::remove);
   server.reg(extent_protocol::put, &ls, &extent_server::put);
+  server.reg(extent_protocol::allocrange, &ls, &extent_server::allocrange);
+  server.reg(extent_protocol::getchunk, &ls, &extent_server::getchunk);
+  server.reg(extent_protocol::putchunk, &ls, &extent_server::putchunk);
+  server.reg(extent_protocol::getparent, &ls, &extent_server::getparent);
+  server.reg(extent_protocol::setparent, &ls, &extent_server::setparent);
 
   while(1)
     sleep(1000);
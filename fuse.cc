@@ -17,6 +17,8 @@
 #include <assert.h>
 #include <arpa/inet.h>
 #include "yfs_client.h"
+#include "jsl_log.h"
+#include "trace.h"
 
 int myid;
 yfs_client *yfs;
@@ -36,19 +38,19 @@ getattr(yfs_client::inum inum, struct stat &st)
   yfs->acquire(inum);
 
   st.st_ino = inum;
-  printf("getattr %016llx %d\n", inum, yfs->isfile(inum));
+  jsl_log(JSL_DBG_3, "getattr %016llx %d\n", inum, yfs->isfile(inum));
   if(yfs->isfile(inum)){
      yfs_client::fileinfo info;
      ret = yfs->getfile(inum, info);
      if(ret != yfs_client::OK)
        goto release;
      st.st_mode = S_IFREG | 0666;
-     st.st_nlink = 1;
+     st.st_nlink = info.nlink;
      st.st_atime = info.atime;
      st.st_mtime = info.mtime;
      st.st_ctime = info.ctime;
      st.st_size = info.size;
-     printf("   getattr -> %llu\n", info.size);
+     jsl_log(JSL_DBG_3, "   getattr -> %llu\n", info.size);
    } else {
      yfs_client::dirinfo info;
      ret = yfs->getdir(inum, info);
@@ -59,7 +61,7 @@ getattr(yfs_client::inum inum, struct stat &st)
      st.st_atime = info.atime;
      st.st_mtime = info.mtime;
      st.st_ctime = info.ctime;
-     printf("   getattr -> %lu %lu %lu\n", info.atime, info.mtime, info.ctime);
+     jsl_log(JSL_DBG_3, "   getattr -> %lu %lu %lu\n", info.atime, info.mtime, info.ctime);
    }
 
 release:
@@ -73,6 +75,7 @@ void
 fuseserver_getattr(fuse_req_t req, fuse_ino_t ino,
           struct fuse_file_info *fi)
 {
+    trace_span ts("fuseserver_getattr %lu", (unsigned long) ino);
     struct stat st;
     yfs_client::inum inum = ino; // req->in.h.nodeid;
     yfs_client::status ret;
@@ -88,7 +91,8 @@ fuseserver_getattr(fuse_req_t req, fuse_ino_t ino,
 void
 fuseserver_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi)
 {
-    printf("fuseserver_setattr 0x%x\n", to_set);
+    trace_span ts("fuseserver_setattr %lu", (unsigned long) ino);
+    jsl_log(JSL_DBG_3, "fuseserver_setattr 0x%x\n", to_set);
     if (FUSE_SET_ATTR_SIZE & to_set) {
 
         // Get lock
@@ -119,7 +123,8 @@ void
 fuseserver_read(fuse_req_t req, fuse_ino_t ino, size_t size,
       off_t off, struct fuse_file_info *fi)
 {
-    printf("fuseserver_read(ino=%ld,size=%u,off=%u)\n",ino,size,off);
+    trace_span ts("fuseserver_read %lu", (unsigned long) ino);
+    jsl_log(JSL_DBG_3, "fuseserver_read(ino=%ld,size=%u,off=%u)\n",ino,size,off);
 
     std::string buf;
 
@@ -147,7 +152,8 @@ fuseserver_write(fuse_req_t req, fuse_ino_t ino,
   const char *buf, size_t size, off_t off,
   struct fuse_file_info *fi)
 {
-    printf("fuseserver_write(ino=%ld,buf=%s,size=%u,off=%ld)\n",ino,buf,size,off);
+    trace_span ts("fuseserver_write %lu", (unsigned long) ino);
+    jsl_log(JSL_DBG_3, "fuseserver_write(ino=%ld,size=%u,off=%ld)\n",ino,size,off);
 
     int bytesWritten;
 
@@ -174,7 +180,7 @@ yfs_client::status
 fuseserver_createhelper(fuse_ino_t parent, const char *name,
      mode_t mode, struct fuse_entry_param *e)
 {
-    printf("fuseserver_createhelper(parent=%ld,name=%s,mode=%d,e=?)\n",parent,name,mode);
+    jsl_log(JSL_DBG_3, "fuseserver_createhelper(parent=%ld,name=%s,mode=%d,e=?)\n",parent,name,mode);
 
 
     // Creating 0 response
@@ -185,18 +191,21 @@ fuseserver_createhelper(fuse_ino_t parent, const char *name,
     e->entry_timeout=0.0;
     e->attr_timeout=0.0;
 
-    // Get locks for directory
-    yfs->acquire(parent);
+    // Allocation of unique inum, before locking, so that the directory and the new file are locked in one request
+    yfs_client::inum newInum;
+    ret=yfs->newinum(true, newInum);
+    if (ret!=yfs_client::OK)
+        return ret;
+    jsl_log(JSL_DBG_3, "fuseserver_createhelper(), generated id: %lld\n", newInum);
+
+    // Get locks for directory and new file
+    yfs->acquire(parent, newInum);
 
     yfs_client::inum fileInum=yfs->ilookup(parent, name);
 
     if (fileInum==0)
     {
-        // Generation of 32 bits inum
-        fileInum = random() | 0x80000000;
-        printf("fuseserver_createhelper(), generated id: %lld\n", fileInum);
-
-        yfs->acquire(fileInum);
+        fileInum=newInum;
 
         // Storing file to server
         ret=yfs->create(parent, fileInum, name);
@@ -205,6 +214,8 @@ fuseserver_createhelper(fuse_ino_t parent, const char *name,
     }
     else
     {
+        // File exists, the new inum is not used
+        yfs->release(newInum);
         yfs->acquire(fileInum);
     }
 
@@ -217,7 +228,7 @@ fuseserver_createhelper(fuse_ino_t parent, const char *name,
     e->ino=fileInum;
     e->generation=1;
     e->attr.st_mode = S_IFREG | 0666;
-    e->attr.st_nlink = 1;
+    e->attr.st_nlink = info.nlink;
     e->attr.st_atime = info.atime;
     e->attr.st_mtime = info.mtime;
     e->attr.st_ctime = info.ctime;
@@ -234,6 +245,7 @@ void
 fuseserver_create(fuse_req_t req, fuse_ino_t parent, const char *name,
    mode_t mode, struct fuse_file_info *fi)
 {
+  trace_span ts("fuseserver_create %lu", (unsigned long) parent);
   struct fuse_entry_param e;
   if( fuseserver_createhelper( parent, name, mode, &e ) == yfs_client::OK ) {
     fuse_reply_create(req, &e, fi);
@@ -244,6 +256,7 @@ fuseserver_create(fuse_req_t req, fuse_ino_t parent, const char *name,
 
 void fuseserver_mknod( fuse_req_t req, fuse_ino_t parent,
     const char *name, mode_t mode, dev_t rdev ) {
+  trace_span ts("fuseserver_mknod %lu", (unsigned long) parent);
   struct fuse_entry_param e;
   if( fuseserver_createhelper( parent, name, mode, &e ) == yfs_client::OK ) {
     fuse_reply_entry(req, &e);
@@ -255,7 +268,8 @@ void fuseserver_mknod( fuse_req_t req, fuse_ino_t parent,
 void
 fuseserver_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
-    printf("fuseserver_lookup(req=?,parent=%ld,name=%s)\n",parent,name);
+    trace_span ts("fuseserver_lookup %lu", (unsigned long) parent);
+    jsl_log(JSL_DBG_3, "fuseserver_lookup(req=?,parent=%ld,name=%s)\n",parent,name);
 
     struct fuse_entry_param e;
     bzero(&(e.attr), sizeof(e.attr));
@@ -329,7 +343,8 @@ void
 fuseserver_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
           off_t off, struct fuse_file_info *fi)
 {
-    printf("fuseserver_readdir(req=?,ino=%ld,size=%u,off=%ld,fi=?)\n",ino,size,off);
+    trace_span ts("fuseserver_readdir %lu", (unsigned long) ino);
+    jsl_log(JSL_DBG_3, "fuseserver_readdir(req=?,ino=%ld,size=%u,off=%ld,fi=?)\n",ino,size,off);
 
     yfs_client::inum inum = ino; // req->in.h.nodeid;
     struct dirbuf b;
@@ -370,6 +385,7 @@ void
 fuseserver_open(fuse_req_t req, fuse_ino_t ino,
      struct fuse_file_info *fi)
 {
+    trace_span ts("fuseserver_open %lu", (unsigned long) ino);
     if (yfs->isdir(ino))
         fuse_reply_err(req, EISDIR);
     fuse_reply_open(req, fi);
@@ -379,9 +395,10 @@ void
 fuseserver_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
      mode_t mode)
 {
+    trace_span ts("fuseserver_mkdir %lu", (unsigned long) parent);
     struct fuse_entry_param e;
 
-    printf("fuseserver_mkdir(parent=%ld,name=%s,mode=%d,e=?)\n",parent,name,mode);
+    jsl_log(JSL_DBG_3, "fuseserver_mkdir(parent=%ld,name=%s,mode=%d,e=?)\n",parent,name,mode);
 
     // Creating 0 response
     yfs_client::status r;
@@ -391,13 +408,17 @@ fuseserver_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
     e.entry_timeout=0.0;
     e.attr_timeout=0.0;
 
-    // Generation of 32 bits inum
-    yfs_client::inum dirINum = random() & 0x7fffffff;
-    printf("fuseserver_mkdir(), generated id: %lld\n", dirINum);
+    // Allocation of unique inum
+    yfs_client::inum dirINum;
+    if (yfs->newinum(false, dirINum) != yfs_client::OK)
+    {
+        fuse_reply_err(req, EIO);
+        return;
+    }
+    jsl_log(JSL_DBG_3, "fuseserver_mkdir(), generated id: %lld\n", dirINum);
 
-    // Get locks for directories
-    yfs->acquire(dirINum);
-    yfs->acquire(parent);
+    // Get locks for directories in one request
+    yfs->acquire(dirINum, parent);
 
     // Storing dir to server
     r=yfs->create(parent, dirINum, name);
@@ -437,6 +458,7 @@ fuseserver_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name,
 void
 fuseserver_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
 {
+    trace_span ts("fuseserver_unlink %lu", (unsigned long) parent);
     // Getting lock for directory
     yfs->acquire(parent);
 
@@ -462,12 +484,131 @@ fuseserver_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
         fuse_reply_err(req, 0);
 }
 
+int
+errcode(yfs_client::status res)
+{
+    switch (res)
+    {
+    case yfs_client::OK:
+        return 0;
+    case yfs_client::NOENT:
+        return ENOENT;
+    case yfs_client::EXIST:
+        return EEXIST;
+    case yfs_client::NOTDIR:
+        return ENOTDIR;
+    case yfs_client::NOTEMPTY:
+        return ENOTEMPTY;
+    case yfs_client::ISDIR:
+        return EISDIR;
+    case yfs_client::INVAL:
+        return EINVAL;
+    default:
+        return EIO;
+    }
+}
+
+void
+fuseserver_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    trace_span ts("fuseserver_rmdir %lu", (unsigned long) parent);
+    jsl_log(JSL_DBG_3, "fuseserver_rmdir(parent=%ld,name=%s)\n",parent,name);
+
+    // Getting lock for parent directory
+    yfs->acquire(parent);
+
+    // Getting lock for the directory to remove
+    yfs_client::inum dirInum=yfs->ilookup(parent,name);
+    if (dirInum != 0)
+        yfs->acquire(dirInum);
+
+    // Removing empty directory
+    yfs_client::status res = yfs->rmdir(parent, name);
+
+    // Release locks
+    if (dirInum != 0)
+        yfs->release(dirInum);
+    yfs->release(parent);
+
+    fuse_reply_err(req, errcode(res));
+}
+
+void
+fuseserver_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+     fuse_ino_t newparent, const char *newname)
+{
+    trace_span ts("fuseserver_rename %lu", (unsigned long) parent);
+    jsl_log(JSL_DBG_3, "fuseserver_rename(parent=%ld,name=%s,newparent=%ld,newname=%s)\n",parent,name,newparent,newname);
+
+    // Getting locks for both directories, ordered to avoid deadlocks with other renames
+    yfs->acquire(parent, newparent);
+
+    // Getting lock for the entry which will be replaced, if any. Moved entry itself
+    // is not changed, so it doesn't need to be locked
+    yfs_client::inum oldInum=yfs->ilookup(newparent,newname);
+    if (oldInum != 0)
+        yfs->acquire(oldInum);
+
+    // Moving directory entry
+    yfs_client::status res = yfs->rename(parent, name, newparent, newname);
+
+    // Release locks
+    if (oldInum != 0)
+        yfs->release(oldInum);
+    yfs->release(parent, newparent);
+
+    fuse_reply_err(req, errcode(res));
+}
+
+void
+fuseserver_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent,
+     const char *newname)
+{
+    trace_span ts("fuseserver_link %lu", (unsigned long) ino);
+    jsl_log(JSL_DBG_3, "fuseserver_link(ino=%ld,newparent=%ld,newname=%s)\n",ino,newparent,newname);
+
+    // Hard links to directories are not allowed
+    if (yfs->isdir(ino))
+    {
+        fuse_reply_err(req, EPERM);
+        return;
+    }
+
+    // Getting locks for directory and file
+    yfs->acquire(newparent);
+    yfs->acquire(ino);
+
+    // Adding new name for the file
+    yfs_client::status res = yfs->link(ino, newparent, newname);
+
+    // Release locks
+    yfs->release(ino);
+    yfs->release(newparent);
+
+    if (res != yfs_client::OK)
+    {
+        fuse_reply_err(req, errcode(res));
+        return;
+    }
+
+    struct fuse_entry_param e;
+    bzero(&e, sizeof(e));
+    e.ino = ino;
+    e.generation = 1;
+    if (getattr(ino, e.attr) != yfs_client::OK)
+    {
+        fuse_reply_err(req, EIO);
+        return;
+    }
+    fuse_reply_entry(req, &e);
+}
+
 void
 fuseserver_statfs(fuse_req_t req)
 {
   struct statvfs buf;
 
-  printf("statfs\n");
+  jsl_log(JSL_DBG_3, "statfs\n");
 
   memset(&buf, 0, sizeof(buf));
 
@@ -486,7 +627,7 @@ main(int argc, char *argv[])
   int err = -1;
   int fd;
 
-  setvbuf(stdout, NULL, _IONBF, 0);
+  setvbuf(stdout, NULL, _IOLBF, 0);
 
   if(argc != 4){
     fprintf(stderr, "Usage: yfs_client <mountpoint> <port-extent-server> <port-lock-server>\n");
@@ -512,6 +653,9 @@ main(int argc, char *argv[])
   fuseserver_oper.setattr    = fuseserver_setattr;
   fuseserver_oper.unlink     = fuseserver_unlink;
   fuseserver_oper.mkdir      = fuseserver_mkdir;
+  fuseserver_oper.rmdir      = fuseserver_rmdir;
+  fuseserver_oper.rename     = fuseserver_rename;
+  fuseserver_oper.link       = fuseserver_link;
 
   const char *fuse_argv[20];
   int fuse_argc = 0;
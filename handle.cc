@@ -1,55 +1,180 @@
 #include "handle.h"
+#include "method_thread.h"
 #include <stdio.h>
+#include <sstream>
+
+// handle_mgr caches one bound rpcc per member. Binding takes up to a
+// second when the member is down, so it is done without handle_mutex
+// held: RPCs to other members go ahead, and other threads that want the
+// same member wait for the bind in progress instead of starting their
+// own. A member whose bind failed is down; get_handle fails for it at
+// once, and a background thread binds it again after a backoff that
+// doubles with every failure, up to maxbackoff.
 
 handle_mgr mgr;
 
-handle::handle(std::string m) 
+handle::handle(std::string m)
 {
   h = mgr.get_handle(m);
 }
 
-handle::~handle() 
+handle::~handle()
 {
   if (h != 0) mgr.done_handle(h);
 }
 
 handle_mgr::handle_mgr()
+  : reconnecting (false)
 {
   assert (pthread_mutex_init(&handle_mutex, NULL) == 0);
+  assert (pthread_cond_init(&bind_cond, NULL) == 0);
+  assert (pthread_cond_init(&retry_cond, NULL) == 0);
 }
 
 struct hinfo *
 handle_mgr::get_handle(std::string m)
 {
-  int ret;
-  assert(pthread_mutex_lock(&handle_mutex)==0);
-  rpcc *cl = 0;
   struct hinfo *h = 0;
-  if (hmap.find(m) == hmap.end()) {
-    sockaddr_in dstsock;
-    make_sockaddr(m.c_str(), &dstsock);
-    cl = new rpcc(dstsock);
-    printf("paxos::get_handle trying to bind...%s\n", m.c_str());
-    ret = cl->bind(rpcc::to(1000));
-    if (ret < 0) {
-      printf("handle_mgr::get_handle bind failure! %s %d\n", m.c_str(), ret);
-    } else {
-      printf("handle_mgr::get_handle bind succeeded %s\n", m.c_str());
-      hmap[m].cl = cl;
-      hmap[m].refcnt = 1;
-      hmap[m].del = false;
-      hmap[m].m = m;
+  struct timeval now;
+  assert(pthread_mutex_lock(&handle_mutex)==0);
+  while (1) {
+    if (hmap.find(m) == hmap.end()) {
       h = &hmap[m];
+      h->cl = 0;
+      h->refcnt = 0;
+      h->del = false;
+      h->m = m;
+      h->binding = false;
+      h->backoff = 0;
+      timerclear(&h->nextbind);
+      gettimeofday(&h->since, NULL);
+      h->nbinds = 0;
+      h->nfails = 0;
+    }
+    h = &hmap[m];
+    if (h->del) {
+      h = 0;
+      break;
+    }
+    if (h->cl) {
+      h->refcnt++;
+      break;
+    }
+    if (h->binding) {
+      // a member already down does not hold up callers while it retries
+      if (h->nfails) {
+	h = 0;
+	break;
+      }
+      assert(pthread_cond_wait(&bind_cond, &handle_mutex) == 0);
+      continue;
+    }
+    gettimeofday(&now, NULL);
+    if (timercmp(&now, &h->nextbind, <)) {
+      // down; the reconnect thread will try again
+      h = 0;
+      break;
+    }
+    if (!bind_wo(h)) {
+      h = 0;
+      break;
     }
-  } else if (!hmap[m].del) {
-      hmap[m].refcnt++;
-      h = &hmap[m];
   }
   assert(pthread_mutex_unlock(&handle_mutex)==0);
   return h;
 }
 
-void 
+// Binds h with handle_mutex released. Returns false if h was deleted
+// in the meantime, in which case it is gone.
+bool
+handle_mgr::bind_wo(struct hinfo *h)
+{
+  std::string m = h->m;
+  sockaddr_in dstsock;
+  int ret;
+
+  h->binding = true;
+  assert(pthread_mutex_unlock(&handle_mutex)==0);
+  make_sockaddr(m.c_str(), &dstsock);
+  rpcc *cl = new rpcc(dstsock);
+  printf("paxos::get_handle trying to bind...%s\n", m.c_str());
+  ret = cl->bind(rpcc::to(1000));
+  assert(pthread_mutex_lock(&handle_mutex)==0);
+
+  h->binding = false;
+  assert(pthread_cond_broadcast(&bind_cond) == 0);
+  if (h->del) {
+    delete cl;
+    hmap.erase(m);
+    return false;
+  }
+  gettimeofday(&h->nextbind, NULL);
+  if (ret < 0) {
+    delete cl;
+    h->backoff = h->backoff ? h->backoff * 2 : minbackoff;
+    if (h->backoff > maxbackoff)
+      h->backoff = maxbackoff;
+    if (h->nfails++ == 0)
+      h->since = h->nextbind;
+    h->nextbind.tv_sec += h->backoff / 1000;
+    h->nextbind.tv_usec += (h->backoff % 1000) * 1000;
+    if (h->nextbind.tv_usec >= 1000000) {
+      h->nextbind.tv_sec++;
+      h->nextbind.tv_usec -= 1000000;
+    }
+    printf("handle_mgr::get_handle bind failure! %s %d, retry in %u ms\n",
+	   m.c_str(), ret, h->backoff);
+    if (!reconnecting) {
+      reconnecting = true;
+      method_thread(this, true, &handle_mgr::reconnector);
+    }
+    assert(pthread_cond_signal(&retry_cond) == 0);
+  } else {
+    printf("handle_mgr::get_handle bind succeeded %s\n", m.c_str());
+    h->cl = cl;
+    h->since = h->nextbind;
+    h->backoff = 0;
+    h->nbinds++;
+    h->nfails = 0;
+  }
+  return true;
+}
+
+// Binds the members that are down once their backoff runs out. Exits
+// when no member is down.
+void
+handle_mgr::reconnector()
+{
+  struct timeval now;
+  struct timespec ts;
+
+  assert(pthread_mutex_lock(&handle_mutex)==0);
+  while (1) {
+    struct hinfo *next = 0;
+    std::map<std::string, struct hinfo>::iterator it;
+    for (it = hmap.begin(); it != hmap.end(); it++) {
+      struct hinfo *h = &it->second;
+      if (h->cl || h->del || h->binding)
+	continue;
+      if (!next || timercmp(&h->nextbind, &next->nextbind, <))
+	next = h;
+    }
+    if (!next)
+      break;
+    gettimeofday(&now, NULL);
+    if (timercmp(&now, &next->nextbind, <)) {
+      ts.tv_sec = next->nextbind.tv_sec;
+      ts.tv_nsec = next->nextbind.tv_usec * 1000;
+      pthread_cond_timedwait(&retry_cond, &handle_mutex, &ts);
+      continue;
+    }
+    bind_wo(next);
+  }
+  reconnecting = false;
+  assert(pthread_mutex_unlock(&handle_mutex)==0);
+}
+
+void
 handle_mgr::done_handle(struct hinfo *h)
 {
   assert(pthread_mutex_lock(&handle_mutex)==0);
@@ -76,12 +201,41 @@ handle_mgr::delete_handle_wo(std::string m)
   } else {
     printf("handle_mgr::delete_handle_wo: cl %s refcnt %d\n", m.c_str(),
 	   hmap[m].refcnt);
-    if (hmap[m].refcnt == 0) {
-      hmap[m].cl->cancel();
-      delete hmap[m].cl;
+    if (hmap[m].refcnt == 0 && !hmap[m].binding) {
+      if (hmap[m].cl) {
+	hmap[m].cl->cancel();
+	delete hmap[m].cl;
+      }
       hmap.erase(m);
     } else {
+      // the last done_handle, or the bind in progress, removes it
       hmap[m].del = true;
     }
   }
 }
+
+// One line per member: up or down, for how long, and the binds so far.
+std::string
+handle_mgr::health()
+{
+  std::ostringstream ost;
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  assert(pthread_mutex_lock(&handle_mutex)==0);
+  std::map<std::string, struct hinfo>::iterator it;
+  for (it = hmap.begin(); it != hmap.end(); it++) {
+    struct hinfo *h = &it->second;
+    long ms = (now.tv_sec - h->since.tv_sec) * 1000 +
+      (now.tv_usec - h->since.tv_usec) / 1000;
+    ost << h->m << " ";
+    if (h->cl)
+      ost << "up " << ms << " ms, refs " << h->refcnt;
+    else if (h->binding && h->nfails == 0)
+      ost << "binding";
+    else
+      ost << "down " << ms << " ms, " << h->nfails << " failed binds";
+    ost << ", " << h->nbinds << " binds\n";
+  }
+  assert(pthread_mutex_unlock(&handle_mutex)==0);
+  return ost.str();
+}
@@ -3,13 +3,24 @@
 
 #include <string>
 #include <vector>
+#include <sys/time.h>
 #include "rpc.h"
 
 struct hinfo {
-  rpcc *cl;
+  rpcc *cl;		// 0 until bound
   int refcnt;
   bool del;
   std::string m;
+
+  // Connection state. Only one thread binds a member at a time; after a
+  // failed bind the member is down and get_handle fails right away until
+  // nextbind, while a background thread retries with exponential backoff.
+  bool binding;
+  unsigned backoff;	// ms to wait after the last failed bind
+  struct timeval nextbind;
+  struct timeval since;	// last change between up and down
+  unsigned nbinds;	// successful binds
+  unsigned nfails;	// failed binds since the last successful one
 };
 
 class handle {
@@ -24,13 +35,22 @@ class handle {
 class handle_mgr {
  private:
   pthread_mutex_t handle_mutex;
+  pthread_cond_t bind_cond;	// a bind finished
+  pthread_cond_t retry_cond;	// a member went down
+  bool reconnecting;		// the reconnect thread runs
   std::map<std::string, struct hinfo> hmap;
+
+  static const unsigned minbackoff = 250;
+  static const unsigned maxbackoff = 4000;
+  bool bind_wo(struct hinfo *h);
  public:
   handle_mgr();
   struct hinfo *get_handle(std::string m);
   void done_handle(struct hinfo *h);
   void delete_handle(std::string m);
   void delete_handle_wo(std::string m);
+  void reconnector();
+  std::string health();
 };
 
 extern class handle_mgr mgr;
@@ -1,11 +1,15 @@
 // RPC stubs for clients to talk to lock_server, and cache the locks
 // see lock_client.cache.h for protocol details.
 
+#include <algorithm> // before rpc.h, whose max macro breaks it
 #include "lock_client_cache.h"
 #include "rpc.h"
+#include "trace.h"
+#include "jsl_log.h"
 #include <sstream>
 #include <iostream>
 #include <stdio.h>
+#include <unistd.h>
 
 
 static void *
@@ -20,13 +24,21 @@ int lock_client_cache::last_port = 0;
 
 lock_client_cache::lock_client_cache(std::string xdst, 
 				     class lock_release_user *_lu)
-  : lock_client(xdst), lu(_lu)
+  : lock_client(xdst), lu(_lu), nServerAcquires(0), nRetries(0), nRevokes(0)
 {
+  // Lock server is replicated, requests go through its primary
+  rsmc = new rsm_client(xdst);
+
   // Seek random generator of first client to 1, all other to random value
   srand(time(NULL)^last_port);
 
-  // Generating random port number to listen revoke and retry rpc from server
-  rlock_port = ((rand()%32000) | (0x1 << 10));
+  // Generating random port number to listen revoke and retry rpc from server.
+  // Further clients in the same process take the next ports, so that a
+  // process with many clients does not pick the same port twice
+  if (last_port == 0)
+    rlock_port = ((rand()%32000) | (0x1 << 10));
+  else
+    rlock_port = last_port + 1 < 65536 ? last_port + 1 : (0x1 << 10);
   const char *hname;
   // assert(gethostname(hname, 100) == 0);
   hname = "127.0.0.1";
@@ -64,11 +76,22 @@ lock_client_cache::~lock_client_cache()
     for (std::map<lock_protocol::lockid_t,client_lock_t>::iterator it=localLocks.begin();it!=localLocks.end();it++)
         if ((*it).second.status()==client_lock_t::FREE)
         {
-            lu->dorelease((*it).first);
-            cl->call(lock_protocol::release, cl->id(), (*it).first, r);
+            // the server must not give the lock away with the changes lost
+            if (lu && lu->dorelease((*it).first)!=lock_protocol::OK)
+                continue;
+            rsmc->call(lock_protocol::release, cl->id(), (*it).first, r);
         }
 }
 
+lock_protocol::status
+lock_client_cache::stat(lock_protocol::lockid_t lid)
+{
+    int r;
+    lock_protocol::status ret = rsmc->call(lock_protocol::stat, cl->id(), lid, r);
+    assert (ret == lock_protocol::OK);
+    return r;
+}
+
 void
 lock_client_cache::releaser()
 {
@@ -102,8 +125,13 @@ lock_client_cache::releaser()
             // If it is FREE, we release it on server
             if (acqRes==client_lock_t::FREE)
             {
-                lu->dorelease(lid);
-                lock_protocol::status rs=cl->call(lock_protocol::release, cl->id(), lid, r);
+                trace_span ts("lock_client_cache::releaser %llu", lid);
+                // The lock is not released if the user could not write back its changes
+                lock_protocol::status rs=lock_protocol::OK;
+                if (lu)
+                    rs=lu->dorelease(lid);
+                if (rs==lock_protocol::OK)
+                    rs=rsmc->call(lock_protocol::release, cl->id(), lid, r);
 
                 // If release on server succeds, we change status of lock to NONE
                 if (rs==lock_protocol::OK)
@@ -119,6 +147,9 @@ lock_client_cache::releaser()
                         pthread_mutex_lock(&mutexRevokeList);
                             revokeList.push_back(lid);
                         pthread_mutex_unlock(&mutexRevokeList);
+
+                        // Not spinning while the servers keep failing
+                        usleep(100000);
                 }
             }
     }
@@ -128,7 +159,8 @@ lock_client_cache::releaser()
 lock_protocol::status
 lock_client_cache::acquire(lock_protocol::lockid_t lid)
 {
-    printf("lock_client_cache::acquire(%llu)\n", lid);
+    jsl_log(JSL_DBG_4, "lock_client_cache::acquire(%llu)\n", lid);
+    trace_span ts("lock_client_cache::acquire %llu", lid);
     // If lock was FREE, we can simply use it
     if(localLocks[lid].acquire()==client_lock_t::FREE)
         return lock_protocol::OK;
@@ -144,17 +176,22 @@ lock_client_cache::acquire(lock_protocol::lockid_t lid)
         pthread_mutex_unlock(&mutexRetryMap);
 
         // Request to server
-        lock_protocol::status as=cl->call(lock_protocol::acquire, cl->id(), lid, id, r);
+        __sync_fetch_and_add(&nServerAcquires, 1);
+        lock_protocol::status as=rsmc->call(lock_protocol::acquire, cl->id(), lid, id, r);
 
         // If answer is RETRY, we retry to request it after we receive retry rpc, or immediately, if we received it
         while (as==lock_protocol::RETRY)
         {
+            trace_span tw("lock_client_cache::acquire wait retry %llu", lid);
             pthread_mutex_lock(&mutexRetryMap);
             while (!retryMap[lid])
                 pthread_cond_wait(&okToRetry, &mutexRetryMap);
             retryMap[lid]=false;
-            as=cl->call(lock_protocol::acquire, cl->id(), lid, id, r);
             pthread_mutex_unlock(&mutexRetryMap);
+
+            // Not holding mutexRetryMap during the call, retry RPCs for other locks should not wait for it
+            __sync_fetch_and_add(&nServerAcquires, 1);
+            as=rsmc->call(lock_protocol::acquire, cl->id(), lid, id, r);
         }
 
         // If we received OK, so we have lock, change its status to LOCKED, and use it
@@ -169,10 +206,150 @@ lock_client_cache::acquire(lock_protocol::lockid_t lid)
     }
 }
 
+lock_protocol::status
+lock_client_cache::acquire(lock_protocol::lockid_t lid1, lock_protocol::lockid_t lid2)
+{
+    std::vector<lock_protocol::lockid_t> lids;
+    lids.push_back(lid1);
+    lids.push_back(lid2);
+    return acquire(lids);
+}
+
+lock_protocol::status
+lock_client_cache::acquire(std::vector<lock_protocol::lockid_t> lids)
+{
+    // Canonical order, each lock once
+    std::sort(lids.begin(), lids.end());
+    lids.erase(std::unique(lids.begin(), lids.end()), lids.end());
+    if (lids.size()==1)
+        return acquire(lids[0]);
+
+    jsl_log(JSL_DBG_4, "lock_client_cache::acquire(%u locks from %llu)\n", (unsigned) lids.size(), lids[0]);
+    trace_span ts("lock_client_cache::acquire %u locks from %llu", (unsigned) lids.size(), lids[0]);
+
+    // Locks of the set that this thread acquires from server, their status is ACQUIRING
+    std::vector<lock_protocol::lockid_t> need;
+
+    while (true)
+    {
+        // Take the locks cached on this client and set the others to ACQUIRING, without waiting. If another thread
+        // has one of them, we give back all we took and wait for that one, so we never wait holding a lock of the set
+        std::vector<lock_protocol::lockid_t> cached;
+        lock_protocol::lockid_t busy=0;
+        bool isBusy=false;
+        for (unsigned int i=0;i<lids.size() && !isBusy;i++)
+        {
+            if (std::find(need.begin(), need.end(), lids[i])!=need.end())
+                continue;
+            int st=localLocks[lids[i]].tryacquire();
+            if (st==client_lock_t::FREE)
+                cached.push_back(lids[i]);
+            else if (st==client_lock_t::NONE)
+                need.push_back(lids[i]);
+            else
+            {
+                busy=lids[i];
+                isBusy=true;
+            }
+        }
+
+        if (isBusy)
+        {
+            for (unsigned int i=0;i<cached.size();i++)
+                release(cached[i]);
+            for (unsigned int i=0;i<need.size();i++)
+                localLocks[need[i]].released();
+            need.clear();
+            localLocks[busy].wait();
+            continue;
+        }
+
+        if (need.empty())
+            return lock_protocol::OK;
+
+        // One request for all locks we don't have. If retry RPC will be delivered earlier as RETRY answer, we just
+        // use the flag and don't wait
+        int r;
+        std::sort(need.begin(), need.end());
+        pthread_mutex_lock(&mutexRetryMap);
+        for (unsigned int i=0;i<need.size();i++)
+            retryMap[need[i]]=false;
+        pthread_mutex_unlock(&mutexRetryMap);
+
+        __sync_fetch_and_add(&nServerAcquires, 1);
+        lock_protocol::status as=rsmc->call(lock_protocol::acquiremany, cl->id(), need, id, r);
+        if (as==lock_protocol::OK)
+        {
+            for (unsigned int i=0;i<need.size();i++)
+                localLocks[need[i]].locked();
+            return lock_protocol::OK;
+        }
+
+        // Give the cached locks back while we wait, another client may have asked for them
+        for (unsigned int i=0;i<cached.size();i++)
+            release(cached[i]);
+
+        // Else was some ERROR
+        if (as!=lock_protocol::RETRY)
+        {
+            for (unsigned int i=0;i<need.size();i++)
+                localLocks[need[i]].released();
+            return as;
+        }
+
+        // Server sends retry for one of the locks, the first one it found held
+        trace_span tw("lock_client_cache::acquire wait retry %u locks", (unsigned) need.size());
+        pthread_mutex_lock(&mutexRetryMap);
+        while (true)
+        {
+            bool retry=false;
+            for (unsigned int i=0;i<need.size();i++)
+                if (retryMap[need[i]])
+                    retry=true;
+            if (retry)
+                break;
+            pthread_cond_wait(&okToRetry, &mutexRetryMap);
+        }
+        pthread_mutex_unlock(&mutexRetryMap);
+    }
+}
+
+lock_protocol::status
+lock_client_cache::release(lock_protocol::lockid_t lid1, lock_protocol::lockid_t lid2)
+{
+    // Release in reverse order of acquiring
+    if (lid1 > lid2)
+        std::swap(lid1, lid2);
+
+    lock_protocol::status rs=lock_protocol::OK;
+    if (lid1!=lid2)
+        rs=release(lid2);
+
+    lock_protocol::status rs1=release(lid1);
+    return rs!=lock_protocol::OK ? rs : rs1;
+}
+
+lock_protocol::status
+lock_client_cache::release(std::vector<lock_protocol::lockid_t> lids)
+{
+    // Release in reverse order of acquiring
+    std::sort(lids.begin(), lids.end());
+    lids.erase(std::unique(lids.begin(), lids.end()), lids.end());
+
+    lock_protocol::status rs=lock_protocol::OK;
+    for (unsigned int i=lids.size();i>0;i--)
+    {
+        lock_protocol::status rs1=release(lids[i-1]);
+        if (rs==lock_protocol::OK)
+            rs=rs1;
+    }
+    return rs;
+}
+
 lock_protocol::status
 lock_client_cache::release(lock_protocol::lockid_t lid)
 {
-    printf("lock_client_cache::release(%llu)\n", lid);
+    jsl_log(JSL_DBG_4, "lock_client_cache::release(%llu)\n", lid);
     lock_protocol::status rs;
     bool toRevoke=false;
 
@@ -193,9 +370,12 @@ lock_client_cache::release(lock_protocol::lockid_t lid)
     {
         int r;
 
-        lu->dorelease(lid);
-        // Call release to server
-        rs=cl->call(lock_protocol::release, cl->id(), lid, r);
+        // Call release to server, only once the user has written back its changes
+        rs=lock_protocol::OK;
+        if (lu)
+            rs=lu->dorelease(lid);
+        if (rs==lock_protocol::OK)
+            rs=rsmc->call(lock_protocol::release, cl->id(), lid, r);
 
         // If server released it properly, we change it local status to NONE
         if (rs==lock_protocol::OK)
@@ -228,29 +408,47 @@ lock_client_cache::release(lock_protocol::lockid_t lid)
 // RPC Procedures
 rlock_protocol::status lock_client_cache::retry(lock_protocol::lockid_t lid, int &)
 {
-    printf("lock_client_cache::retry(%llu)\n", lid);
+    jsl_log(JSL_DBG_4, "lock_client_cache::retry(%llu)\n", lid);
 
     // Set retry map value for given lock to true and signal toRetry
     pthread_mutex_lock(&mutexRetryMap);
         retryMap[lid]=true;
+        nRetries++;
     pthread_mutex_unlock(&mutexRetryMap);
-    pthread_cond_signal(&okToRetry);
+    // threads waiting for other locks share okToRetry, wake all of them
+    pthread_cond_broadcast(&okToRetry);
     return rlock_protocol::OK;
 }
 
 rlock_protocol::status lock_client_cache::revoke(lock_protocol::lockid_t lid, int &)
 {
-    printf("lock_client_cache::revoke(%llu)\n", lid);
+    jsl_log(JSL_DBG_4, "lock_client_cache::revoke(%llu)\n", lid);
 
     // Add given lock to revokeList and signal revoker
     pthread_mutex_lock(&mutexRevokeList);
         revokeList.push_back(lid);
+        nRevokes++;
     pthread_mutex_unlock(&mutexRevokeList);
     pthread_cond_signal(&okToRevoke);
+
+    // Let the user prepare the release while a thread may still hold the lock
+    if (lu)
+        lu->dorevoke(lid);
     return rlock_protocol::OK;
 }
 
 
+void lock_client_cache::counters(unsigned long long &acquires, unsigned long long &retries, unsigned long long &revokes)
+{
+    acquires += __sync_fetch_and_add(&nServerAcquires, 0);
+    pthread_mutex_lock(&mutexRetryMap);
+        retries += nRetries;
+    pthread_mutex_unlock(&mutexRetryMap);
+    pthread_mutex_lock(&mutexRevokeList);
+        revokes += nRevokes;
+    pthread_mutex_unlock(&mutexRevokeList);
+}
+
 // Implementation of lock_t class
 
 client_lock_t::client_lock_t()
@@ -288,6 +486,28 @@ int client_lock_t::acquire()
     return result;
 }
 
+int client_lock_t::tryacquire()
+{
+    pthread_mutex_lock(&mutex);
+    int result = lockStatus;
+    if (lockStatus==FREE)
+        lockStatus=LOCKED;
+    else if (lockStatus==NONE)
+        lockStatus=ACQUIRING;
+    pthread_mutex_unlock(&mutex);
+    return result;
+}
+
+void client_lock_t::wait()
+{
+    pthread_mutex_lock(&mutex);
+    while (lockStatus!=FREE && lockStatus!=NONE)
+        pthread_cond_wait(&okToLock, &mutex);
+    pthread_mutex_unlock(&mutex);
+    // We didn't take the lock, pass the wakeup on to a thread that may want to
+    pthread_cond_signal(&okToLock);
+}
+
 int client_lock_t::release()
 {
     // Just set lock status to RELEASING. It is used always after LOCKED
@@ -5,16 +5,22 @@
 #define lock_client_cache_h
 
 #include <string>
+#include <vector>
 #include "lock_protocol.h"
 #include "rpc.h"
 #include "lock_client.h"
+#include "rsm_client.h"
 
 // Classes that inherit lock_release_user can override dorelease so that 
 // that they will be called when lock_client releases a lock.
 // You will not need to do anything with this class until Lab 6.
 class lock_release_user {
  public:
-  virtual void dorelease(lock_protocol::lockid_t) = 0;
+  // The lock is kept, and released again later, unless it returns OK
+  virtual lock_protocol::status dorelease(lock_protocol::lockid_t) = 0;
+  // Called from the revoke RPC, before the lock is released, so that work
+  // for the release can start early. Must not block.
+  virtual void dorevoke(lock_protocol::lockid_t) {};
   virtual ~lock_release_user() {};
 };
 
@@ -31,6 +37,13 @@ public:
     /// and returns NONE. Could return NONE or FREE, depends on previous state
     int acquire();
 
+    /// Takes the lock like acquire if it is FREE or NONE, but never waits. Returns the previous status; the lock is
+    /// left alone if it was not FREE or NONE
+    int tryacquire();
+
+    /// Waits until the lock is FREE or NONE, without taking it
+    void wait();
+
     /// Releases the lock. Setting lock to RELEASING status
     int release();
 
@@ -108,6 +121,7 @@ private:
 class lock_client_cache : public lock_client {
  private:
   class lock_release_user *lu;
+  rsm_client *rsmc;
   int rlock_port;
   std::string hostname;
   /// id for creation of sockaddr obj, "ip:port"
@@ -130,6 +144,11 @@ class lock_client_cache : public lock_client {
   pthread_cond_t okToRetry;
   pthread_mutex_t mutexRetryMap;
 
+  /// Counters for load tests: acquire RPCs sent, retry and revoke RPCs received
+  unsigned long long nServerAcquires;
+  unsigned long long nRetries;
+  unsigned long long nRevokes;
+
  public:
 
   /// Last used port on this computer
@@ -137,12 +156,29 @@ class lock_client_cache : public lock_client {
 
   /// Constructor of lock_client_cache. xdst - string for creating sever socket connection "ip:port"
   lock_client_cache(std::string xdst, class lock_release_user *l = 0);
-  virtual ~lock_client_cache() {};
+  virtual ~lock_client_cache();
   lock_protocol::status acquire(lock_protocol::lockid_t);
 
+  /// Acquire two locks at once, see acquire(std::vector). Equal ids are acquired only once
+  lock_protocol::status acquire(lock_protocol::lockid_t, lock_protocol::lockid_t);
+
+  /// Acquire a set of locks at once. Locks that are not cached are asked from the server in one acquiremany request,
+  /// which grants all of them or none. The thread never waits for a lock while holding others of the set, so sets
+  /// acquired this way cannot deadlock in any order. Equal ids are acquired only once
+  lock_protocol::status acquire(std::vector<lock_protocol::lockid_t>);
+
   /// Release lock, locally or to server if needed, signal to other threads waiting for that lock
   virtual lock_protocol::status release(lock_protocol::lockid_t);
 
+  /// Release two locks acquired by acquire(lid1, lid2)
+  lock_protocol::status release(lock_protocol::lockid_t, lock_protocol::lockid_t);
+
+  /// Release a set of locks acquired by acquire(std::vector)
+  lock_protocol::status release(std::vector<lock_protocol::lockid_t>);
+
+  /// Status of the lock on the server, 1 if some client holds it
+  virtual lock_protocol::status stat(lock_protocol::lockid_t);
+
   /// Revoke locks, which are FREE
   void releaser();
 
@@ -151,5 +187,8 @@ class lock_client_cache : public lock_client {
 
   /// RPC that signals, that lock should be revoked
   rlock_protocol::status revoke(lock_protocol::lockid_t lid, int &);
+
+  /// Adds this client's counters to acquires, retries and revokes
+  void counters(unsigned long long &acquires, unsigned long long &retries, unsigned long long &revokes);
 };
 #endif
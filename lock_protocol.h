@@ -14,7 +14,10 @@ class lock_protocol {
     acquire = 0x7001,
     release,
     subscribe,	// for lab 5
-    stat
+    stat,
+    hotlocks,	// contention report of the most contended locks
+    acquiremany,	// acquire a set of locks at once, all or none
+    dropwaiter	// internal: forget a waiting client that does not answer
   };
 };
 
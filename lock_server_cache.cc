@@ -1,125 +1,243 @@
 // the caching lock server implementation
 
-#include <queue> // causes wierd error with GCC 4.3.2 unless include is placed before header file
-                 // this quick-fix is found at http://programming.itags.org/c-c++/180035/
+#include <algorithm> // before the header file, the max macro of marshall.h breaks it
+#include <set>
 
 #include "lock_server_cache.h"
 
 #include <sstream>
+#include <vector>
 #include <stdio.h>
+#include <time.h>
 
 #include <unistd.h>
 #include <arpa/inet.h>
+#include "jsl_log.h"
+
+// A revoke or retry request to be sent to a client
+struct callback_t {
+    unsigned int proc; // rlock_protocol::revoke or rlock_protocol::retry
+    std::string addr; // client address
+    lock_protocol::lockid_t lid;
+};
+
+// A client whose last call failed
+struct failing_t {
+    unsigned int failures; // calls failed in a row
+    struct timespec notBefore; // when to call it again
+};
+
+// Revoke and retry requests in the order they were queued. The senders
+// take the first request to a client that has no call in progress, so
+// requests to one client are sent in order and a client that does not
+// answer holds up only its own requests.
+static std::list<callback_t> callbacks;
+static std::set<std::string> busyClients; // clients with a call in progress
+static std::map<std::string, failing_t> failingClients;
+static int failingBusy = 0; // senders calling a failing client
+static pthread_mutex_t callbackMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t needToSend = PTHREAD_COND_INITIALIZER;
+
+// Number of sender threads
+static const int nsenders = 4;
+
+// Number of senders that may call failing clients at once. Each such call
+// can take the whole call timeout, the other senders are kept for the
+// clients that answer
+static const int maxFailingSenders = 1;
+
+// Time to wait before calling a failing client again, doubled with every
+// failed call up to maxResendMs
+static const long resendMs = 100;
+static const long maxResendMs = 6400;
+
+// Failed calls in a row after which a retry is passed to the next waiting
+// client. Revokes are sent until the holder answers, the lock can't be
+// given to anyone else before
+static const unsigned int maxRetryFailures = 5;
 
 // rpcc connection cache
-std::map<std::string, rpcc*> rpccCache;
+static std::map<std::string, rpcc*> rpccCache;
+static pthread_mutex_t rpccMutex = PTHREAD_MUTEX_INITIALIZER;
 
-// Revoke requested
-std::map<lock_protocol::lockid_t, bool> revokeRequested;
-
-// Revoke and retry request queues
-std::queue<std::pair<std::string, lock_protocol::lockid_t> > revokeRequests;
-std::queue<std::pair<std::string, lock_protocol::lockid_t> > retryRequests;
+static void
+queueCallback(unsigned int proc, const std::string &addr, lock_protocol::lockid_t lid)
+{
+    callback_t cb;
+    cb.proc = proc;
+    cb.addr = addr;
+    cb.lid = lid;
+
+    pthread_mutex_lock(&callbackMutex);
+    callbacks.push_back(cb);
+    pthread_mutex_unlock(&callbackMutex);
+    pthread_cond_signal(&needToSend);
+}
 
-// Mutexes to protect revoke and retry request queues
-pthread_mutex_t revokeMutex;
-pthread_mutex_t retryMutex;
+// A failing client sent a request, so it may be reachable again: call it
+// back without waiting for the rest of its backoff
+static void
+clientSeen(const std::string &addr)
+{
+    pthread_mutex_lock(&callbackMutex);
+    std::map<std::string, failing_t>::iterator it = failingClients.find(addr);
+    if (it != failingClients.end())
+    {
+        it->second.notBefore.tv_sec = it->second.notBefore.tv_nsec = 0;
+        pthread_cond_broadcast(&needToSend);
+    }
+    pthread_mutex_unlock(&callbackMutex);
+}
 
-// Condition variable to allow waking up revoke and retry request handler processes
-pthread_cond_t needToRevoke;
-pthread_cond_t needToRetry;
+static unsigned long long
+usSince(const struct timespec &t)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (now.tv_sec - t.tv_sec) * 1000000ULL + now.tv_nsec / 1000 - t.tv_nsec / 1000;
+}
 
 // Implementation of lock_server_cache class
 
+cache_lock_t::stats_t::stats_t()
+    : acquires(0)
+    , retries(0)
+    , revokes(0)
+    , handoffs(0)
+    , maxWaiters(0)
+{
+    since.tv_sec = since.tv_nsec = 0;
+}
+
 cache_lock_t::cache_lock_t(lock_protocol::lockid_t lid)
     : id(lid)
     , lockHolder("")
+    , revokeQueued(false)
 {
-    pthread_cond_init(&okToLock, NULL);
     pthread_mutex_init(&mutex, NULL);
 
     // initialize interested clients list
     interestedClients.clear();
-
-    // set default value for revoke requested status
-    revokeRequested[id] = false;
 }
 
 lock_protocol::status cache_lock_t::acquire(std::string addr)
 {
-    printf("lock_t_server::acquire(%s, %llu) ", addr.c_str(), id);
-
     pthread_mutex_lock(&mutex);
+    lock_protocol::status res = acquire_wo(addr, true);
+    pthread_mutex_unlock(&mutex);
+    return res;
+}
+
+lock_protocol::status cache_lock_t::acquire_wo(std::string addr, bool wait)
+{
     lock_protocol::status res;
+    stats.acquires++;
 
     if (!lockHolder.empty())
     {
-        printf("rejected\n");
+        jsl_log(JSL_DBG_4, "cache_lock_t::acquire(%s, %llu) rejected\n", addr.c_str(), id);
 
-        // add revoke request to the queue and wake up the revoker thread
-        pthread_mutex_lock(&revokeMutex);
-        if (!revokeRequested[id])
+        // ask the holder to give the lock back, once
+        if (!revokeQueued)
         {
-            revokeRequested[id] = true;
-            revokeRequests.push(std::make_pair(lockHolder, id));
+            revokeQueued = true;
+            queueCallback(rlock_protocol::revoke, lockHolder, id);
+            stats.revokes++;
         }
-        pthread_mutex_unlock(&revokeMutex);
-        pthread_cond_signal(&needToRevoke);
 
         // add client to the list of interested clients
-        interestedClients.push_back(addr);
+        if (wait)
+        {
+            interestedClients.push_back(addr);
+            if (interestedClients.size() > stats.maxWaiters)
+                stats.maxWaiters = interestedClients.size();
+        }
         res = lock_protocol::RETRY;
-
+        stats.retries++;
     }
     else
     {
-        printf("granted\n");
+        jsl_log(JSL_DBG_4, "cache_lock_t::acquire(%s, %llu) granted\n", addr.c_str(), id);
 
         // store current lock holder
         lockHolder = addr;
         res = lock_protocol::OK;
+        if (stats.lastHolder != addr)
+            stats.handoffs++;
+        stats.lastHolder = addr;
+        clock_gettime(CLOCK_REALTIME, &stats.since);
 
+        // other clients are waiting, the new holder must give it back
         if (!interestedClients.empty())
         {
-            pthread_mutex_lock(&revokeMutex);
-            revokeRequested[id] = true;
-            revokeRequests.push(std::make_pair(lockHolder, id));
-            pthread_mutex_unlock(&revokeMutex);
-            pthread_cond_signal(&needToRevoke);
+            revokeQueued = true;
+            queueCallback(rlock_protocol::revoke, lockHolder, id);
+            stats.revokes++;
         }
     }
 
-    pthread_mutex_unlock(&mutex);
     return res;
 }
 
+void cache_lock_t::lock()
+{
+    pthread_mutex_lock(&mutex);
+}
+
+void cache_lock_t::unlock()
+{
+    pthread_mutex_unlock(&mutex);
+}
+
+bool cache_lock_t::isLocked_wo()
+{
+    return !lockHolder.empty();
+}
+
 void cache_lock_t::release()
 {
     pthread_mutex_lock(&mutex);
 
-    assert(!lockHolder.empty());
+    // a client resends a release the old primary committed before it failed
+    if (lockHolder.empty())
+    {
+        pthread_mutex_unlock(&mutex);
+        return;
+    }
+
+    if (stats.since.tv_sec)
+        stats.heldUs[lockHolder] += usSince(stats.since);
 
     // clear lock holder
     lockHolder = "";
 
     // clear revoke requested status
-    revokeRequested[id] = false;
+    revokeQueued = false;
 
-    // notify all interested clients that the lock is available
-    pthread_mutex_lock(&retryMutex);
+    // tell the first interested client that the lock is available
     if (!interestedClients.empty())
     {
         std::string client = interestedClients.front();
         interestedClients.pop_front();
-        retryRequests.push(std::make_pair(client, id)); // add repeat request to the queue
-        pthread_mutex_unlock(&retryMutex);
-
-        // wake up the retryer thread
-        pthread_cond_signal(&needToRetry);
+        queueCallback(rlock_protocol::retry, client, id);
     }
-    else
+
+    pthread_mutex_unlock(&mutex);
+}
+
+void cache_lock_t::retryFailed(std::string addr)
+{
+    pthread_mutex_lock(&mutex);
+
+    // the client does not wait for this lock anymore
+    interestedClients.remove(addr);
+
+    // the lock is still free, tell the next interested client
+    if (lockHolder.empty() && !interestedClients.empty())
     {
-        pthread_mutex_unlock(&retryMutex);
+        std::string client = interestedClients.front();
+        interestedClients.pop_front();
+        queueCallback(rlock_protocol::retry, client, id);
     }
 
     pthread_mutex_unlock(&mutex);
@@ -134,194 +252,513 @@ bool cache_lock_t::isLocked()
     return isLocked;
 }
 
-// Implementation of lock_server_cache class
+void cache_lock_t::marshal_state(marshall &m)
+{
+    pthread_mutex_lock(&mutex);
+    std::vector<std::string> clients(interestedClients.begin(), interestedClients.end());
+    m << lockHolder;
+    m << clients;
+    pthread_mutex_unlock(&mutex);
+}
 
-static void *
-revokethread(void *x)
+void cache_lock_t::unmarshal_state(unmarshall &u)
 {
-  lock_server_cache *sc = (lock_server_cache *) x;
-  sc->revoker();
-  return 0;
+    pthread_mutex_lock(&mutex);
+    std::vector<std::string> clients;
+    u >> lockHolder;
+    u >> clients;
+    interestedClients.assign(clients.begin(), clients.end());
+    // the time held so far is unknown here, count it from now
+    stats.lastHolder = lockHolder;
+    if (lockHolder.empty())
+        stats.since.tv_sec = stats.since.tv_nsec = 0;
+    else
+        clock_gettime(CLOCK_REALTIME, &stats.since);
+    // revokes queued by the previous primary are lost, allow new ones
+    revokeQueued = false;
+    pthread_mutex_unlock(&mutex);
+}
+
+unsigned long long cache_lock_t::contention()
+{
+    pthread_mutex_lock(&mutex);
+    unsigned long long c = stats.retries + stats.revokes;
+    pthread_mutex_unlock(&mutex);
+    return c;
+}
+
+std::string cache_lock_t::report()
+{
+    std::ostringstream ost;
+    pthread_mutex_lock(&mutex);
+    ost << "lock " << id << " acquires " << stats.acquires
+        << " retries " << stats.retries << " revokes " << stats.revokes
+        << " handoffs " << stats.handoffs << " waiters " << interestedClients.size()
+        << " maxwaiters " << stats.maxWaiters << " holder "
+        << (lockHolder.empty() ? "-" : lockHolder) << " held_ms";
+    std::map<std::string, unsigned long long> held = stats.heldUs;
+    if (!lockHolder.empty() && stats.since.tv_sec)
+        held[lockHolder] += usSince(stats.since);
+    for (std::map<std::string, unsigned long long>::iterator it = held.begin(); it != held.end(); it++)
+        ost << " " << it->first << "=" << it->second / 1000;
+    pthread_mutex_unlock(&mutex);
+    return ost.str();
+}
+
+void cache_lock_t::clear()
+{
+    pthread_mutex_lock(&mutex);
+    lockHolder = "";
+    revokeQueued = false;
+    interestedClients.clear();
+    pthread_mutex_unlock(&mutex);
 }
 
+// Implementation of lock_server_cache class
+
 static void *
-retrythread(void *x)
+senderthread(void *x)
 {
   lock_server_cache *sc = (lock_server_cache *) x;
-  sc->retryer();
+  sc->sender();
   return 0;
 }
 
-lock_server_cache::lock_server_cache()
+lock_server_cache::lock_server_cache(class rsm *_rsm)
+    : rsm(_rsm)
 {
     // initialize lock map access mutex
     pthread_mutex_init(&mutex, NULL);
 
     pthread_t th;
-    int r = pthread_create(&th, NULL, &revokethread, (void *) this);
-    assert (r == 0);
-    r = pthread_create(&th, NULL, &retrythread, (void *) this);
-    assert (r == 0);
+    for (int i = 0; i < nsenders; i++)
+    {
+        int r = pthread_create(&th, NULL, &senderthread, (void *) this);
+        assert (r == 0);
+    }
 }
 
-void
-lock_server_cache::revoker()
+// Returns the connection to the client at addr, binding it on first use.
+// Only the sender that has addr in busyClients calls it for addr.
+static rpcc *
+clientConnection(const std::string &addr)
 {
-    // initialize condition var and mutex
-    pthread_cond_init(&needToRevoke, NULL);
-    pthread_mutex_init(&revokeMutex, NULL);
+    pthread_mutex_lock(&rpccMutex);
+    std::map<std::string, rpcc*>::iterator it = rpccCache.find(addr);
+    rpcc *cl = it == rpccCache.end() ? 0 : it->second;
+    pthread_mutex_unlock(&rpccMutex);
+    if (cl)
+        return cl;
+
+    sockaddr_in dstsock;
+    make_sockaddr(addr.c_str(), &dstsock);
+    cl = new rpcc(dstsock);
+    if (cl->bind(rpcc::to(1000)) < 0)
+    {
+        printf("lock_server_cache::sender(): bind to %s failed\n", addr.c_str());
+        delete cl;
+        return 0;
+    }
+
+    pthread_mutex_lock(&rpccMutex);
+    rpccCache[addr] = cl;
+    pthread_mutex_unlock(&rpccMutex);
+    return cl;
+}
+
+static bool
+later(const struct timespec &a, const struct timespec &b)
+{
+    return a.tv_sec > b.tv_sec || (a.tv_sec == b.tv_sec && a.tv_nsec > b.tv_nsec);
+}
 
+void
+lock_server_cache::sender()
+{
     // temp variable to store RPC result
     int r;
+    struct timespec now;
 
+    pthread_mutex_lock(&callbackMutex);
     while (true)
     {
-        pthread_mutex_lock(&revokeMutex);
-
-        // wait for new revoke requests
-        while (revokeRequests.empty())
-            pthread_cond_wait(&needToRevoke, &revokeMutex);
-
-        // get request details
-        std::pair<std::string, lock_protocol::lockid_t> req =
-            revokeRequests.front();
+        // find the first request that can be sent now, and the time at
+        // which the first failing client waiting to be called again can be
+        clock_gettime(CLOCK_REALTIME, &now);
+        std::list<callback_t>::iterator it, next = callbacks.end();
+        struct timespec wake = { 0, 0 };
+        for (it = callbacks.begin(); it != callbacks.end(); it++)
+        {
+            if (busyClients.count(it->addr))
+                continue;
+            std::map<std::string, failing_t>::iterator f = failingClients.find(it->addr);
+            if (f != failingClients.end())
+            {
+                // woken when the sender calling a failing client is done
+                if (failingBusy >= maxFailingSenders)
+                    continue;
+                if (later(f->second.notBefore, now))
+                {
+                    if (wake.tv_sec == 0 || later(wake, f->second.notBefore))
+                        wake = f->second.notBefore;
+                    continue;
+                }
+            }
+            next = it;
+            break;
+        }
 
-        // remove processed request
-        revokeRequests.pop();
+        if (next == callbacks.end())
+        {
+            if (wake.tv_sec)
+                pthread_cond_timedwait(&needToSend, &callbackMutex, &wake);
+            else
+                pthread_cond_wait(&needToSend, &callbackMutex);
+            continue;
+        }
 
-        pthread_mutex_unlock(&revokeMutex);
-        
-        // get or create connection to client
-        rpcc* cl;
-        if (rpccCache.find(req.first) == rpccCache.end())
+        callback_t cb = *next;
+        callbacks.erase(next);
+        busyClients.insert(cb.addr);
+        bool failing = failingClients.count(cb.addr) > 0;
+        if (failing)
+            failingBusy++;
+        pthread_mutex_unlock(&callbackMutex);
+
+        // every replica queues the request, only the primary sends it.
+        // The rsm mutex is held while requests queue callbacks, so it is
+        // not taken with callbackMutex held
+        if (rsm && !rsm->amiprimary())
         {
-            sockaddr_in dstsock;
-            make_sockaddr(req.first.c_str(), &dstsock);
-            cl = new rpcc(dstsock);
+            pthread_mutex_lock(&callbackMutex);
+            busyClients.erase(cb.addr);
+            if (failing)
+                failingBusy--;
+            pthread_cond_broadcast(&needToSend);
+            continue;
+        }
 
-            if (cl->bind() < 0) {
-                printf("lock_server_cache::revoker(): bind failed\n");
-                return;
-            }
+        jsl_log(JSL_DBG_4, "lock_server_cache::send_%s(%s, %llu)\n",
+                cb.proc == rlock_protocol::revoke ? "revoke" : "retry",
+                cb.addr.c_str(), cb.lid);
+        rpcc *cl = clientConnection(cb.addr);
+        bool sent = cl && cl->call(cb.proc, cb.lid, r, rpcc::to(1000)) == rlock_protocol::OK;
 
-            rpccCache.insert(std::make_pair(req.first, cl));
+        if (cl && !sent)
+        {
+            // the client may be gone, do not keep its connection open
+            pthread_mutex_lock(&rpccMutex);
+            rpccCache.erase(cb.addr);
+            pthread_mutex_unlock(&rpccMutex);
+            delete cl;
         }
+
+        bool giveUp = false;
+        pthread_mutex_lock(&callbackMutex);
+        busyClients.erase(cb.addr);
+        if (failing)
+            failingBusy--;
+        if (sent)
+            failingClients.erase(cb.addr);
         else
         {
-            cl = rpccCache[req.first];
+            // call the client again later, waiting twice as long after
+            // every failed call
+            failing_t &f = failingClients[cb.addr];
+            f.failures++;
+            long ms = f.failures > 7 ? maxResendMs : std::min(resendMs << (f.failures - 1), maxResendMs);
+            clock_gettime(CLOCK_REALTIME, &f.notBefore);
+            f.notBefore.tv_sec += ms / 1000;
+            f.notBefore.tv_nsec += (ms % 1000) * 1000000;
+            if (f.notBefore.tv_nsec >= 1000000000)
+            {
+                f.notBefore.tv_sec++;
+                f.notBefore.tv_nsec -= 1000000000;
+            }
+            printf("lock_server_cache::sender(): %s to %s failed %u times, next call in %ld ms\n",
+                   cb.proc == rlock_protocol::revoke ? "revoke" : "retry",
+                   cb.addr.c_str(), f.failures, ms);
+
+            if (cb.proc == rlock_protocol::retry && f.failures >= maxRetryFailures)
+                giveUp = true;
+            else
+                // still ahead of later requests to the client
+                callbacks.push_front(cb);
         }
+        // the client's next request may be waiting for this one
+        pthread_cond_broadcast(&needToSend);
 
-        // send revoke request
-        printf("lock_server_cache::send_revoke(%s, %llu)\n", req.first.c_str(), req.second);
-        if (cl->call(rlock_protocol::revoke, req.second, r) != rlock_protocol::OK)
+        if (giveUp)
         {
-            pthread_mutex_lock(&revokeMutex);
-            revokeRequests.push(req);
-            pthread_mutex_unlock(&revokeMutex);
+            // the lock is held by nobody while the client does not answer,
+            // pass it to the next one. The waiting list is replicated state,
+            // so the change goes through the RSM like a client request
+            pthread_mutex_unlock(&callbackMutex);
+            printf("lock_server_cache::sender(): retry of %llu passed on from %s\n",
+                   cb.lid, cb.addr.c_str());
+            int ret = rsm_client_protocol::OK;
+            if (rsm)
+            {
+                marshall m;
+                m << 0;
+                m << cb.lid;
+                m << cb.addr;
+                std::string rep;
+                ret = rsm->submit(lock_protocol::dropwaiter, m.str(), rep);
+            }
+            else
+                dropwaiter(0, cb.lid, cb.addr, r);
+            pthread_mutex_lock(&callbackMutex);
+
+            // in a view change: call the client again, and give up again
+            // once the view is settled. If this replica is not the primary
+            // anymore, the request is dropped like any callback of a backup
+            if (rsm && ret == rsm_client_protocol::BUSY)
+            {
+                callbacks.push_front(cb);
+                pthread_cond_broadcast(&needToSend);
+            }
         }
     }
 }
 
-
-void
-lock_server_cache::retryer()
+lock_protocol::status lock_server_cache::stat(int clt, lock_protocol::lockid_t lid, int & r)
 {
-    // initialize condition var and mutex
-    pthread_cond_init(&needToRetry, NULL);
-    pthread_mutex_init(&retryMutex, NULL);
+    jsl_log(JSL_DBG_4, "lock_server_cache::stat(%d, %llu)\n", clt, lid);
 
-    // temp variable to store RPC result
-    int r;
+    // read-only: the replicated server answers stat on the primary alone,
+    // so an unknown lock id must not create a record
+    pthread_mutex_lock(&mutex);
+    std::map<lock_protocol::lockid_t, cache_lock_t>::iterator it = locks.find(lid);
+    r = (it != locks.end() && it->second.isLocked()) ? 1 : 0;
+    pthread_mutex_unlock(&mutex);
 
-    while (true)
-    {
-        pthread_mutex_lock(&retryMutex);
+    return lock_protocol::OK;
+}
 
-        // wait for new revoke requests
-        while (retryRequests.empty())
-            pthread_cond_wait(&needToRetry, &retryMutex);
+lock_protocol::status lock_server_cache::acquire(int clt, lock_protocol::lockid_t lid, std::string rpc_addr, lock_protocol::status & r)
+{
+    jsl_log(JSL_DBG_4, "lock_server_cache::acquire(%d, %s, %llu)\n", clt, rpc_addr.c_str(), lid);
 
-        // get request details
-        std::pair<std::string, lock_protocol::lockid_t> req =
-            retryRequests.front();
+    // insert new lock record on first access (for unknown-before lock id);
+    // map elements stay in place, so l is valid after the map is unlocked
+    pthread_mutex_lock(&mutex);
+    if (locks.find(lid) == locks.end())
+        locks.insert(std::make_pair(lid, cache_lock_t(lid)));
+    cache_lock_t &l = locks[lid];
+    l.version = execvs;
+    pthread_mutex_unlock(&mutex);
 
-        // remove processed request
-        retryRequests.pop();
+    clientSeen(rpc_addr);
+    r = l.acquire(rpc_addr);
 
-        pthread_mutex_unlock(&retryMutex);
+    return r;
+}
 
-        // get or create connection to client
-        rpcc* cl;
-        if (rpccCache.find(req.first) == rpccCache.end())
-        {
-            sockaddr_in dstsock;
-            make_sockaddr(req.first.c_str(), &dstsock);
-            cl = new rpcc(dstsock);
+lock_protocol::status lock_server_cache::acquiremany(int clt, std::vector<lock_protocol::lockid_t> lids, std::string rpc_addr, lock_protocol::status & r)
+{
+    jsl_log(JSL_DBG_4, "lock_server_cache::acquiremany(%d, %s, %u locks)\n", clt, rpc_addr.c_str(), (unsigned) lids.size());
 
-            if (cl->bind() < 0) {
-                printf("lock_server_cache::revoker(): bind failed\n");
-                return;
-            }
+    // lock the locks in ascending order of their ids, so that this never
+    // deadlocks with another acquiremany, and each one once
+    std::sort(lids.begin(), lids.end());
+    lids.erase(std::unique(lids.begin(), lids.end()), lids.end());
 
-            rpccCache.insert(std::make_pair(req.first, cl));
-        }
-        else
-        {
-            cl = rpccCache[req.first];
-        }
+    std::vector<cache_lock_t *> ls;
+    pthread_mutex_lock(&mutex);
+    for (unsigned int i = 0; i < lids.size(); i++)
+    {
+        if (locks.find(lids[i]) == locks.end())
+            locks.insert(std::make_pair(lids[i], cache_lock_t(lids[i])));
+        cache_lock_t &l = locks[lids[i]];
+        l.version = execvs;
+        ls.push_back(&l);
+    }
+    pthread_mutex_unlock(&mutex);
+
+    clientSeen(rpc_addr);
+    for (unsigned int i = 0; i < ls.size(); i++)
+        ls[i]->lock();
+
+    // grant all of them, or none if one is held
+    unsigned int held = ls.size();
+    for (unsigned int i = 0; i < ls.size() && held == ls.size(); i++)
+        if (ls[i]->isLocked_wo())
+            held = i;
 
-        // send revoke request
-        printf("lock_server_cache::send_retry(%s, %llu)\n", req.first.c_str(), req.second);
-        if (cl->call(rlock_protocol::retry, req.second, r) != rlock_protocol::OK)
+    r = lock_protocol::OK;
+    for (unsigned int i = 0; i < ls.size(); i++)
+    {
+        if (held == ls.size())
+            ls[i]->acquire_wo(rpc_addr, true);
+        else if (ls[i]->isLocked_wo())
         {
-            pthread_mutex_lock(&retryMutex);
-            retryRequests.push(req);
-            pthread_mutex_unlock(&retryMutex);
+            // revoke every held lock, but wait for the retry of one only,
+            // as each retry is sent to one client
+            ls[i]->acquire_wo(rpc_addr, i == held);
+            r = lock_protocol::RETRY;
         }
     }
+
+    for (unsigned int i = ls.size(); i > 0; i--)
+        ls[i - 1]->unlock();
+
+    return r;
 }
 
-lock_protocol::status lock_server_cache::stat(int clt, lock_protocol::lockid_t lid, int & r)
+lock_protocol::status lock_server_cache::release(int clt, lock_protocol::lockid_t lid, int &)
 {
-    printf("lock_server_cache::stat(%d, %llu)\n", clt, lid);
+    jsl_log(JSL_DBG_4, "lock_server_cache::release(%d, %llu)\n", clt, lid);
 
     // insert new lock record on first access (for unknown-before lock id)
     pthread_mutex_lock(&mutex);
     if (locks.find(lid) == locks.end())
-        locks.insert(std::make_pair(lid, cache_lock_t(lid)));
+    {
+        pthread_mutex_unlock(&mutex);
+        return lock_protocol::NOENT;
+    }
+    cache_lock_t &l = locks[lid];
+    l.version = execvs;
     pthread_mutex_unlock(&mutex);
 
-    r = locks[lid].isLocked() ? 1 : 0;
+    l.release();
 
     return lock_protocol::OK;
 }
 
-lock_protocol::status lock_server_cache::acquire(int clt, lock_protocol::lockid_t lid, std::string rpc_addr, lock_protocol::status & r)
+lock_protocol::status lock_server_cache::dropwaiter(int clt, lock_protocol::lockid_t lid, std::string rpc_addr, int &)
 {
-    printf("lock_server_cache::acquire(%d, %s, %llu)\n", clt, rpc_addr.c_str(), lid);
+    jsl_log(JSL_DBG_4, "lock_server_cache::dropwaiter(%llu, %s)\n", lid, rpc_addr.c_str());
 
-    // insert new lock record on first access (for unknown-before lock id)
     pthread_mutex_lock(&mutex);
     if (locks.find(lid) == locks.end())
-        locks.insert(std::make_pair(lid, cache_lock_t(lid)));
+    {
+        pthread_mutex_unlock(&mutex);
+        return lock_protocol::NOENT;
+    }
+    cache_lock_t &l = locks[lid];
+    l.version = execvs;
     pthread_mutex_unlock(&mutex);
 
-    r = locks[lid].acquire(rpc_addr);
+    l.retryFailed(rpc_addr);
 
-    return r;
+    return lock_protocol::OK;
 }
 
-lock_protocol::status lock_server_cache::release(int clt, lock_protocol::lockid_t lid, int &)
+lock_protocol::status lock_server_cache::hotlocks(int clt, unsigned int n, std::string & r)
 {
-    printf("lock_server_cache::release(%d, %llu)\n", clt, lid);
+    jsl_log(JSL_DBG_4, "lock_server_cache::hotlocks(%d, %u)\n", clt, n);
+
+    std::vector<std::pair<unsigned long long, lock_protocol::lockid_t> > ranked;
+    std::ostringstream ost;
 
-    // insert new lock record on first access (for unknown-before lock id)
     pthread_mutex_lock(&mutex);
-    if (locks.find(lid) == locks.end())
-        return lock_protocol::NOENT;
+    for (std::map<lock_protocol::lockid_t, cache_lock_t>::iterator it = locks.begin(); it != locks.end(); it++)
+        ranked.push_back(std::make_pair(it->second.contention(), it->first));
+
+    // most contended first, only the n of them are sorted
+    n = std::min((size_t) n, ranked.size());
+    std::partial_sort(ranked.begin(), ranked.begin() + n, ranked.end(),
+                      std::greater<std::pair<unsigned long long, lock_protocol::lockid_t> >());
+    for (unsigned int i = 0; i < n; i++)
+        ost << locks[ranked[i].second].report() << "\n";
     pthread_mutex_unlock(&mutex);
 
-    locks[lid].release();
-
+    r = ost.str();
     return lock_protocol::OK;
 }
+
+std::string lock_server_cache::marshal_state()
+{
+    std::string cursor, state;
+    marshal_page(true, viewstamp(), cursor, ~0u, state);
+    return state;
+}
+
+void lock_server_cache::unmarshal_state(std::string state)
+{
+    unmarshal_page(state, true);
+}
+
+void lock_server_cache::set_viewstamp(viewstamp vs)
+{
+    pthread_mutex_lock(&mutex);
+    execvs = vs;
+    pthread_mutex_unlock(&mutex);
+}
+
+bool lock_server_cache::marshal_page(bool full, viewstamp since, std::string &cursor,
+                                     unsigned maxsize, std::string &page)
+{
+    marshall locksm;
+    unsigned int count = 0;
+
+    pthread_mutex_lock(&mutex);
+
+    // cursor holds the id of the last lock sent
+    std::map<lock_protocol::lockid_t, cache_lock_t>::iterator it = locks.begin();
+    if (!cursor.empty())
+    {
+        unmarshall u(cursor);
+        lock_protocol::lockid_t lid;
+        u >> lid;
+        it = locks.upper_bound(lid);
+    }
+
+    for (; it != locks.end() && (unsigned) locksm.size() < maxsize; it++)
+    {
+        if (!full && !(it->second.version > since))
+            continue;
+        locksm << it->first;
+        locksm << it->second.version;
+        it->second.marshal_state(locksm);
+        count++;
+    }
+
+    bool done = (it == locks.end());
+    if (!done)
+    {
+        std::map<lock_protocol::lockid_t, cache_lock_t>::iterator prev = it;
+        prev--;
+        marshall c;
+        c << prev->first;
+        cursor = c.str();
+    }
+    pthread_mutex_unlock(&mutex);
+
+    marshall m;
+    m << count;
+    page = m.str() + locksm.str();
+    return done;
+}
+
+void lock_server_cache::unmarshal_page(std::string page, bool replace)
+{
+    unmarshall u(page);
+    unsigned int count;
+
+    pthread_mutex_lock(&mutex);
+
+    // locks unknown to the primary are free
+    if (replace)
+    {
+        for (std::map<lock_protocol::lockid_t, cache_lock_t>::iterator it = locks.begin(); it != locks.end(); it++)
+        {
+            it->second.clear();
+            it->second.version = viewstamp();
+        }
+    }
+
+    u >> count;
+    for (unsigned int i = 0; i < count; i++)
+    {
+        lock_protocol::lockid_t lid;
+        u >> lid;
+        if (locks.find(lid) == locks.end())
+            locks.insert(std::make_pair(lid, cache_lock_t(lid)));
+        cache_lock_t &l = locks[lid];
+        u >> l.version;
+        l.unmarshal_state(u);
+    }
+    pthread_mutex_unlock(&mutex);
+}
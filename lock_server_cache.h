@@ -3,10 +3,13 @@
 
 #include <string>
 #include <list>
+#include <vector>
 
 #include "lock_protocol.h"
 #include "rpc.h"
 #include "lock_server.h"
+#include "rsm.h"
+#include "rsm_state_transfer.h"
 
 /** cache_lock_t class
  * 
@@ -31,41 +34,101 @@ public:
 	 */
         cache_lock_t(lock_protocol::lockid_t lid);
     
-    /** Aquires the lock. Pauses thread until lock is released.
+    /** Aquires the lock. Never waits: if the lock is held, the client is
+	 *  queued, a revoke is queued for the holder and RETRY is returned.
+	 *  The client gets a retry callback when the lock is released.
 	 *
 	 *  @param addr Address for the RPC calls to the client
 	 *  @return Result for the acquire operation -- could be RETRY or OK
 	 */
     lock_protocol::status acquire(std::string addr);
     
-    /// Releases the lock. Wakes up other thread waiting to aquire this lock.
+    /** Aquires the lock like acquire, with the mutex already held by lock().
+	 *  If the lock is held, a revoke is queued for the holder, and the
+	 *  client is queued for a retry callback only if wait is set.
+	 *
+	 *  @param addr Address for the RPC calls to the client
+	 *  @param wait Queue the client if the lock is held
+	 *  @return Result for the acquire operation -- could be RETRY or OK
+	 */
+    lock_protocol::status acquire_wo(std::string addr, bool wait);
+
+    /// Locks the mutex, so that several locks can be acquired at once.
+    /// Locks are always locked in ascending order of their ids.
+    void lock();
+
+    /// Unlocks the mutex locked by lock()
+    void unlock();
+
+    /// Returns whether the lock is held, with the mutex held by lock()
+    bool isLocked_wo();
+
+    /// Releases the lock. Queues a retry callback for the first waiting client.
     void release();
     
+    /// Forgets a waiting client that did not answer its retry callback and
+    /// queues the retry for the next waiting one if the lock is still free.
+    void retryFailed(std::string addr);
+
     /// Returns the current status of the lock.
     bool isLocked();
+
+    /// Writes lock holder and waiting clients, used for RSM state transfer
+    void marshal_state(marshall &m);
+
+    /// Restores lock holder and waiting clients written by marshal_state
+    void unmarshal_state(unmarshall &u);
+
+    /// Frees the lock and forgets waiting clients
+    void clear();
+
+    /// Viewstamp of the replicated request that last changed the lock
+    viewstamp version;
+
+    /// Contention score used to rank locks: RETRY answers plus revokes
+    unsigned long long contention();
+
+    /// One line of contention statistics for the hot-locks report
+    std::string report();
 	
 private:
+    /// Contention statistics. Every replica keeps them for the requests it
+    /// executes; they are not part of the replicated state.
+    struct stats_t {
+        stats_t();
+        unsigned long long acquires; // acquire requests
+        unsigned long long retries; // acquires answered RETRY, each one a retry wait on the client
+        unsigned long long revokes; // revokes queued for the holder
+        unsigned long long handoffs; // grants to another client than the previous holder
+        unsigned int maxWaiters; // longest list of interested clients seen
+        struct timespec since; // when the current holder got the lock
+        std::string lastHolder;
+        std::map<std::string, unsigned long long> heldUs; // time held per client
+    };
+    stats_t stats;
+
+
 	lock_protocol::lockid_t id; // current lock id
 	std::string lockHolder; // address of the current lock holder (or an empty string if noone is holding the lock)
-    pthread_cond_t okToLock; // condition on which acquire should be woken
+    bool revokeQueued; // a revoke is queued for the current holder
     pthread_mutex_t mutex; // mutex to process multi-thread access to the variables
 	std::list<std::string> interestedClients; // list of the clients that are waiting for this lock
 };
 
-class lock_server_cache {
+class lock_server_cache : public rsm_state_transfer {
 public:
-	/// This is constructor for the lock server. It will start revoker
-	/// and retryer threads and set up internal variables to their initial
-	/// values.
-	lock_server_cache();
-	
-	/// This function is to be executed in a separate thread and
-	/// it will process revoke requests in a continuous loop.
-	void revoker();
+	/// This is constructor for the lock server. It will start the sender
+	/// threads and set up internal variables to their initial values.
+	/// When the server is replicated, only the primary sends revoke and
+	/// retry requests to the clients.
+	lock_server_cache(class rsm *_rsm = 0);
 	
-	/// This function is to be executed in a separate thread and
-	/// it will process retry requests in a continuous loop.
-	void retryer();
+	/// This function is to be executed in a pool of threads and it will
+	/// send queued revoke and retry requests in a continuous loop, one
+	/// at a time to each client, so that a slow client holds up only
+	/// its own requests. Failing clients are called again with
+	/// exponential backoff, by a bounded number of the threads.
+	void sender();
   
 	/** Get status of a certain lock (RPC command handler)
 	 *
@@ -88,6 +151,20 @@ public:
 	 */
 	lock_protocol::status acquire(int clt, lock_protocol::lockid_t lid, std::string rpc_addr, int & r);
 
+	/** Aquire a set of locks at once (RPC command handler). Either all
+	 *  of them are granted or none is; in that case the client waits for
+	 *  a retry of the first lock of the set that is held, and revokes are
+	 *  queued for every held one.
+	 *
+	 *  @param clt Client ID
+	 *  @param lids Lock IDs
+	 *  @param rpc_addr Address for the RPC calls to the client
+	 *  @param r Result for the acquire operation -- could be RETRY or OK
+	 *  @return Execution status of the RPC function. Indicates success or
+	 *          failure code.
+	 */
+	lock_protocol::status acquiremany(int clt, std::vector<lock_protocol::lockid_t> lids, std::string rpc_addr, int & r);
+
 	/** Release certain lock (RPC command handler)
 	 *
 	 *  @param clt Client ID
@@ -96,10 +173,50 @@ public:
 	 *          failure code.
 	 */
 	lock_protocol::status release(int clt, lock_protocol::lockid_t lid, int &);
+
+	/** Forget a waiting client that did not answer its retry callback and
+	 *  pass the retry on (RSM command handler). Not called by clients:
+	 *  the primary submits it, so every replica changes the waiting list
+	 *  in the same order.
+	 *
+	 *  @param clt Unused
+	 *  @param lid Lock ID
+	 *  @param rpc_addr Address of the client that does not answer
+	 *  @return Execution status of the RPC function
+	 */
+	lock_protocol::status dropwaiter(int clt, lock_protocol::lockid_t lid, std::string rpc_addr, int &);
+
+	/** Report the most contended locks (RPC command handler)
+	 *
+	 *  @param clt Client ID
+	 *  @param n Number of locks to report
+	 *  @param r One line per lock, most contended first
+	 *  @return Execution status of the RPC function
+	 */
+	lock_protocol::status hotlocks(int clt, unsigned int n, std::string & r);
+
+	/// Returns the whole lock table for the RSM state transfer
+	std::string marshal_state();
+
+	/// Replaces the lock table with one returned by marshal_state
+	void unmarshal_state(std::string state);
+
+	/// Sets the viewstamp recorded in the locks changed by the next requests
+	void set_viewstamp(viewstamp vs);
+
+	/// Returns the locks with ids after cursor, only those changed after
+	/// since unless full is set, in pages of about maxsize bytes
+	bool marshal_page(bool full, viewstamp since, std::string &cursor,
+	                  unsigned maxsize, std::string &page);
+
+	/// Updates the locks from a page returned by marshal_page
+	void unmarshal_page(std::string page, bool replace);
 	
 protected:
+    class rsm *rsm; // replicated state machine or NULL if not replicated
     std::map<lock_protocol::lockid_t, cache_lock_t> locks; // lock map
 	pthread_mutex_t mutex; // mutex to protect map modification (such as adding new unknown-before locks)
+	viewstamp execvs; // viewstamp of the requests being executed
 };
 
 #endif
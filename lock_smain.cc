@@ -38,6 +38,16 @@ main(int argc, char *argv[])
 #define	RSM
 #ifdef RSM
   rsm rsm(argv[1], argv[2]);
+  lock_server_cache ls(&rsm);
+  rsm.set_state_transfer(&ls);
+  rsm.reg(lock_protocol::stat, &ls, &lock_server_cache::stat); // register stat()
+  rsm.reg(lock_protocol::acquire, &ls, &lock_server_cache::acquire); // register acquire()
+  rsm.reg(lock_protocol::release, &ls, &lock_server_cache::release); // register release()
+  rsm.reg(lock_protocol::hotlocks, &ls, &lock_server_cache::hotlocks); // register hotlocks()
+  rsm.reg(lock_protocol::acquiremany, &ls, &lock_server_cache::acquiremany); // register acquiremany()
+  rsm.reg(lock_protocol::dropwaiter, &ls, &lock_server_cache::dropwaiter); // register dropwaiter(), submitted by the primary
+  rsm.set_readonly(lock_protocol::stat);
+  rsm.set_readonly(lock_protocol::hotlocks);
 #endif
 
 #ifndef RSM
@@ -46,6 +56,8 @@ main(int argc, char *argv[])
   server.reg(lock_protocol::stat, &ls, &lock_server_cache::stat); // register stat()
   server.reg(lock_protocol::acquire, &ls, &lock_server_cache::acquire); // register acquire()
   server.reg(lock_protocol::release, &ls, &lock_server_cache::release); // register release()
+  server.reg(lock_protocol::hotlocks, &ls, &lock_server_cache::hotlocks); // register hotlocks()
+  server.reg(lock_protocol::acquiremany, &ls, &lock_server_cache::acquiremany); // register acquiremany()
 #endif
 
 
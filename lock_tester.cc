@@ -2,18 +2,21 @@
 // Lock server tester
 //
 
+#include <algorithm> // before rpc.h, whose max macro breaks them
+#include <math.h>
 #include "lock_protocol.h"
 #include "lock_client.h"
 #include "rpc.h"
 #include "jsl_log.h"
 #include <arpa/inet.h>
+#include <unistd.h>
 #include <vector>
 #include <stdlib.h>
 #include <stdio.h>
 #include "lock_client_cache.h"
 
 // must be >= 2
-int nt = 10; //XXX: lab1's rpc handlers are blocking. Since rpcs uses a thread pool of 10 threads, we cannot test more than 10 blocking rpc.
+int nt = 10; // lab1's lock_server parks one of its 10 rpcs threads per blocked acquire; the caching server never does, see -l for more clients
 std::string dst;
 lock_client_cache **lc = new lock_client_cache * [nt];
 lock_protocol::lockid_t a = 1;
@@ -144,12 +147,149 @@ test5(void *x)
   return 0;
 }
 
+// Load generator (-l): nthreads threads spread over nclients caching
+// clients acquire, hold and release locks for secs seconds. Lock ids
+// are drawn uniformly from 1..nlocks, or from a Zipf distribution with
+// exponent zipf_s if it is set, so that a few locks are hot. With
+// nmulti > 1 every operation acquires that many locks at once. Each
+// grant is checked against the holders seen so far.
+
+int nclients = 100;
+int nthreads = 200;
+int nlocks = 100;
+double zipf_s = 0;
+int holdus = 0;
+int secs = 10;
+int nmulti = 1;
+std::vector<double> zipf_cdf;
+std::vector<int> holders; // threads holding each lock
+volatile bool load_stop;
+
+struct loader_t {
+  lock_client_cache *lc;
+  unsigned int seed;
+  unsigned long long ops;
+  rpc_hist lat;
+};
+
+lock_protocol::lockid_t
+picklock(unsigned int *seed)
+{
+  double u = rand_r(seed) / (RAND_MAX + 1.0);
+  if (zipf_cdf.empty())
+    return 1 + (lock_protocol::lockid_t) (u * nlocks);
+  std::vector<double>::iterator it =
+    std::lower_bound(zipf_cdf.begin(), zipf_cdf.end(), u);
+  return 1 + (it - zipf_cdf.begin());
+}
+
+void *
+loader(void *x)
+{
+  loader_t *l = (loader_t *) x;
+  std::vector<lock_protocol::lockid_t> lids;
+  while (!load_stop) {
+    lids.clear();
+    for (int i = 0; i < nmulti; i++)
+      lids.push_back(picklock(&l->seed));
+    std::sort(lids.begin(), lids.end());
+    lids.erase(std::unique(lids.begin(), lids.end()), lids.end());
+    struct timespec start;
+    clock_gettime(CLOCK_REALTIME, &start);
+    if (nmulti > 1)
+      assert(l->lc->acquire(lids) == lock_protocol::OK);
+    else
+      assert(l->lc->acquire(lids[0]) == lock_protocol::OK);
+    l->lat.add(usec_since(start));
+    for (unsigned i = 0; i < lids.size(); i++) {
+      if (__sync_add_and_fetch(&holders[lids[i]], 1) != 1) {
+        fprintf(stderr, "error: lock %llu granted twice\n", lids[i]);
+        exit(1);
+      }
+    }
+    if (holdus)
+      usleep(holdus);
+    for (unsigned i = 0; i < lids.size(); i++)
+      __sync_sub_and_fetch(&holders[lids[i]], 1);
+    if (nmulti > 1)
+      l->lc->release(lids);
+    else
+      l->lc->release(lids[0]);
+    l->ops++;
+  }
+  return 0;
+}
+
+void
+loadtest()
+{
+  holders.resize(nlocks + 1);
+  if (zipf_s > 0) {
+    double sum = 0;
+    for (int i = 1; i <= nlocks; i++) {
+      sum += 1 / pow(i, zipf_s);
+      zipf_cdf.push_back(sum);
+    }
+    for (int i = 0; i < nlocks; i++)
+      zipf_cdf[i] /= sum;
+  }
+
+  printf("load: starting %d clients\n", nclients);
+  std::vector<lock_client_cache *> lcs;
+  for (int i = 0; i < nclients; i++)
+    lcs.push_back(new lock_client_cache(dst));
+
+  std::vector<loader_t> ls(nthreads);
+  std::vector<pthread_t> th(nthreads);
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, 64*1024);
+  struct timespec start;
+  clock_gettime(CLOCK_REALTIME, &start);
+  for (int i = 0; i < nthreads; i++) {
+    ls[i].lc = lcs[i % nclients];
+    ls[i].seed = random();
+    ls[i].ops = 0;
+    assert(pthread_create(&th[i], &attr, loader, (void *) &ls[i]) == 0);
+  }
+  sleep(secs);
+  load_stop = true;
+
+  rpc_hist lat;
+  unsigned long long ops = 0;
+  for (int i = 0; i < nthreads; i++) {
+    pthread_join(th[i], NULL);
+    lat.merge(ls[i].lat);
+    ops += ls[i].ops;
+  }
+  double elapsed = usec_since(start) / 1000000.0;
+  unsigned long long acquires = 0, retries = 0, revokes = 0;
+  for (int i = 0; i < nclients; i++)
+    lcs[i]->counters(acquires, retries, revokes);
+
+  char dist[32];
+  if (zipf_s > 0)
+    snprintf(dist, sizeof(dist), "zipf %.2f", zipf_s);
+  else
+    snprintf(dist, sizeof(dist), "uniform");
+  printf("load: clients %d threads %d locks %d per op %d %s hold %d us: "
+         "%llu acquires in %.1f s, %.0f/s; acquire latency p50 %llu "
+         "p90 %llu p99 %llu p999 %llu max %llu us; "
+         "server acquires %llu retries %llu revokes %llu\n",
+         nclients, nthreads, nlocks, nmulti, dist, holdus, ops, elapsed,
+         ops / elapsed, lat.percentile(50), lat.percentile(90),
+         lat.percentile(99), lat.percentile(99.9), lat.percentile(100),
+         acquires, retries, revokes);
+}
+
 int
 main(int argc, char *argv[])
 {
     int r;
     pthread_t th[nt];
     int test = 0;
+    bool load = false;
+    int ch;
 
     setvbuf(stdout, NULL, _IONBF, 0);
     setvbuf(stderr, NULL, _IONBF, 0);
@@ -157,13 +297,41 @@ main(int argc, char *argv[])
 
     //jsl_set_debug(2);
 
+    while ((ch = getopt(argc, argv, "lc:t:k:m:z:h:s:")) != -1) {
+      switch (ch) {
+      case 'l': load = true; break;
+      case 'c': nclients = atoi(optarg); break;
+      case 't': nthreads = atoi(optarg); break;
+      case 'k': nlocks = atoi(optarg); break;
+      case 'm': nmulti = atoi(optarg); break;
+      case 'z': zipf_s = atof(optarg); break;
+      case 'h': holdus = atoi(optarg); break;
+      case 's': secs = atoi(optarg); break;
+      default:
+        exit(1);
+      }
+    }
+    char *prog = argv[0];
+    argc -= optind - 1;
+    argv += optind - 1;
+    argv[0] = prog;
+
     if(argc < 2) {
-      fprintf(stderr, "Usage: %s [host:]port [test]\n", argv[0]);
+      fprintf(stderr, "Usage: %s [host:]port [test]\n"
+              "       %s -l [-c clients] [-t threads] [-k locks] "
+              "[-m locks per op]\n"
+              "          [-z zipf exponent] [-h hold us] [-s secs] [host:]port\n",
+              argv[0], argv[0]);
       exit(1);
     }
 
     dst = argv[1]; 
 
+    if (load) {
+      loadtest();
+      exit(0);
+    }
+
     if (argc > 2) {
       test = atoi(argv[2]);
       if(test < 1 || test > 5){
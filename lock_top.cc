@@ -0,0 +1,31 @@
+//
+// Prints the most contended locks of a running lock server
+//
+
+#include "lock_protocol.h"
+#include "rsm_client.h"
+#include <stdlib.h>
+#include <stdio.h>
+
+int
+main(int argc, char *argv[])
+{
+  unsigned int n = 10;
+  std::string r;
+
+  if(argc != 2 && argc != 3){
+    fprintf(stderr, "Usage: %s [master:]port [n]\n", argv[0]);
+    exit(1);
+  }
+  if (argc == 3)
+    n = atoi(argv[2]);
+
+  rsm_client rsmc(argv[1]);
+  int ret = rsmc.call(lock_protocol::hotlocks, 0, n, r);
+  if (ret != lock_protocol::OK) {
+    fprintf(stderr, "%s: hotlocks failed %d\n", argv[0], ret);
+    exit(1);
+  }
+  printf("%s", r.c_str());
+  return 0;
+}
@@ -1,90 +1,404 @@
 #include "paxos.h"
 #include <fstream>
 #include <iostream>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 // Paxos must maintain some durable state (i.e., that survives power
 // failures) to run Paxos correct.  This module implements a log with
-// all durable state to run Paxos.  Since the values chosen correspond
-// to views, the log contains all views since the beginning of time.
+// all durable state to run Paxos.
+//
+// The state lives in two binary files. paxos-<me>.snap holds a snapshot
+// of the acceptor, paxos-<me>.wal the records (decided instance, highest
+// prepare, accepted proposal) appended since. Every snapevery records
+// the current state is written as a new snapshot and the WAL is
+// emptied, and a snapshot keeps only the last keep decided views, so
+// reading the log at startup and the dump sent to a joining node do not
+// grow with the number of views.
+//
+// Every record and the snapshot are framed as length, CRC-32 of the
+// payload, payload. A record cut short by a crash fails its checksum and
+// is dropped along with anything after it. Records carry the generation
+// of the snapshot they follow, so records left behind by a crash between
+// writing a snapshot and emptying the WAL are not replayed on top of it.
+//
+// An acceptor must not answer before its record is on disk. Records are
+// written by a separate thread: it takes all records queued while the
+// previous fdatasync was running and makes them durable with one
+// fdatasync, so concurrent prepares and accepts share the disk latency.
+// The WAL is preallocated, so fdatasync does not have to update the file
+// size; unwritten space reads as zero length frames.
+//
+// paxos-<me>.log lists the decided views as text ("done <instance>
+// <value>") for people and test scripts to read; it is never read back.
+
+static unsigned
+crc32(const std::string &s)
+{
+  static unsigned table[256];
+  static bool init = false;
+  if (!init) {
+    for (unsigned i = 0; i < 256; i++) {
+      unsigned c = i;
+      for (int k = 0; k < 8; k++)
+	c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+      table[i] = c;
+    }
+    init = true;
+  }
+  unsigned c = 0xffffffff;
+  for (unsigned i = 0; i < s.size(); i++)
+    c = table[(c ^ (unsigned char) s[i]) & 0xff] ^ (c >> 8);
+  return c ^ 0xffffffff;
+}
+
+static bool
+readfile(std::string name, std::string &buf)
+{
+  int fd = open(name.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  char b[8192];
+  int n;
+  while ((n = read(fd, b, sizeof(b))) > 0)
+    buf.append(b, n);
+  close(fd);
+  return true;
+}
+
+static void
+writeall(int fd, const std::string &s, off_t off)
+{
+  unsigned done = 0;
+  while (done < s.size()) {
+    int n = pwrite(fd, s.data() + done, s.size() - done, off + done);
+    assert(n > 0);
+    done += n;
+  }
+}
+
+static void *
+writerthread(void *x)
+{
+  log *l = (log *) x;
+  l->writer();
+  return 0;
+}
 
 log::log(acceptor *_acc, std::string _me)
-  : pxs (_acc)
+  : pxs (_acc), walfd(-1), nrecords(0), gen(0), queued(0), durable(0),
+    woff(0), nsyncs(0)
 {
   name = "paxos-" + _me + ".log";
+  walname = "paxos-" + _me + ".wal";
+  snapname = "paxos-" + _me + ".snap";
+  assert(pthread_mutex_init(&wmutex, NULL) == 0);
+  assert(pthread_cond_init(&wcond, NULL) == 0);
+  assert(pthread_cond_init(&dcond, NULL) == 0);
   logread();
+
+  pthread_t th;
+  assert(pthread_create(&th, NULL, &writerthread, (void *) this) == 0);
+}
+
+std::string
+log::frame(std::string payload)
+{
+  marshall m;
+  m << (unsigned int) payload.size();
+  m << crc32(payload);
+  return m.str() + payload;
+}
+
+// Takes the frame at off out of buf and moves off past it. Returns false
+// if the frame is empty, incomplete or its checksum does not match.
+bool
+log::unframe(const std::string &buf, unsigned &off, std::string &payload)
+{
+  unsigned int len, crc;
+  if (buf.size() < off + 8)
+    return false;
+  unmarshall u(buf.substr(off, 8));
+  u >> len;
+  u >> crc;
+  if (len == 0 || buf.size() - off - 8 < len)
+    return false;
+  payload = buf.substr(off + 8, len);
+  if (crc32(payload) != crc)
+    return false;
+  off += 8 + len;
+  return true;
+}
+
+// Queues a record for the writer. Every snapevery records a snapshot of
+// the acceptor is queued after it; callers update the acceptor before
+// logging, so the snapshot contains every record queued so far.
+unsigned long long
+log::append(std::string payload)
+{
+  marshall m;
+  m << gen;
+  job_t j;
+  j.data = frame(m.str() + payload);
+  j.snap = false;
+
+  assert(pthread_mutex_lock(&wmutex) == 0);
+  queue.push_back(j);
+  unsigned long long seq = ++queued;
+  if (++nrecords >= snapevery) {
+    gen++;
+    nrecords = 0;
+    j.data = frame(snapshot());
+    j.snap = true;
+    queue.push_back(j);
+    while (pxs->values.size() > keep)
+      pxs->values.erase(pxs->values.begin());
+  }
+  pthread_cond_signal(&wcond);
+  assert(pthread_mutex_unlock(&wmutex) == 0);
+  return seq;
 }
 
+// Waits until the record with sequence number seq is on disk.
 void
-log::logread(void)
+log::sync(unsigned long long seq)
 {
-  std::ifstream from;
-  std::string type;
-  unsigned instance;
+  assert(pthread_mutex_lock(&wmutex) == 0);
+  while (durable < seq)
+    pthread_cond_wait(&dcond, &wmutex);
+  assert(pthread_mutex_unlock(&wmutex) == 0);
+}
 
-  from.open(name.c_str());
-  printf ("logread\n");
-  while (from >> type) {
-    if (type == "done") {
-      std::string v;
-      from >> instance;
-      from.get();
-      getline(from, v);
-      pxs->values[instance] = v;
-      pxs->instance_h = instance;
-      printf ("logread: instance: %d w. v = %s\n", instance, 
-	      pxs->values[instance].c_str());
-      pxs->v_a.clear();
-      pxs->n_h.n = 0;
-      pxs->n_a.n = 0;
-    } else if (type == "high") {
-      from >> pxs->n_h.n;
-      from >> pxs->n_h.m;
-      printf("logread: high update: %d(%s)\n", pxs->n_h.n, pxs->n_h.m.c_str());
-    } else if (type == "prop") {
-      std::string v;
-      from >> pxs->n_a.n;
-      from >> pxs->n_a.m;
-      from.get();
-      getline(from, v);
-      pxs->v_a = v;
-      printf("logread: prop update %d(%s) with v = %s\n", pxs->n_a.n, 
-	     pxs->n_a.m.c_str(), pxs->v_a.c_str());
-    } else {
-      printf("logread: unknown log record\n");
-      assert(0);
+void
+log::writer()
+{
+  std::list<job_t> jobs;
+  unsigned long long nrecs = 0;
+
+  while (true) {
+    assert(pthread_mutex_lock(&wmutex) == 0);
+    while (queue.empty())
+      pthread_cond_wait(&wcond, &wmutex);
+    jobs.swap(queue);
+    unsigned long long last = queued;
+    assert(pthread_mutex_unlock(&wmutex) == 0);
+
+    // consecutive records go out in one write
+    std::string buf;
+    for (std::list<job_t>::iterator it = jobs.begin(); it != jobs.end(); it++) {
+      if (!it->snap) {
+	buf += it->data;
+	nrecs++;
+	continue;
+      }
+      // the snapshot covers the records before it
+      buf.clear();
+      writesnap(it->data);
+      resetwal(0);
     }
-  } 
-  from.close();
+    jobs.clear();
+    if (!buf.empty()) {
+      writeall(walfd, buf, woff);
+      woff += buf.size();
+    }
+    assert(fdatasync(walfd) == 0);
+
+    assert(pthread_mutex_lock(&wmutex) == 0);
+    durable = last;
+    nsyncs++;
+    if (nsyncs % 1000 == 0)
+      printf("log::writer: %llu records in %llu syncs\n", nrecs, nsyncs);
+    pthread_cond_broadcast(&dcond);
+    assert(pthread_mutex_unlock(&wmutex) == 0);
+  }
 }
 
-std::string 
-log::dump()
+std::string
+log::snapshot()
+{
+  std::map<unsigned,std::string> recent;
+  std::map<unsigned,std::string>::reverse_iterator it;
+  for (it = pxs->values.rbegin();
+       it != pxs->values.rend() && recent.size() < keep; it++)
+    recent[it->first] = it->second;
+
+  marshall m;
+  m << gen;
+  m << pxs->instance_h;
+  m << pxs->n_h;
+  m << pxs->n_a;
+  m << pxs->v_a;
+  m << recent;
+  return m.str();
+}
+
+void
+log::load(std::string payload)
 {
-  std::ifstream from;
-  std::string res;
-  std::string v;
-  from.open(name.c_str());
-  while (getline(from, v)) {
-    res = res + v + "\n";
+  unmarshall u(payload);
+  u >> gen;
+  u >> pxs->instance_h;
+  u >> pxs->n_h;
+  u >> pxs->n_a;
+  u >> pxs->v_a;
+  u >> pxs->values;
+  printf("logread: snapshot at instance %d, %u views\n", pxs->instance_h,
+	 (unsigned) pxs->values.size());
+}
+
+void
+log::replay(std::string payload)
+{
+  unmarshall u(payload);
+  int type;
+  u >> type;
+  if (type == DONE) {
+    unsigned instance;
+    std::string v;
+    u >> instance;
+    u >> v;
+    pxs->values[instance] = v;
+    pxs->instance_h = instance;
+    printf ("logread: instance: %d w. v = %s\n", instance,
+	    pxs->values[instance].c_str());
+    pxs->v_a.clear();
+    pxs->n_a.n = 0;
+  } else if (type == HIGH) {
+    u >> pxs->n_h;
+    printf("logread: high update: %d(%s)\n", pxs->n_h.n, pxs->n_h.m.c_str());
+  } else if (type == PROP) {
+    u >> pxs->n_a;
+    u >> pxs->v_a;
+    printf("logread: prop update %d(%s) with v = %s\n", pxs->n_a.n,
+	   pxs->n_a.m.c_str(), pxs->v_a.c_str());
+  } else {
+    printf("logread: unknown log record\n");
+    assert(0);
   }
-  from.close();
-  return res;
 }
 
+// Replaces the snapshot file with f. The new snapshot is on disk before
+// the rename, so a crash leaves either the old or the new one.
 void
-log::restore(std::string s)
+log::writesnap(std::string f)
+{
+  std::string tmp = snapname + ".tmp";
+  int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  assert(fd >= 0);
+  writeall(fd, f, 0);
+  assert(fsync(fd) == 0);
+  close(fd);
+  assert(rename(tmp.c_str(), snapname.c_str()) == 0);
+}
+
+// Drops the WAL after off and preallocates it again with zeros.
+void
+log::resetwal(unsigned long long off)
+{
+  assert(ftruncate(walfd, off) == 0);
+  if (off < prealloc)
+    assert(posix_fallocate(walfd, off, prealloc - off) == 0);
+  woff = off;
+}
+
+void
+log::writeviews()
 {
   std::ofstream f;
-  printf("restore: %s\n", s.c_str());
   f.open(name.c_str(), std::ios::trunc);
-  f << s;
+  std::map<unsigned,std::string>::iterator it;
+  for (it = pxs->values.begin(); it != pxs->values.end(); it++)
+    f << "done " << it->first << " " << it->second << "\n";
   f.close();
 }
 
-// XXX should be an atomic operation
+// Assumes the writer is idle.
+void
+log::logread(void)
+{
+  std::string buf, payload;
+  unsigned off = 0;
+
+  printf ("logread\n");
+  if (readfile(snapname, buf)) {
+    if (!unframe(buf, off, payload)) {
+      printf("logread: bad snapshot %s\n", snapname.c_str());
+      assert(0);
+    }
+    load(payload);
+  }
+
+  buf.clear();
+  off = 0;
+  nrecords = 0;
+  readfile(walname, buf);
+  unsigned good = 0;
+  while (unframe(buf, off, payload)) {
+    unmarshall u(payload);
+    unsigned g;
+    u >> g;
+    if (g != gen)
+      break;
+    replay(payload.substr(4));
+    nrecords++;
+    good = off;
+  }
+
+  if (walfd < 0) {
+    walfd = open(walname.c_str(), O_RDWR | O_CREAT, 0644);
+    assert(walfd >= 0);
+  }
+  // whatever follows the last good record is a torn write or the WAL of
+  // an older generation
+  resetwal(good);
+  assert(fdatasync(walfd) == 0);
+}
+
+// The state as a single snapshot frame, for a node that joins.
+std::string
+log::dump()
+{
+  return frame(snapshot());
+}
+
+// Assumes the acceptor is locked, so nothing new is queued.
 void
+log::restore(std::string s)
+{
+  std::string payload;
+  unsigned off = 0;
+  unsigned mygen = gen;
+  printf("restore: %u bytes\n", (unsigned) s.size());
+  if (!unframe(s, off, payload)) {
+    printf("restore: bad snapshot\n");
+    return;
+  }
+  assert(pthread_mutex_lock(&wmutex) == 0);
+  unsigned long long last = queued;
+  assert(pthread_mutex_unlock(&wmutex) == 0);
+  sync(last);
+
+  load(payload);
+  // the local WAL must not match the new snapshot
+  if (gen <= mygen)
+    gen = mygen;
+  gen++;
+  nrecords = 0;
+  writesnap(frame(snapshot()));
+  resetwal(0);
+  writeviews();
+}
+
+unsigned long long
 log::loginstance(unsigned instance, std::string v)
 {
+  marshall m;
+  m << (int) DONE;
+  m << instance;
+  m << v;
+  unsigned long long seq = append(m.str());
+
   std::ofstream f;
   f.open(name.c_str(), std::ios::app);
   f << "done";
@@ -94,35 +408,24 @@ log::loginstance(unsigned instance, std::string v)
   f << v;
   f << "\n";
   f.close();
+  return seq;
 }
 
-void
+unsigned long long
 log::loghigh(prop_t n_h)
 {
-  std::ofstream f;
-  f.open(name.c_str(), std::ios::app);
-  f << "high";
-  f << " ";
-  f << n_h.n;
-  f << " ";
-  f << n_h.m;
-  f << "\n";
-  f.close();
+  marshall m;
+  m << (int) HIGH;
+  m << n_h;
+  return append(m.str());
 }
 
-void
+unsigned long long
 log::logprop(prop_t n, std::string v)
 {
-  std::ofstream f;
-  f.open(name.c_str(), std::ios::app);
-  f << "prop";
-  f << " ";
-  f << n.n;
-  f << " ";
-  f << n.m;
-  f << " ";
-  f << v;
-  f << "\n";
-  f.close();
+  marshall m;
+  m << (int) PROP;
+  m << n;
+  m << v;
+  return append(m.str());
 }
-
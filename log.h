@@ -3,22 +3,70 @@
 
 #include <string>
 #include <vector>
+#include <list>
+#include <pthread.h>
 
 
 class acceptor;
 
 class log {
  private:
-  std::string name;
+  std::string name;      // decided views as text, one "done" line each
+  std::string walname;   // binary records since the last snapshot
+  std::string snapname;  // acceptor state at the last snapshot
   acceptor *pxs;
+  int walfd;
+  unsigned nrecords;     // records queued since the last snapshot
+  unsigned gen;          // generation of the WAL, bumped by each snapshot
+
+  // WAL records between snapshots, decided instances a snapshot keeps,
+  // and bytes preallocated for the WAL
+  static const unsigned snapevery = 1024;
+  static const unsigned keep = 100;
+  static const unsigned prealloc = 1 << 20;
+
+  enum rectype { DONE = 1, HIGH, PROP };
+
+  // Group commit. Callers queue records and wait for their sequence
+  // number to become durable; the writer thread writes everything queued
+  // so far and makes it durable with a single fdatasync.
+  struct job_t {
+    std::string data;
+    bool snap;           // data is a snapshot, not a WAL record
+  };
+  std::list<job_t> queue;
+  unsigned long long queued;   // last record queued
+  unsigned long long durable;  // last record on disk
+  unsigned long long woff;     // WAL write offset
+  unsigned long long nsyncs;   // fdatasyncs done, for the statistics
+  pthread_mutex_t wmutex;
+  pthread_cond_t wcond;        // work for the writer
+  pthread_cond_t dcond;        // durable advanced
+
+  static std::string frame(std::string payload);
+  static bool unframe(const std::string &buf, unsigned &off,
+		      std::string &payload);
+  unsigned long long append(std::string payload);
+  void replay(std::string payload);
+  std::string snapshot();
+  void load(std::string payload);
+  void writesnap(std::string f);
+  void resetwal(unsigned long long off);
+  void writeviews();
  public:
   log (acceptor*, std::string _me);
   std::string dump();
   void restore(std::string s);
   void logread(void);
-  void loginstance(unsigned instance, std::string v);
-  void loghigh(prop_t n_h);
-  void logprop(prop_t n_a, std::string v);
+  void writer();
+
+  // The log* calls expect the acceptor to be locked and updated already.
+  // They return the record's sequence number for sync, which may be
+  // called after unlocking the acceptor.
+  unsigned long long loginstance(unsigned instance, std::string v);
+  unsigned long long loghigh(prop_t n_h);
+  unsigned long long logprop(prop_t n_a, std::string v);
+  void sync(unsigned long long seq);
 };
 
 #endif /* log_h */
@@ -0,0 +1,90 @@
+//
+// Paxos log benchmark: accepts per second with the log on disk
+//
+// Runs an acceptor on the given port and sends it accept requests from
+// a number of threads, each over its own connection. Every accept is
+// acknowledged only after its record is on disk, so the rate shows how
+// well concurrent accepts share an fdatasync.
+//
+
+#include "paxos.h"
+#include "rpc.h"
+#include <arpa/inet.h>
+#include <sys/time.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+
+int nt = 8;
+int seconds = 5;
+std::string dst;
+volatile bool stop = false;
+unsigned long long accepts[64];
+
+void *
+acceptor_client(void *x)
+{
+  int i = (long) x;
+  sockaddr_in dstsock;
+  make_sockaddr(dst.c_str(), &dstsock);
+  rpcc *cl = new rpcc(dstsock);
+  assert(cl->bind() >= 0);
+
+  paxos_protocol::acceptarg a;
+  a.instance = 2;
+  a.n.n = 1;
+  a.n.m = dst;
+  a.v = dst;
+  while (!stop) {
+    int r;
+    if (cl->call(paxos_protocol::acceptreq, dst, a, r) == paxos_protocol::OK
+        && r == 1)
+      accepts[i]++;
+  }
+  return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  setvbuf(stdout, NULL, _IONBF, 0);
+  setvbuf(stderr, NULL, _IONBF, 0);
+
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s port [threads] [seconds]\n", argv[0]);
+    exit(1);
+  }
+  dst = argv[1];
+  if (argc > 2)
+    nt = atoi(argv[2]);
+  if (argc > 3)
+    seconds = atoi(argv[3]);
+  if (nt < 1 || nt > 64) {
+    fprintf(stderr, "threads must be between 1 and 64\n");
+    exit(1);
+  }
+
+  // no config: nothing is ever decided
+  acceptor *acc = new acceptor(NULL, true, dst, dst);
+
+  pthread_t th[64];
+  for (int i = 0; i < nt; i++)
+    assert(pthread_create(&th[i], NULL, acceptor_client, (void *) (long) i) == 0);
+
+  struct timeval start, end;
+  gettimeofday(&start, NULL);
+  sleep(seconds);
+  stop = true;
+  gettimeofday(&end, NULL);
+
+  unsigned long long total = 0;
+  for (int i = 0; i < nt; i++)
+    total += accepts[i];
+  double secs = (end.tv_sec - start.tv_sec) +
+    (end.tv_usec - start.tv_usec) / 1000000.0;
+  fprintf(stderr, "%d threads: %llu accepts in %.2f s, %.0f accepts/s\n",
+          nt, total, secs, total / secs);
+  // the clients may be waiting for the log, do not tear it down
+  (void) acc;
+  exit(0);
+}
@@ -2,6 +2,7 @@
 #include "handle.h"
 // #include <signal.h>
 #include <stdio.h>
+#include <sys/time.h>
 
 // This module implements the proposer and acceptor of the Paxos
 // distributed algorithm as described by Lamport's "Paxos Made
@@ -11,6 +12,13 @@
 // this instance of Paxos, the acceptor invokes the upcall
 // paxos_commit to inform higher layers of the agreed value for this
 // instance.
+//
+// Instances run one after the other, and the proposer acts as a stable
+// leader (Multi-Paxos): acceptors keep n_h across instances, so once a
+// majority promised a proposer's number the promise also covers the
+// next instance, and that proposer goes straight to the accept round.
+// A prepare from another proposer raises n_h at the acceptors; the
+// leader's accept is then rejected and it runs both phases again.
 
 
 bool
@@ -73,12 +81,21 @@ proposer::majority(const std::vector<std::string> &l1,
 proposer::proposer(class paxos_change *_cfg, class acceptor *_acceptor, 
 		   std::string _me)
   : cfg(_cfg), acc (_acceptor), me (_me), break1 (false), break2 (false), 
-    stable (true)
+    stable (true), leader (false), leader_instance (0)
 {
   assert (pthread_mutex_init(&pxs_mutex, NULL) == 0);
 
 }
 
+static long
+elapsed_ms(const struct timeval &start)
+{
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return (now.tv_sec - start.tv_sec) * 1000 +
+    (now.tv_usec - start.tv_usec) / 1000;
+}
+
 bool
 proposer::run(int instance, std::vector<std::string> nodes, std::string newv)
 {
@@ -86,7 +103,9 @@ proposer::run(int instance, std::vector<std::string> nodes, std::string newv)
     std::vector<std::string> nodes1;
     std::string v;
     bool r = false;
+    struct timeval start;
 
+    gettimeofday(&start, NULL);
     pthread_mutex_lock(&pxs_mutex);
     printf("start: initiate paxos for %s w. i=%d v=%s stable=%d\n",
         print_members(nodes).c_str(), instance, newv.c_str(), stable);
@@ -100,6 +119,35 @@ proposer::run(int instance, std::vector<std::string> nodes, std::string newv)
     c_nodes = nodes;
     c_v = newv;
 
+    // stable leader: skip prepare, fall back to it if the accept round
+    // fails
+    if (leader && instance == (int) leader_instance && majority(nodes, promised))
+    {
+        printf("paxos::manager: leader with %u(%s), accept only for i=%d\n",
+               my_n.n, my_n.m.c_str(), instance);
+
+        breakpoint1();
+
+        accepts.clear();
+        accept(instance, accepts, nodes, c_v);
+
+        if (majority(c_nodes, accepts)) {
+            printf("paxos::manager: received a majority of accept responses, v=%s\n", c_v.c_str());
+
+            breakpoint2();
+
+            decide(instance, c_nodes, c_v);
+            printf("paxos::manager: decided i=%d in %ld ms\n", instance,
+                   elapsed_ms(start));
+            leader_instance = instance + 1;
+            stable = true;
+            pthread_mutex_unlock(&pxs_mutex);
+            return true;
+        }
+        printf("paxos::manager: leader lost the accept round, preparing\n");
+    }
+    leader = false;
+
     accepts.clear();
     v.clear();
     if (prepare(instance, accepts, nodes, v))
@@ -116,15 +164,22 @@ proposer::run(int instance, std::vector<std::string> nodes, std::string newv)
 
             nodes1 = accepts;
             accepts.clear();
-            accept(instance, accepts, nodes1, v); // FIXME: add support for oldinstance from accept RPC
+            accept(instance, accepts, c_nodes, v); // FIXME: add support for oldinstance from accept RPC
 
             if (majority(c_nodes, accepts)) {
                 printf("paxos::manager: received a majority of accept responses, v=%s\n", v.c_str());
 
                 breakpoint2();
 
-                decide(instance, accepts, v); // FIXME: add support for oldinstance from decide RPC
+                decide(instance, c_nodes, v); // FIXME: add support for oldinstance from decide RPC
+                printf("paxos::manager: decided i=%d in %ld ms\n", instance,
+                       elapsed_ms(start));
                 r = true;
+
+                // the promises hold for the next instance too
+                leader = true;
+                leader_instance = instance + 1;
+                promised = nodes1;
             }
             else
             {
@@ -149,6 +204,113 @@ proposer::run(int instance, std::vector<std::string> nodes, std::string newv)
     return r;
 }
 
+// Proposer RPCs go out to all nodes at once, one thread per node, and
+// the proposer waits only until it has the answers it needs, so a dead
+// or partitioned node does not add its timeout to every phase. The
+// answers are collected in a round shared by the proposer and the RPC
+// threads; answers that arrive after the proposer moved on are dropped,
+// and whoever lets go of the round last frees it.
+struct pxround {
+  pthread_mutex_t m;
+  pthread_cond_t c;
+  int refs;		// proposer plus RPCs still running
+  unsigned npending;	// RPCs without an answer
+  int proc;
+  std::string me;
+  std::vector<std::string> nodes;
+  paxos_protocol::preparearg parg;
+  paxos_protocol::acceptarg aarg;
+  paxos_protocol::decidearg darg;
+
+  // per node
+  std::vector<bool> done;
+  std::vector<int> ret;	// RPC status
+  std::vector<paxos_protocol::prepareres> pres;
+  std::vector<int> res;	// accept and decide reply
+
+  pxround(int _proc, std::string _me, const std::vector<std::string> &_nodes)
+    : refs(1), npending(_nodes.size()), proc(_proc), me(_me), nodes(_nodes),
+      done(_nodes.size(), false), ret(_nodes.size(), 0),
+      pres(_nodes.size()), res(_nodes.size(), 0) {
+    assert(pthread_mutex_init(&m, NULL) == 0);
+    assert(pthread_cond_init(&c, NULL) == 0);
+  }
+  ~pxround() {
+    assert(pthread_mutex_destroy(&m) == 0);
+    assert(pthread_cond_destroy(&c) == 0);
+  }
+};
+
+struct pxcall_t {
+  pxround *r;
+  unsigned i;
+};
+
+static void
+pxrelease(pxround *r)
+{
+  assert(pthread_mutex_lock(&r->m) == 0);
+  bool last = (--r->refs == 0);
+  assert(pthread_mutex_unlock(&r->m) == 0);
+  if (last)
+    delete r;
+}
+
+static void *
+pxcall(void *x)
+{
+  pxcall_t *c = (pxcall_t *) x;
+  pxround *r = c->r;
+  unsigned i = c->i;
+  delete c;
+
+  // the arguments do not change once the round is sent
+  paxos_protocol::prepareres pres;
+  int res = 0;
+  int ret = rpc_const::bind_failure;
+  handle h(r->nodes[i]);
+  if (h.get_rpcc()) {
+    if (r->proc == paxos_protocol::preparereq)
+      ret = h.get_rpcc()->call(paxos_protocol::preparereq, r->me, r->parg, pres,
+                               rpcc::to(1000));
+    else if (r->proc == paxos_protocol::acceptreq)
+      ret = h.get_rpcc()->call(paxos_protocol::acceptreq, r->me, r->aarg, res,
+                               rpcc::to(1000));
+    else
+      ret = h.get_rpcc()->call(paxos_protocol::decidereq, r->me, r->darg, res,
+                               rpcc::to(1000));
+  } else {
+    printf("proposer: failed to create handle for %s\n", r->nodes[i].c_str());
+  }
+
+  assert(pthread_mutex_lock(&r->m) == 0);
+  r->done[i] = true;
+  r->ret[i] = ret;
+  r->pres[i] = pres;
+  r->res[i] = res;
+  r->npending--;
+  assert(pthread_cond_broadcast(&r->c) == 0);
+  assert(pthread_mutex_unlock(&r->m) == 0);
+  pxrelease(r);
+  return 0;
+}
+
+static void
+pxsend(pxround *r)
+{
+  for (unsigned i = 0; i < r->nodes.size(); i++) {
+    pxcall_t *c = new pxcall_t;
+    c->r = r;
+    c->i = i;
+    assert(pthread_mutex_lock(&r->m) == 0);
+    r->refs++;
+    assert(pthread_mutex_unlock(&r->m) == 0);
+    pthread_t th;
+    assert(pthread_create(&th, NULL, &pxcall, (void *) c) == 0);
+    assert(pthread_detach(th) == 0);
+  }
+}
+
 bool
 proposer::prepare(unsigned instance, std::vector<std::string> &accepts, 
          std::vector<std::string> nodes,
@@ -159,62 +321,84 @@ proposer::prepare(unsigned instance, std::vector<std::string> &accepts,
     my_n.m = me;
     printf("proposer:prepare: calculating my_n, after, my_n.n=%u, my_n.m=%s, acc->get_n_h().n=%u, me=%s\n", my_n.n, my_n.m.c_str(), acc->get_n_h().n, me.c_str());
 
+    pxround *r = new pxround(paxos_protocol::preparereq, me, nodes);
+    r->parg.instance = instance;
+    r->parg.n = my_n;
+    printf("proposer::prepare: sending preparereq RPC to %s\n", print_members(nodes).c_str());
+    pxsend(r);
+
+    // wait for a majority of promises, or for an answer that ends the
+    // round early
+    std::vector<std::string> promises;
+    assert(pthread_mutex_lock(&r->m) == 0);
+    while (r->npending > 0) {
+        bool stop = false;
+        promises.clear();
+        for (unsigned i = 0; i < nodes.size(); i++) {
+            if (!r->done[i] || r->ret[i] != paxos_protocol::OK)
+                continue;
+            if (r->pres[i].oldinstance || !r->pres[i].accept)
+                stop = true;
+            else
+                promises.push_back(nodes[i]);
+        }
+        if (stop || majority(nodes, promises))
+            break;
+        assert(pthread_cond_wait(&r->c, &r->m) == 0);
+    }
+    std::vector<bool> done = r->done;
+    std::vector<int> ret = r->ret;
+    std::vector<paxos_protocol::prepareres> res = r->pres;
+    assert(pthread_mutex_unlock(&r->m) == 0);
+    pxrelease(r);
+
     // set maximum id to the minimum (to be updated in a loop with larger id)
     prop_t max_n_a = {0, std::string()};
 
     for (unsigned i = 0; i < nodes.size(); i++)
     {
-        handle h(nodes[i]);
-
-        if (h.get_rpcc()) {
-            paxos_protocol::prepareres res;
-            paxos_protocol::preparearg arg;
-
-            arg.instance = instance;
-            arg.n = my_n;
-
-            printf("proposer::prepare: sending preparereq RPC to %s\n", nodes[i].c_str());
+        if (!done[i])
+        {
+            printf("proposer::prepare: no response from %s yet\n", nodes[i].c_str());
+        }
+        else if (ret[i] == paxos_protocol::OK)
+        {
+            if (res[i].oldinstance)
+            {
+                printf("proposer::prepare: got oldinstance from %s\n", nodes[i].c_str());
+                acc->commit(instance, res[i].v_a);
+                stable = true;
 
-            if (h.get_rpcc()->call(paxos_protocol::preparereq, me, arg, res, rpcc::to(1000)) == paxos_protocol::OK)
+                return false;
+            }
+            else if (res[i].accept)
             {
-                if (res.oldinstance)
-                {
-                    printf("proposer::prepare: got oldinstance from %s\n", nodes[i].c_str());
-                    acc->commit(instance, res.v_a);
-                    stable = true;
+                printf("proposer::prepare: got prepareres from %s, res.n_a.n=%u, res.n_a.m=%s, res.v_a=%s\n", nodes[i].c_str(), res[i].n_a.n, res[i].n_a.m.c_str(), res[i].v_a.c_str());
 
-                    return false;
-                }
-                else if (res.accept)
-                {
-                    printf("proposer::prepare: got prepareres from %s, res.n_a.n=%u, res.n_a.m=%s, res.v_a=%s\n", nodes[i].c_str(), res.n_a.n, res.n_a.m.c_str(), res.v_a.c_str());
-
-                    // add node to the list of accepted nodes
-                    accepts.push_back(nodes[i]);
-
-                    // check if the node returned value and it's ID it largest than last found
-                    if (res.v_a.size() != 0 && res.n_a > max_n_a)
-                    {
-                        max_n_a = res.n_a;
-                        v = res.v_a;
-                        printf("proposer::propose: updated value to newv=%s, max_n_a.n=%u, max_n_a.m=%s\n",
-                               v.c_str(), max_n_a.n, max_n_a.m.c_str());
-                    }
-                }
-                else
+                // add node to the list of accepted nodes
+                accepts.push_back(nodes[i]);
+
+                // check if the node returned value and it's ID it largest than last found
+                if (res[i].v_a.size() != 0 && res[i].n_a > max_n_a)
                 {
-                    printf("proposer::prepare: got reject from %s\n", nodes[i].c_str());
-                    return false;
+                    max_n_a = res[i].n_a;
+                    v = res[i].v_a;
+                    printf("proposer::propose: updated value to newv=%s, max_n_a.n=%u, max_n_a.m=%s\n",
+                           v.c_str(), max_n_a.n, max_n_a.m.c_str());
                 }
             }
             else
             {
-                printf("proposer::prepare: failed to get response from %s\n", nodes[i].c_str());
+                // start above the acceptor's n_h next time
+                printf("proposer::prepare: got reject from %s, n_h.n=%u\n", nodes[i].c_str(), res[i].n_a.n);
+                if (res[i].n_a.n > my_n.n)
+                    my_n.n = res[i].n_a.n;
+                return false;
             }
         }
         else
         {
-            printf("proposer::prepare: failed to create handle for %s\n", nodes[i].c_str());
+            printf("proposer::prepare: failed to get response from %s\n", nodes[i].c_str());
         }
     }
 
@@ -226,63 +410,81 @@ void
 proposer::accept(unsigned instance, std::vector<std::string> &accepts,
         std::vector<std::string> nodes, std::string v)
 {
-    for (unsigned i = 0; i < nodes.size(); i++)
-    {
-        handle h(nodes[i]);
-
-        if (h.get_rpcc()) {
-            int res;
-            paxos_protocol::acceptarg arg;
-
-            arg.instance = instance;
-            arg.n = my_n;
-            arg.v = v;
-
-            printf("proposer::accept: sending acceptreq RPC to %s\n", nodes[i].c_str());
-
-            if (h.get_rpcc()->call(paxos_protocol::acceptreq, me, arg, res, rpcc::to(1000)) == paxos_protocol::OK)
-            {
-                // FIXME: add support for oldinstance from accept RPC
-                if (res)
-                {
-                    printf("proposer::accept: got acceptres from %s\n", nodes[i].c_str());
-                    accepts.push_back(nodes[i]);
-                }
-                else
-                    printf("proposer::accept: got reject from %s\n", nodes[i].c_str());
-            }
+    pxround *r = new pxround(paxos_protocol::acceptreq, me, nodes);
+    r->aarg.instance = instance;
+    r->aarg.n = my_n;
+    r->aarg.v = v;
+    printf("proposer::accept: sending acceptreq RPC to %s\n", print_members(nodes).c_str());
+    pxsend(r);
+
+    // wait for a majority of c_nodes to accept, or until that cannot
+    // happen any more
+    unsigned needed = (c_nodes.size() >> 1) + 1;
+    assert(pthread_mutex_lock(&r->m) == 0);
+    while (r->npending > 0) {
+        unsigned failed = 0;
+        accepts.clear();
+        for (unsigned i = 0; i < nodes.size(); i++) {
+            if (!r->done[i])
+                continue;
+            if (r->ret[i] == paxos_protocol::OK && r->res[i])
+                accepts.push_back(nodes[i]);
             else
-            {
-                printf("proposer::accept: failed to get response from %s\n", nodes[i].c_str());
-            }
+                failed++;
         }
-        else
+        if (majority(c_nodes, accepts) || nodes.size() - failed < needed)
+            break;
+        assert(pthread_cond_wait(&r->c, &r->m) == 0);
+    }
+    accepts.clear();
+    for (unsigned i = 0; i < nodes.size(); i++)
+    {
+        if (!r->done[i])
+            printf("proposer::accept: no response from %s yet\n", nodes[i].c_str());
+        else if (r->ret[i] != paxos_protocol::OK)
+            printf("proposer::accept: failed to get response from %s\n", nodes[i].c_str());
+        else if (r->res[i])
         {
-            printf("proposer::accept: failed to create handle for %s\n", nodes[i].c_str());
+            printf("proposer::accept: got acceptres from %s\n", nodes[i].c_str());
+            accepts.push_back(nodes[i]);
         }
+        else
+            // FIXME: add support for oldinstance from accept RPC
+            printf("proposer::accept: got reject from %s\n", nodes[i].c_str());
     }
+    assert(pthread_mutex_unlock(&r->m) == 0);
+    pxrelease(r);
 }
 
 void
 proposer::decide(unsigned instance, std::vector<std::string> nodes,
 	      std::string v)
 {
-    for (unsigned i = 0; i < nodes.size(); i++)
-    {
-        handle h(nodes[i]);
-        int res;
-        paxos_protocol::decidearg arg;
-
-        arg.instance = instance;
-        arg.v = v;
-
-        printf("proposer::decide: sending decidereq RPC to %s with arg.v=%s\n", nodes[i].c_str(), arg.v.c_str());
-
-        if (h.get_rpcc())
-            h.get_rpcc()->call(paxos_protocol::decidereq, me, arg, res, rpcc::to(1000));
-        else
-            printf("proposer::decide: failed to create handle for %s\n", nodes[i].c_str());
+    pxround *r = new pxround(paxos_protocol::decidereq, me, nodes);
+    r->darg.instance = instance;
+    r->darg.v = v;
+    printf("proposer::decide: sending decidereq RPC to %s with arg.v=%s\n", print_members(nodes).c_str(), v.c_str());
+    pxsend(r);
+
+    // the callers expect this node to have committed on return; the
+    // other nodes get the decide in the background
+    assert(pthread_mutex_lock(&r->m) == 0);
+    while (r->npending > 0) {
+        std::vector<std::string> answered;
+        bool mine = !isamember(me, nodes);
+        for (unsigned i = 0; i < nodes.size(); i++) {
+            if (!r->done[i])
+                continue;
+            answered.push_back(nodes[i]);
+            if (nodes[i] == me)
+                mine = true;
+        }
+        if (mine && majority(nodes, answered))
+            break;
+        assert(pthread_cond_wait(&r->c, &r->m) == 0);
     }
+    assert(pthread_mutex_unlock(&r->m) == 0);
+    pxrelease(r);
 }
 
 acceptor::acceptor(class paxos_change *_cfg, bool _first, std::string _me, 
@@ -301,8 +503,8 @@ acceptor::acceptor(class paxos_change *_cfg, bool _first, std::string _me,
 
   if (instance_h == 0 && _first) {
     values[1] = _value;
-    l->loginstance(1, _value);
     instance_h = 1;
+    l->sync(l->loginstance(1, _value));
   }
 
   pxs = new rpcs(atoi(_me.c_str()));
@@ -316,6 +518,10 @@ acceptor::preparereq(std::string src, paxos_protocol::preparearg a,
     paxos_protocol::prepareres &r)
 {
     // handle a preparereq message from proposer
+    // the reply waits until the new n_h is on disk, with the acceptor
+    // unlocked so that other requests can join the same disk write
+    unsigned long long seq = 0;
+    pthread_mutex_lock(&pxs_mutex);
 
     if (a.instance <= instance_h)
     {
@@ -326,16 +532,25 @@ acceptor::preparereq(std::string src, paxos_protocol::preparearg a,
     }
     else if (a.n > n_h)
     {
+        // the promise holds for all later instances too. Only a value
+        // accepted for the next instance matters; an acceptor that is
+        // behind has accepted nothing for a.instance
         printf("acceptor::preparereq: responding with prepareres to %s, a.n.n = %u, a.n.m = %s, n_h.n = %u, n_h.m = %s\n", src.c_str(), a.n.n, a.n.m.c_str(), n_h.n, n_h.m.c_str());
 
         n_h = a.n;
 
         r.oldinstance = 0;
         r.accept = 1;
-        r.n_a = n_a;
-        r.v_a = v_a;
+        if (a.instance == instance_h + 1) {
+            r.n_a = n_a;
+            r.v_a = v_a;
+        } else {
+            r.n_a.n = 0;
+            r.n_a.m = me;
+            r.v_a.clear();
+        }
 
-        l->loghigh(n_h);
+        seq = l->loghigh(n_h);
     }
     else
     {
@@ -343,8 +558,13 @@ acceptor::preparereq(std::string src, paxos_protocol::preparearg a,
 
         r.oldinstance = 0;
         r.accept = 0;
+        r.n_a = n_h;
     }
 
+    pthread_mutex_unlock(&pxs_mutex);
+    if (seq)
+        l->sync(seq);
+
     return paxos_protocol::OK;
 }
 
@@ -352,11 +572,19 @@ paxos_protocol::status
 acceptor::acceptreq(std::string src, paxos_protocol::acceptarg a, int &r)
 {
     // handle an acceptreq message from proposer
+    unsigned long long seq = 0;
+    pthread_mutex_lock(&pxs_mutex);
 
     if (a.instance <= instance_h)
     {
         printf("acceptor::acceptreq: responding with oldinstance to %s, a.instance = %u, instance_h = %u\n", src.c_str(), a.instance, instance_h);
-        ; // FIXME: add support for oldinstance from accept RPC
+        r = 0; // the proposer learns the decided value from its next prepare
+    }
+    else if (a.instance > instance_h + 1)
+    {
+        // n_a and v_a belong to the instance after instance_h
+        printf("acceptor::acceptreq: missed a decide, rejecting %s, a.instance = %u, instance_h = %u\n", src.c_str(), a.instance, instance_h);
+        r = 0;
     }
     else if (a.n >= n_h)
     {
@@ -364,7 +592,7 @@ acceptor::acceptreq(std::string src, paxos_protocol::acceptarg a, int &r)
         n_a = a.n;
         v_a = a.v;
 
-        l->logprop(a.n, a.v);
+        seq = l->logprop(a.n, a.v);
 
         r = 1;
     }
@@ -374,6 +602,10 @@ acceptor::acceptreq(std::string src, paxos_protocol::acceptarg a, int &r)
         r = 0;
     }
 
+    pthread_mutex_unlock(&pxs_mutex);
+    if (seq)
+        l->sync(seq);
+
     return paxos_protocol::OK;
 }
 
@@ -405,13 +637,13 @@ acceptor::commit_wo(unsigned instance, std::string value)
   if (instance > instance_h) {
     printf("commit: highestaccepteinstance = %d\n", instance);
     values[instance] = value;
-    l->loginstance(instance, value);
     instance_h = instance;
-    n_h.n = 0;
-    n_h.m = me;
+    // n_h stays: a stable leader's promise covers the next instance
     n_a.n = 0;
     n_a.m = me;
     v_a.clear();
+    // log after the update, the log may snapshot the state
+    l->sync(l->loginstance(instance, value));
     if (cfg) {
       pthread_mutex_unlock(&pxs_mutex);
       cfg->paxos_commit(instance, value);
@@ -431,14 +663,19 @@ acceptor::commit(unsigned instance, std::string value)
 std::string
 acceptor::dump()
 {
-  return l->dump();
+  pthread_mutex_lock(&pxs_mutex);
+  std::string s = l->dump();
+  pthread_mutex_unlock(&pxs_mutex);
+  return s;
 }
 
 void
 acceptor::restore(std::string s)
 {
+  pthread_mutex_lock(&pxs_mutex);
   l->restore(s);
   l->logread();
+  pthread_mutex_unlock(&pxs_mutex);
 }
 
 
@@ -16,7 +16,7 @@ class paxos_change {
 
 class acceptor {
  private:
-  log *l;
+  class log *l;
   rpcs *pxs;
   paxos_change *cfg;
   std::string me;
@@ -59,7 +59,7 @@ extern std::string print_members(const std::vector<std::string> &nodes);
 
 class proposer {
  private:
-  log *l;
+  class log *l;
   paxos_change *cfg;
   acceptor *acc;
   std::string me;
@@ -74,6 +74,13 @@ class proposer {
   std::string c_v;	// value we would like to propose
   prop_t my_n;		// number of the last proposal used in this instance
 
+  // Stable leader: once a majority promised my_n, the promise covers
+  // every later instance, so the next ones need only the accept round
+  // while no higher proposal got in between.
+  bool leader;
+  unsigned leader_instance;	// the instance the promises are good for
+  std::vector<std::string> promised;	// nodes that promised my_n
+
   bool prepare(unsigned instance, std::vector<std::string> &accepts, 
          std::vector<std::string> nodes,
          std::string &v);
@@ -28,7 +28,7 @@ class paxos_protocol {
   struct prepareres {
     int oldinstance;
     int accept;
-    prop_t n_a;
+    prop_t n_a;		// on reject: the acceptor's n_h
     std::string v_a;
   };
 
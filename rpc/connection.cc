@@ -349,12 +349,14 @@ tcpsconn::process_accept()
 
         // garbage collect all dead connections with refcount of 1
         std::map<int, connection *>::iterator i;
-        for (i = conns_.begin(); i != conns_.end(); i++) {
+        for (i = conns_.begin(); i != conns_.end(); ) {
                 if (i->second->isdead() && i->second->ref() == 1) {
 			jsl_log(JSL_DBG_2, "accept_loop garbage collected fd=%d\n",
 					i->second->channo());
                         i->second->decref();
-                        conns_.erase(i);
+                        conns_.erase(i++);
+                } else {
+                        i++;
                 }
         }
 
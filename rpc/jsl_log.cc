@@ -1,4 +1,15 @@
 #include "jsl_log.h"
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <assert.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "gettime.h"
 
 int JSL_DEBUG_LEVEL = 0;
 void
@@ -6,4 +17,224 @@ jsl_set_debug(int level) {
 	JSL_DEBUG_LEVEL = level;
 }
 
+// Every thread that logs gets a ring of RINGSIZE bytes. The thread is
+// the only writer of head and the drain thread the only writer of
+// tail, so neither needs a lock. A record is a rec_hdr followed by len
+// bytes of text, and may wrap around the end of the ring.
 
+#define RINGSIZE (64*1024)
+#define MAXMSG 1024
+
+struct rec_hdr {
+	unsigned len;
+	int level;
+	struct timespec ts;
+};
+
+struct ring {
+	char buf[RINGSIZE];
+	volatile unsigned long long head;	// bytes written
+	volatile unsigned long long tail;	// bytes drained
+	volatile unsigned dropped;
+	volatile bool dead;	// thread exited, free once drained
+	unsigned long tid;
+};
+
+struct rec {
+	struct timespec ts;
+	unsigned long tid;
+	int level;
+	std::string msg;
+	bool operator<(const rec &r) const {
+		return ts.tv_sec < r.ts.tv_sec ||
+			(ts.tv_sec == r.ts.tv_sec && ts.tv_nsec < r.ts.tv_nsec);
+	}
+};
+
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static pthread_key_t ringkey;
+static pthread_mutex_t rings_m = PTHREAD_MUTEX_INITIALIZER;	// rings
+static pthread_mutex_t drain_m = PTHREAD_MUTEX_INITIALIZER;	// one drain
+// never destroyed, the drain thread may run while the program exits
+static std::vector<ring *> *rings;
+
+static void
+ring_exit(void *x)
+{
+	((ring *) x)->dead = true;
+}
+
+static void
+ring_copy(ring *r, unsigned long long at, char *p, unsigned n, bool in)
+{
+	for (unsigned done = 0; done < n; ) {
+		unsigned off = (at + done) % RINGSIZE;
+		unsigned k = std::min(n - done, (unsigned) RINGSIZE - off);
+		if (in)
+			memcpy(r->buf + off, p + done, k);
+		else
+			memcpy(p + done, r->buf + off, k);
+		done += k;
+	}
+}
+
+static void
+writeall(const std::string &s)
+{
+	unsigned done = 0;
+	while (done < s.size()) {
+		int n = write(1, s.data() + done, s.size() - done);
+		if (n <= 0)
+			return;
+		done += n;
+	}
+}
+
+void
+jsl_flush()
+{
+	std::vector<rec> recs;
+	unsigned dropped = 0;
+
+	if (!rings)
+		return;
+	assert(pthread_mutex_lock(&drain_m) == 0);
+	assert(pthread_mutex_lock(&rings_m) == 0);
+	for (unsigned i = 0; i < rings->size(); ) {
+		ring *r = (*rings)[i];
+		bool dead = r->dead;
+		unsigned long long head = r->head;
+		__sync_synchronize();
+		unsigned long long tail = r->tail;
+		while (tail < head) {
+			rec_hdr h;
+			rec x;
+			ring_copy(r, tail, (char *) &h, sizeof(h), false);
+			x.ts = h.ts;
+			x.tid = r->tid;
+			x.level = h.level;
+			x.msg.resize(h.len);
+			ring_copy(r, tail + sizeof(h), &x.msg[0], h.len, false);
+			recs.push_back(x);
+			tail += sizeof(h) + h.len;
+		}
+		__sync_synchronize();
+		r->tail = tail;
+		if (r->dropped) {
+			dropped += __sync_fetch_and_and(&r->dropped, 0);
+		}
+		if (dead && r->head == r->tail) {
+			(*rings)[i] = rings->back();
+			rings->pop_back();
+			delete r;
+		} else {
+			i++;
+		}
+	}
+	assert(pthread_mutex_unlock(&rings_m) == 0);
+
+	// threads' rings are drained one after the other; put the records
+	// back in time order
+	std::stable_sort(recs.begin(), recs.end());
+	std::string out;
+	char pre[64];
+	for (unsigned i = 0; i < recs.size(); i++) {
+		snprintf(pre, sizeof(pre), "%ld.%06ld %lx %d: ",
+		    (long) recs[i].ts.tv_sec, recs[i].ts.tv_nsec / 1000,
+		    recs[i].tid, recs[i].level);
+		out += pre;
+		out += recs[i].msg;
+	}
+	if (dropped) {
+		snprintf(pre, sizeof(pre), "jsl_log: dropped %u messages\n",
+		    dropped);
+		out += pre;
+	}
+	// anything printf'ed so far goes first
+	fflush(stdout);
+	writeall(out);
+	assert(pthread_mutex_unlock(&drain_m) == 0);
+}
+
+static void *
+drainer(void *)
+{
+	struct timespec ts;
+	ts.tv_sec = 0;
+	ts.tv_nsec = 20 * 1000000;
+	while (1) {
+		nanosleep(&ts, NULL);
+		jsl_flush();
+	}
+	return 0;
+}
+
+static void
+jsl_init()
+{
+	rings = new std::vector<ring *>;
+	assert(pthread_key_create(&ringkey, ring_exit) == 0);
+	atexit(jsl_flush);
+	pthread_t th;
+	assert(pthread_create(&th, NULL, drainer, NULL) == 0);
+	assert(pthread_detach(th) == 0);
+}
+
+static ring *
+myring()
+{
+	pthread_once(&once, jsl_init);
+	ring *r = (ring *) pthread_getspecific(ringkey);
+	if (!r) {
+		r = new ring;
+		r->head = r->tail = 0;
+		r->dropped = 0;
+		r->dead = false;
+		r->tid = (unsigned long) pthread_self();
+		assert(pthread_setspecific(ringkey, r) == 0);
+		assert(pthread_mutex_lock(&rings_m) == 0);
+		rings->push_back(r);
+		assert(pthread_mutex_unlock(&rings_m) == 0);
+	}
+	return r;
+}
+
+void
+jsl_logf(int level, const char *fmt, ...)
+{
+	char msg[MAXMSG];
+	va_list ap;
+	va_start(ap, fmt);
+	int n = vsnprintf(msg, sizeof(msg), fmt, ap);
+	va_end(ap);
+	if (n < 0)
+		return;
+	if (n >= MAXMSG) {
+		// keep the line ending of a message that was cut short
+		n = MAXMSG - 1;
+		msg[n - 1] = '\n';
+	}
+
+	ring *r = myring();
+	rec_hdr h;
+	h.len = n;
+	h.level = level;
+	clock_gettime(CLOCK_REALTIME, &h.ts);
+	if (RINGSIZE - (r->head - r->tail) < sizeof(h) + n) {
+		__sync_fetch_and_add(&r->dropped, 1);
+		return;
+	}
+	ring_copy(r, r->head, (char *) &h, sizeof(h), true);
+	ring_copy(r, r->head + sizeof(h), msg, n, true);
+	__sync_synchronize();
+	r->head += sizeof(h) + n;
+}
+
+// JSL_DEBUG in the environment sets the level before main runs.
+static struct jsl_env {
+	jsl_env() {
+		char *e = getenv("JSL_DEBUG");
+		if (e)
+			JSL_DEBUG_LEVEL = atoi(e);
+	}
+} jsl_env_init;
@@ -1,6 +1,8 @@
 #ifndef __JSL_LOG_H__
 #define __JSL_LOG_H__ 1
 
+#include <stdlib.h>
+
 enum dbcode {
 	JSL_DBG_OFF = 0,
 	JSL_DBG_1 = 1, // Critical
@@ -9,17 +11,33 @@ enum dbcode {
 	JSL_DBG_4 = 4, // Debugging
 };
 
+// Messages above JSL_MAX_LEVEL are compiled out; build with, e.g.,
+// -DJSL_MAX_LEVEL=2 to drop the info and debugging traces entirely.
+// Below it, JSL_DEBUG_LEVEL (set with jsl_set_debug or the JSL_DEBUG
+// environment variable) decides at run time.
+#ifndef JSL_MAX_LEVEL
+#define JSL_MAX_LEVEL JSL_DBG_4
+#endif
+
 extern int JSL_DEBUG_LEVEL;
 
+// Messages are formatted by the caller into a ring buffer of its own
+// thread and written out by a background thread, so logging costs no
+// system call and no lock on the calling thread. When a thread's ring
+// is full its messages are dropped and counted.
 #define jsl_log(level,...)                                    \
 	do {                                                        \
-		if(JSL_DEBUG_LEVEL < abs(level))			      							\
+		if(abs(level) > JSL_MAX_LEVEL || JSL_DEBUG_LEVEL < abs(level)) \
 		{;}                                                       \
 		else {                                                    \
-			{ printf(__VA_ARGS__);}														\
+			jsl_logf(abs(level), __VA_ARGS__);                      \
 		}                                                         \
 	} while(0)
 
 void jsl_set_debug(int level);
+void jsl_logf(int level, const char *fmt, ...)
+	__attribute__ ((format (printf, 2, 3)));
+// Writes out everything logged so far. Runs at exit too.
+void jsl_flush();
 
 #endif // __JSL_LOG_H__
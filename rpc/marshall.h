@@ -13,13 +13,17 @@
 #define max(a,b) ((a>b)?a:b)
 
 struct req_header {
-	req_header(int x=0, int p=0, int c = 0, int s = 0, int xi = 0):
-		xid(x), proc(p), clt_nonce(c), srv_nonce(s), xid_rep(xi) {}
+	req_header(int x=0, int p=0, int c = 0, int s = 0, int xi = 0,
+	    unsigned int t = 0, unsigned int sp = 0):
+		xid(x), proc(p), clt_nonce(c), srv_nonce(s), xid_rep(xi),
+		trace(t), span(sp) {}
 	int xid;
 	int proc;
 	unsigned int clt_nonce;
 	unsigned int srv_nonce;
 	int xid_rep;
+	unsigned int trace;	// trace of the caller, 0 if none (see trace.h)
+	unsigned int span;	// the caller's span for this call
 };
 
 struct reply_header {
@@ -91,6 +95,8 @@ class marshall {
 			pack((int)h.clt_nonce);
 			pack((int)h.srv_nonce);
 			pack(h.xid_rep);
+			pack((int)h.trace);
+			pack((int)h.span);
 			_ind = saved_sz;
 		}
 
@@ -181,6 +187,8 @@ class unmarshall {
 			unpack((int *)&h->clt_nonce);
 			unpack((int *)&h->srv_nonce);
 			unpack(&h->xid_rep);
+			unpack((int *)&h->trace);
+			unpack((int *)&h->span);
 			_ind = RPC_HEADER_SZ;
 		}
 
@@ -8,7 +8,8 @@
 #include <sys/epoll.h>
 #endif
 
-#define MAX_POLL_FDS 128
+// select() cannot watch fds above FD_SETSIZE
+#define MAX_POLL_FDS FD_SETSIZE
 
 typedef enum {
 	CB_NONE = 0x0,
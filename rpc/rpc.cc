@@ -72,10 +72,15 @@
 
 #include "jsl_log.h"
 #include "gettime.h"
+#include "trace.h"
+#include <sstream>
 
 const rpcc::TO rpcc::to_max = { 120000 };
 const rpcc::TO rpcc::to_min = { 1000 };
 
+std::map<unsigned int, rpcc::stat_t> rpcc::stats_;
+pthread_mutex_t rpcc::stats_m_ = PTHREAD_MUTEX_INITIALIZER;
+
 rpcc::caller::caller(unsigned int xxid, unmarshall *xun)
 : xid(xxid), un(xun), done(false)
 {
@@ -190,6 +195,14 @@ rpcc::call1(unsigned int proc, marshall &req, unmarshall &rep,
 {
 
 	caller ca(0, &rep);
+	struct timespec start;
+	clock_gettime(CLOCK_REALTIME, &start);
+	trace_ctx tc = trace_current();
+	trace_ctx mine;
+	if (tc.trace) {
+		mine.trace = tc.trace;
+		mine.span = trace_newid();
+	}
 	{
 		ScopedLock ml(&m_);
 
@@ -206,7 +219,8 @@ rpcc::call1(unsigned int proc, marshall &req, unmarshall &rep,
 		ca.xid = xid_++;
 		calls_[ca.xid] = &ca;
 
-		req_header h(ca.xid, proc, clt_nonce_, srv_nonce_, xid_rep_window_.front());
+		req_header h(ca.xid, proc, clt_nonce_, srv_nonce_, xid_rep_window_.front(),
+				mine.trace, mine.span);
 		req.pack_req_header(h);
 	}
 
@@ -220,12 +234,14 @@ rpcc::call1(unsigned int proc, marshall &req, unmarshall &rep,
 
 	bool transmit = true;
 	connection *ch = NULL;
+	int nsent = 0;
 
 	while (1) {
 
 		if (transmit) {
 			get_refconn(&ch);
 			if (ch) {
+				nsent++;
 			        if (reachable_) ch->send(req.cstr(), req.size());
 				else jsl_log(JSL_DBG_1, "not reachable\n");
 				jsl_log(JSL_DBG_2, 
@@ -289,6 +305,23 @@ rpcc::call1(unsigned int proc, marshall &req, unmarshall &rep,
 
 	if (ch)
 		ch->decref();
+
+	{
+		ScopedLock sl(&stats_m_);
+		stat_t &st = stats_[proc];
+		st.latency.add(usec_since(start));
+		if (nsent > 1)
+			st.retrans += nsent - 1;
+		if (!ca.done)
+			st.timeouts++;
+	}
+	if (mine.trace) {
+		char name[64];
+		snprintf(name, sizeof(name), "call %x %s:%d", proc,
+				inet_ntoa(dst_.sin_addr), ntohs(dst_.sin_port));
+		trace_record(mine, tc.span, name, start,
+				ca.done ? ca.intret : rpc_const::timeout_failure);
+	}
 	//destruction of req automatically frees its buffer
 	return (ca.done? ca.intret : rpc_const::timeout_failure);
 }
@@ -387,6 +420,7 @@ rpcs::rpcs(unsigned int p1, int count)
 	assert(pthread_mutex_init(&count_m_, 0) == 0);
 	assert(pthread_mutex_init(&reply_window_m_, 0) == 0);
 	assert(pthread_mutex_init(&conss_m_, 0) == 0);
+	assert(pthread_mutex_init(&stats_m_, 0) == 0);
 
 	set_rand_seed();
 	nonce_ = random();
@@ -398,6 +432,7 @@ rpcs::rpcs(unsigned int p1, int count)
 	}
 
 	reg(rpc_const::bind, this, &rpcs::rpcbind);
+	reg(rpc_const::stats, this, &rpcs::rpcstats);
 	dispatchpool_ = new ThrPool(10,false);
 
 	listener_ = new tcpsconn(this, port_, lossytest_);
@@ -472,6 +507,7 @@ rpcs::dispatch(djob_t *j)
 {
 	connection *c = j->conn;
 	unmarshall req(j->buf, j->sz);
+	unsigned long long queued = usec_since(j->queued);
 	delete j;
 
 	req_header h;
@@ -558,7 +594,31 @@ rpcs::dispatch(djob_t *j)
 				updatestat(proc);
 			}
 
-			rh.ret = f->fn(req, rep);
+			{
+				struct timespec start;
+				clock_gettime(CLOCK_REALTIME, &start);
+				// the handler, and the RPCs it makes, run in the
+				// caller's trace
+				trace_ctx saved = trace_current();
+				trace_ctx mine;
+				if (h.trace) {
+					mine.trace = h.trace;
+					mine.span = trace_newid();
+				}
+				trace_set(mine);
+				rh.ret = f->fn(req, rep);
+				trace_set(saved);
+				if (mine.trace) {
+					char name[64];
+					snprintf(name, sizeof(name), "handle %x port %d",
+							proc, port_);
+					trace_record(mine, h.span, name, start, rh.ret);
+				}
+				unsigned long long us = usec_since(start);
+				ScopedLock sl(&stats_m_);
+				stats_[proc].queue.add(queued);
+				stats_[proc].handler.add(us);
+			}
 			assert(rh.ret >= 0 || 
 					rh.ret == rpc_const::unmarshal_args_failure);
 
@@ -594,6 +654,7 @@ rpcs::dispatch(djob_t *j)
 			break;
 		case DONE: //duplicate and we still have the response
 			c->send(b1, sz1);
+			free(b1);
 			break;
 		case FORGOTTEN: //very old request and we don't have the response anymore
 			jsl_log(JSL_DBG_2, "rpcs::dispatch: very old request %u from %u\n", 
@@ -610,28 +671,19 @@ void
 rpcs::add_reply(unsigned int clt_nonce, unsigned int xid,
 		char *b, int sz)
 {
-    ScopedLock rwl(&reply_window_m_);
-        std::list<reply_t>::iterator it;
-        
-        if (reply_window_.find(clt_nonce)==reply_window_.end())
-        {
-            assert(false);
-            return;
-        }
-
-        it=reply_window_[clt_nonce].begin();
-        
-        while(it!=reply_window_[clt_nonce].end() && (*it).xid!=xid)
-            it++;
-        
-        if (it==reply_window_[clt_nonce].end())
-        {
-            assert(false);
-            return;
-        }
+	ScopedLock rwl(&reply_window_m_);
+	std::list<reply_t> &l = reply_window_[clt_nonce];
+	std::list<reply_t>::iterator it;
 
-        (*it).buf=b;
-        (*it).sz=sz;
+	for (it = l.begin(); it != l.end() && (*it).xid < xid; it++)
+		;
+	if (it == l.end() || (*it).xid != xid) {
+		// the client gave up on this request and acknowledged it
+		// meanwhile; keep the reply until its next request trims it
+		it = l.insert(it, reply_t(xid));
+	}
+	(*it).buf = b;
+	(*it).sz = sz;
 }
 
 void
@@ -648,70 +700,46 @@ rpcs::free_reply_window(void)
 		clt->second.clear();
 	}
 	reply_window_.clear();
+	xid_rep_.clear();
 }
 
 rpcs::rpcstate_t 
 rpcs::checkduplicate_and_update(unsigned int clt_nonce, unsigned int xid,
 		unsigned int xid_rep, char **b, int *sz)
 {
-        unsigned int windowSize=20;
-        std::list<reply_t>::iterator it;
 	ScopedLock rwl(&reply_window_m_);
+	std::list<reply_t> &l = reply_window_[clt_nonce];
+	std::list<reply_t>::iterator it;
 
-// If list of clt is empty, request is new
-        if (reply_window_[clt_nonce].size()<1)
-        {
-            reply_t reply(xid);
-            reply_window_[clt_nonce].push_front(reply);
-            return NEW;
-        }
-
-// Find earliest XID
-        unsigned int earliestXid=reply_window_[clt_nonce].back().xid;
-        for (it=reply_window_[clt_nonce].begin(); it!=reply_window_[clt_nonce].end(); it++)
-            if ((*it).xid < earliestXid)
-                earliestXid=(*it).xid;
-
-// We received acknowledgement of reply reception XID_rep
-        it=reply_window_[clt_nonce].begin();
-        while (it!=reply_window_[clt_nonce].end() && (*it).xid!=xid_rep)
-                it++;
-        if (it!=reply_window_[clt_nonce].end())
-            (*it).cb_present = true;
-
-// Delete old values if window is too long
-        if (reply_window_[clt_nonce].size()>=windowSize)
-        {
-            delete[] reply_window_[clt_nonce].back().buf;
-            reply_window_[clt_nonce].pop_back();
-        }
-
-// List is not empty. We check whether it contains reply with coresponding xid
-        it=reply_window_[clt_nonce].begin();
-        while(it!=reply_window_[clt_nonce].end() && (*it).xid!=xid)
-            it++;
-
-// In case it doesn't contain we check whether it is FORGOTTEN or NEW
-        if (it==reply_window_[clt_nonce].end())
-        {
+	// the client has all replies up to xid_rep, forget them. The window
+	// is kept sorted by xid, requests of one client can arrive in any
+	// order when it has several calls outstanding.
+	if (xid_rep > xid_rep_[clt_nonce])
+		xid_rep_[clt_nonce] = xid_rep;
+	while (!l.empty() && l.front().xid <= xid_rep_[clt_nonce]) {
+		free(l.front().buf);
+		l.pop_front();
+	}
 
-// If last reply's xid is greater than current xid, so current should be forgotten
-            if (earliestXid > xid)
-                return FORGOTTEN;
+	if (xid <= xid_rep_[clt_nonce])
+		return FORGOTTEN;
 
-            reply_t reply(xid);
-            reply_window_[clt_nonce].push_front(reply);
-            return NEW;
-        }
+	for (it = l.begin(); it != l.end() && (*it).xid < xid; it++)
+		;
+	if (it == l.end() || (*it).xid != xid) {
+		l.insert(it, reply_t(xid));
+		return NEW;
+	}
 
-// If list contains such xid, we already found it, now we check whether it is DONE or INPROGRESS
-        if ((*it).buf==NULL)
-            return INPROGRESS;
+	if ((*it).buf == NULL)
+		return INPROGRESS;
 
-// If buffer is not empty, than action is done
-        *b=(*it).buf;
-        *sz=(*it).sz;
-        return DONE;
+	// hand out a copy, the window entry can be freed as soon as
+	// reply_window_m_ is released
+	*b = (char *) malloc((*it).sz);
+	memcpy(*b, (*it).buf, (*it).sz);
+	*sz = (*it).sz;
+	return DONE;
 }
 
 //rpc handler
@@ -723,6 +751,132 @@ rpcs::rpcbind(int a, int &r)
 	return 0;
 }
 
+std::string
+rpcs::stats()
+{
+	std::ostringstream ost;
+	ScopedLock sl(&stats_m_);
+	ost << "server port " << port_ << "\n";
+	std::map<unsigned int, stat_t>::iterator it;
+	for (it = stats_.begin(); it != stats_.end(); it++) {
+		ost << "  proc " << std::hex << it->first << std::dec
+		    << " queue " << it->second.queue.str() << "\n";
+		ost << "  proc " << std::hex << it->first << std::dec
+		    << " handler " << it->second.handler.str() << "\n";
+	}
+	return ost.str();
+}
+
+//rpc handler: this server's stats followed by those of the process's
+//clients
+int
+rpcs::rpcstats(int a, std::string &r)
+{
+	r = stats() + rpcc::stats();
+	return 0;
+}
+
+std::string
+rpcc::stats()
+{
+	std::ostringstream ost;
+	ScopedLock sl(&stats_m_);
+	ost << "client\n";
+	std::map<unsigned int, stat_t>::iterator it;
+	for (it = stats_.begin(); it != stats_.end(); it++) {
+		ost << "  proc " << std::hex << it->first << std::dec
+		    << " latency " << it->second.latency.str()
+		    << " retrans " << it->second.retrans
+		    << " timeouts " << it->second.timeouts << "\n";
+	}
+	return ost.str();
+}
+
+unsigned long long
+usec_since(const struct timespec &start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	long long us = (now.tv_sec - start.tv_sec) * 1000000LL +
+		(now.tv_nsec - start.tv_nsec) / 1000;
+	return us < 0 ? 0 : us;
+}
+
+rpc_hist::rpc_hist() : n_(0), sum_(0), max_(0)
+{
+	memset(b_, 0, sizeof(b_));
+}
+
+int
+rpc_hist::bucket(unsigned long long us)
+{
+	if (us < 16)
+		return us;
+	int e = 63 - __builtin_clzll(us);
+	int sub = (us >> (e - 3)) & 7;
+	int b = 16 + (e - 4) * 8 + sub;
+	return b < nbuckets ? b : nbuckets - 1;
+}
+
+// the largest value that falls in bucket b
+unsigned long long
+rpc_hist::top(int b)
+{
+	if (b < 16)
+		return b;
+	int e = (b - 16) / 8 + 4;
+	unsigned long long sub = (b - 16) % 8;
+	return ((9 + sub) << (e - 3)) - 1;
+}
+
+void
+rpc_hist::add(unsigned long long us)
+{
+	n_++;
+	sum_ += us;
+	if (us > max_)
+		max_ = us;
+	b_[bucket(us)]++;
+}
+
+void
+rpc_hist::merge(const rpc_hist &h)
+{
+	n_ += h.n_;
+	sum_ += h.sum_;
+	if (h.max_ > max_)
+		max_ = h.max_;
+	for (int b = 0; b < nbuckets; b++)
+		b_[b] += h.b_[b];
+}
+
+unsigned long long
+rpc_hist::percentile(double p) const
+{
+	if (n_ == 0)
+		return 0;
+	unsigned long long want = (unsigned long long) (p * n_ / 100.0 + 0.5);
+	if (want == 0)
+		want = 1;
+	unsigned long long seen = 0;
+	for (int b = 0; b < nbuckets; b++) {
+		seen += b_[b];
+		if (seen >= want)
+			return top(b) < max_ ? top(b) : max_;
+	}
+	return max_;
+}
+
+std::string
+rpc_hist::str() const
+{
+	char buf[256];
+	snprintf(buf, sizeof(buf), "n %llu avg %llu p50 %llu p90 %llu p99 %llu "
+	    "p99.9 %llu max %llu us", n_, n_ ? sum_ / n_ : 0, percentile(50),
+	    percentile(90), percentile(99), percentile(99.9), max_);
+	return buf;
+}
+
 void
 marshall::rawbyte(unsigned char x)
 {
@@ -5,6 +5,8 @@
 #include <netinet/in.h>
 #include <list>
 #include <map>
+#include <string>
+#include <time.h>
 
 #include "thr_pool.h"
 #include "marshall.h"
@@ -24,8 +26,30 @@ class rpc_const {
 		static const int oldsrv_failure = -5;
 		static const int bind_failure = -6;
 		static const int cancel_failure = -7;
+		static const unsigned int stats = 2;  // handler number reserved for stats
 };
 
+// Latency histogram in microseconds, HDR style: exact below 16us, then
+// 8 buckets for every power of two, so a percentile is off by at most
+// 12.5%.
+class rpc_hist {
+	public:
+		static const int nbuckets = 16 + 40 * 8;
+		rpc_hist();
+		void add(unsigned long long us);
+		void merge(const rpc_hist &h);
+		unsigned long long count() const { return n_; }
+		unsigned long long percentile(double p) const;
+		std::string str() const;
+	private:
+		unsigned long long n_, sum_, max_;
+		unsigned long long b_[nbuckets];
+		static int bucket(unsigned long long us);
+		static unsigned long long top(int b);
+};
+
+unsigned long long usec_since(const struct timespec &start);
+
 // rpc client endpoint.
 // manages a xid space per destination socket
 // threaded: multiple threads can be sending RPCs,
@@ -70,6 +94,16 @@ class rpcc : public chanmgr {
 		std::map<int, caller *> calls_;
 		std::list<unsigned int> xid_rep_window_;
 
+		// per proc, over all rpcc objects of the process
+		struct stat_t {
+			stat_t() : retrans(0), timeouts(0) {}
+			rpc_hist latency;
+			unsigned long long retrans;
+			unsigned long long timeouts;
+		};
+		static std::map<unsigned int, stat_t> stats_;
+		static pthread_mutex_t stats_m_;
+
 	public:
 
 		rpcc(sockaddr_in d, bool retrans=true);
@@ -95,6 +129,8 @@ class rpcc : public chanmgr {
 
 		bool got_pdu(connection *c, char *b, int sz);
 
+		// latency, retransmissions and timeouts of the calls made so far
+		static std::string stats();
 
 		template<class R>
 			int call_m(unsigned int proc, marshall &req, R & r, TO to);
@@ -260,12 +296,10 @@ class rpcs : public chanmgr {
 	struct reply_t {
 		reply_t (unsigned int _xid) {
 			xid = _xid;
-			cb_present = false;
 			buf = NULL;
 			sz = 0;
 		}
 		unsigned int xid;
-		bool cb_present;
 		char *buf;
 		int sz;
 	};
@@ -276,6 +310,9 @@ class rpcs : public chanmgr {
 	// provide at most once semantics by maintaining a window of replies
 	// per client that that client hasn't acknowledged receiving yet.
 	std::map<unsigned int, std::list<reply_t> > reply_window_;
+	// per client, the highest xid_rep it has sent: it has got all replies
+	// up to that xid
+	std::map<unsigned int, unsigned int> xid_rep_;
 
 	void free_reply_window(void);
 	void add_reply(unsigned int clt_nonce, unsigned int xid, char *b, int sz);
@@ -294,6 +331,15 @@ class rpcs : public chanmgr {
 	int curr_counts_;
 	std::map<int, int> counts_;
 
+	// per proc, time spent waiting for a dispatch thread and in the
+	// handler
+	struct stat_t {
+		rpc_hist queue;
+		rpc_hist handler;
+	};
+	std::map<unsigned int, stat_t> stats_;
+	pthread_mutex_t stats_m_;
+
 	int lossytest_; 
 	bool reachable_;
 
@@ -309,10 +355,13 @@ class rpcs : public chanmgr {
 	protected:
 
 	struct djob_t {
-		djob_t (connection *c, char *b, int bsz):buf(b),sz(bsz),conn(c) {}
+		djob_t (connection *c, char *b, int bsz):buf(b),sz(bsz),conn(c) {
+			clock_gettime(CLOCK_REALTIME, &queued);
+		}
 		char *buf;
 		int sz;
 		connection *conn;
+		struct timespec queued;
 	};
 	void dispatch(djob_t *);
 
@@ -329,6 +378,10 @@ class rpcs : public chanmgr {
 	//RPC handler for clients binding
 	int rpcbind(int a, int &r);
 
+	//RPC handler returning stats() and rpcc::stats()
+	int rpcstats(int a, std::string &r);
+	std::string stats();
+
 	void set_reachable(bool r) { reachable_ = r; }
 
 	bool got_pdu(connection *c, char *b, int sz);
@@ -7,6 +7,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <getopt.h>
+#include <vector>
 #include "jsl_log.h"
 #include "gettime.h"
 
@@ -27,6 +28,7 @@ class srv {
 		int handle_fast(const int a, int &r);
 		int handle_slow(const int a, int &r);
 		int handle_bigrep(const int a, std::string &r);
+		int handle_echo(const std::string a, std::string &r);
 };
 
 // a handler. a and b are arguments, r is the result.
@@ -65,6 +67,13 @@ srv::handle_bigrep(const int len, std::string &r)
 	return 0;
 }
 
+int
+srv::handle_echo(const std::string a, std::string &r)
+{
+	r = a;
+	return 0;
+}
+
 srv service;
 
 void startserver()
@@ -74,6 +83,7 @@ void startserver()
 	server->reg(23, &service, &srv::handle_fast);
 	server->reg(24, &service, &srv::handle_slow);
 	server->reg(25, &service, &srv::handle_bigrep);
+	server->reg(26, &service, &srv::handle_echo);
 }
 
 void
@@ -382,6 +392,84 @@ failure_test()
 	printf("failure_test OK\n");
 }
 
+// benchmark mode (-b): nt threads (-n) call the echo handler back to
+// back for secs seconds (-t) with a payload of each of the sizes (-z
+// 16,1024,...), spread over nclients rpcc objects (-k). -l or -L
+// percent makes the connections lossy. Run with -s and -c -p port to
+// put the server in a process of its own.
+struct bench_t {
+	rpcc *cl;
+	int size;
+	unsigned long long calls;
+	rpc_hist lat;
+};
+volatile bool bench_stop;
+
+void *
+benchthread(void *xx)
+{
+	bench_t *b = (bench_t *) xx;
+	std::string req(b->size, 'b');
+	std::string rep;
+
+	while (!bench_stop) {
+		struct timespec start;
+		clock_gettime(CLOCK_REALTIME, &start);
+		int ret = b->cl->call(26, req, rep);
+		assert(ret == 0);
+		b->lat.add(usec_since(start));
+		b->calls++;
+	}
+	return 0;
+}
+
+void
+benchmark(std::vector<int> sizes, int nt, int nclients, int secs)
+{
+	std::vector<rpcc *> cls;
+	for (int i = 0; i < nclients; i++) {
+		cls.push_back(new rpcc(dst));
+		assert(cls[i]->bind() == 0);
+	}
+
+	char *lossy = getenv("RPC_LOSSY");
+	for (unsigned s = 0; s < sizes.size(); s++) {
+		std::vector<bench_t> b(nt);
+		std::vector<pthread_t> th(nt);
+		struct timespec start;
+
+		bench_stop = false;
+		clock_gettime(CLOCK_REALTIME, &start);
+		for (int i = 0; i < nt; i++) {
+			b[i].cl = cls[i % nclients];
+			b[i].size = sizes[s];
+			b[i].calls = 0;
+			assert(pthread_create(&th[i], &attr, benchthread,
+						(void *) &b[i]) == 0);
+		}
+		sleep(secs);
+		bench_stop = true;
+		rpc_hist lat;
+		unsigned long long calls = 0;
+		for (int i = 0; i < nt; i++) {
+			assert(pthread_join(th[i], NULL) == 0);
+			lat.merge(b[i].lat);
+			calls += b[i].calls;
+		}
+		double elapsed = usec_since(start) / 1000000.0;
+		// the payload goes both ways
+		printf("bench size %d threads %d clients %d lossy %s: %llu calls "
+				"%.0f calls/s %.2f MB/s p50 %llu p99 %llu p999 %llu max %llu us\n",
+				sizes[s], nt, nclients, lossy ? lossy : "0", calls,
+				calls / elapsed, 2.0 * sizes[s] * calls / elapsed / 1e6,
+				lat.percentile(50), lat.percentile(99),
+				lat.percentile(99.9), lat.percentile(100));
+	}
+
+	for (int i = 0; i < nclients; i++)
+		delete cls[i];
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -392,12 +480,17 @@ main(int argc, char *argv[])
 
 	bool isclient = false;
 	bool isserver = false;
+	bool bench = false;
+	std::vector<int> sizes;
+	int bench_threads = 10;
+	int bench_clients = 1;
+	int bench_secs = 5;
 
 	srandom(getpid());
 	port = 20000 + (getpid() % 10000);
 
 	char ch = 0;
-	while ((ch = getopt(argc, argv, "csd:p:l"))!=-1) {
+	while ((ch = getopt(argc, argv, "csd:p:lL:bz:n:k:t:"))!=-1) {
 		switch (ch) {
 			case 'c':
 				isclient = true;
@@ -413,6 +506,27 @@ main(int argc, char *argv[])
 				break;
 			case 'l':
 				assert(setenv("RPC_LOSSY", "5", 1) == 0);
+				break;
+			case 'L':
+				assert(setenv("RPC_LOSSY", optarg, 1) == 0);
+				break;
+			case 'b':
+				bench = true;
+				break;
+			case 'z':
+				// comma separated payload sizes
+				for (char *p = strtok(optarg, ","); p; p = strtok(NULL, ","))
+					sizes.push_back(atoi(p));
+				break;
+			case 'n':
+				bench_threads = atoi(optarg);
+				break;
+			case 'k':
+				bench_clients = atoi(optarg);
+				break;
+			case 't':
+				bench_secs = atoi(optarg);
+				break;
 			default:
 				break;
 		}
@@ -446,6 +560,15 @@ main(int argc, char *argv[])
 		dst.sin_addr.s_addr = inet_addr("127.0.0.1");
 		dst.sin_port = htons(port);
 
+		if (bench) {
+			if (sizes.empty()) {
+				sizes.push_back(16);
+				sizes.push_back(1024);
+				sizes.push_back(65536);
+			}
+			benchmark(sizes, bench_threads, bench_clients, bench_secs);
+			exit(0);
+		}
 
 		// start the client.  bind it to the server.
 		// starts a thread to listen for replies and hand them to
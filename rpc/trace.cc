@@ -0,0 +1,190 @@
+#include "trace.h"
+#include <string>
+#include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "gettime.h"
+
+#define FLUSHBYTES (32*1024)
+
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static pthread_key_t ctxkey;
+static pthread_mutex_t trace_m = PTHREAD_MUTEX_INITIALIZER;
+static std::string *pending;	// spans not yet written
+static int tracefd = -1;
+static int sample;	// RPC_TRACE; 0 is off
+static unsigned long long nroots;	// outermost spans seen, atomic
+static bool flushing;	// flusher thread started
+
+// per thread
+struct tstate {
+	trace_ctx ctx;
+	int unsampled;	// depth of trace_spans not sampled
+};
+
+static void *
+flusher(void *)
+{
+	struct timespec ts;
+	ts.tv_sec = 0;
+	ts.tv_nsec = 200 * 1000000;
+	while (1) {
+		nanosleep(&ts, NULL);
+		trace_flush();
+	}
+	return 0;
+}
+
+static void
+trace_init()
+{
+	assert(pthread_key_create(&ctxkey, free) == 0);
+	pending = new std::string;
+	char *e = getenv("RPC_TRACE");
+	if (e)
+		sample = atoi(e);
+	atexit(trace_flush);
+}
+
+static tstate *
+mystate()
+{
+	pthread_once(&once, trace_init);
+	tstate *t = (tstate *) pthread_getspecific(ctxkey);
+	if (!t) {
+		t = (tstate *) malloc(sizeof(*t));
+		t->ctx.trace = t->ctx.span = 0;
+		t->unsampled = 0;
+		assert(pthread_setspecific(ctxkey, t) == 0);
+	}
+	return t;
+}
+
+trace_ctx
+trace_current()
+{
+	return mystate()->ctx;
+}
+
+void
+trace_set(const trace_ctx &c)
+{
+	mystate()->ctx = c;
+}
+
+// random() is seeded by every rpcc and rpcs
+unsigned int
+trace_newid()
+{
+	unsigned int id;
+	do {
+		id = random();
+	} while (id == 0);
+	return id;
+}
+
+// Must be called with trace_m locked.
+static void
+flush_wo()
+{
+	if (pending->empty())
+		return;
+	if (tracefd < 0) {
+		char name[64];
+		snprintf(name, sizeof(name), "trace-%d.log", getpid());
+		tracefd = open(name, O_WRONLY | O_CREAT | O_APPEND, 0644);
+		if (tracefd < 0) {
+			pending->clear();
+			return;
+		}
+	}
+	unsigned done = 0;
+	while (done < pending->size()) {
+		int n = write(tracefd, pending->data() + done,
+		    pending->size() - done);
+		if (n <= 0)
+			break;
+		done += n;
+	}
+	pending->clear();
+}
+
+void
+trace_flush()
+{
+	pthread_once(&once, trace_init);
+	assert(pthread_mutex_lock(&trace_m) == 0);
+	flush_wo();
+	assert(pthread_mutex_unlock(&trace_m) == 0);
+}
+
+void
+trace_record(const trace_ctx &c, unsigned int parent, const char *name,
+    const struct timespec &start, int ret)
+{
+	struct timespec now;
+	char line[160];
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	long long st = start.tv_sec * 1000000LL + start.tv_nsec / 1000;
+	long long dur = now.tv_sec * 1000000LL + now.tv_nsec / 1000 - st;
+	snprintf(line, sizeof(line), "%x %x %x %lld %lld %d %s\n", c.trace,
+	    c.span, parent, st, dur, ret, name);
+
+	pthread_once(&once, trace_init);
+	assert(pthread_mutex_lock(&trace_m) == 0);
+	*pending += line;
+	if (pending->size() >= FLUSHBYTES)
+		flush_wo();
+	if (!flushing) {
+		// servers are usually killed, not exited; do not sit on spans
+		pthread_t th;
+		assert(pthread_create(&th, NULL, flusher, NULL) == 0);
+		assert(pthread_detach(th) == 0);
+		flushing = true;
+	}
+	assert(pthread_mutex_unlock(&trace_m) == 0);
+}
+
+trace_span::trace_span(const char *fmt, ...)
+	: ret_(0)
+{
+	tstate *t = mystate();
+	saved_ = t->ctx;
+	if (t->ctx.trace) {
+		mine_.trace = t->ctx.trace;
+	} else {
+		// only the outermost span of an operation decides; with
+		// tracing off no shared state is touched
+		bool sampled = false;
+		if (t->unsampled == 0 && sample > 0)
+			sampled = __sync_fetch_and_add(&nroots, 1) % sample == 0;
+		if (!sampled) {
+			t->unsampled++;
+			return;
+		}
+		mine_.trace = trace_newid();
+	}
+	mine_.span = trace_newid();
+	t->ctx = mine_;
+
+	va_list ap;
+	va_start(ap, fmt);
+	vsnprintf(name_, sizeof(name_), fmt, ap);
+	va_end(ap);
+	clock_gettime(CLOCK_REALTIME, &start_);
+}
+
+trace_span::~trace_span()
+{
+	if (!mine_.trace) {
+		mystate()->unsampled--;
+		return;
+	}
+	trace_record(mine_, saved_.span, name_, start_, ret_);
+	trace_set(saved_);
+}
@@ -0,0 +1,55 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__ 1
+
+#include <time.h>
+
+// Request tracing across processes. A trace is started by a root span,
+// e.g. one FUSE operation in yfs_client, and carries its trace id and
+// the id of the current span in the header of every RPC made on its
+// behalf. rpcc::call1 records a span for each call and rpcs::dispatch
+// one for each handler run, with the caller's span as parent, and the
+// handler runs in the trace so the RPCs it makes join it.
+//
+// Root spans are started only if RPC_TRACE is set in the environment:
+// RPC_TRACE=1 traces every operation, RPC_TRACE=n one in n. A process
+// records spans whenever it takes part in a trace, one line per span in
+// trace-<pid>.log in its current directory:
+//
+//   <trace> <span> <parent> <start us> <duration us> <ret> <name>
+//
+// with ids in hex and parent 0 for a root. tracetree.pl merges the files
+// of all processes and prints each trace as a tree.
+
+struct trace_ctx {
+	trace_ctx() : trace(0), span(0) {}
+	unsigned int trace;
+	unsigned int span;
+};
+
+// the trace context of the calling thread; trace 0 if none
+trace_ctx trace_current();
+void trace_set(const trace_ctx &c);
+unsigned int trace_newid();
+void trace_record(const trace_ctx &c, unsigned int parent, const char *name,
+    const struct timespec &start, int ret);
+// writes out the spans recorded so far; runs at exit too
+void trace_flush();
+
+// A span for the lifetime of the object, child of the calling thread's
+// current span. With no trace in progress it starts a new one if this
+// operation is sampled, and does nothing otherwise.
+class trace_span {
+	public:
+		trace_span(const char *fmt, ...)
+			__attribute__ ((format (printf, 2, 3)));
+		~trace_span();
+		void ret(int r) { ret_ = r; }
+	private:
+		trace_ctx saved_;
+		trace_ctx mine_;
+		struct timespec start_;
+		int ret_;
+		char name_[64];
+};
+
+#endif
@@ -0,0 +1,35 @@
+//
+// Prints the RPC stats of a running server: per procedure latency,
+// queue wait and handler time, retransmissions and timeouts.
+//
+
+#include "rpc.h"
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+int
+main(int argc, char *argv[])
+{
+  sockaddr_in dst;
+  std::string r;
+
+  if(argc != 2){
+    fprintf(stderr, "Usage: %s [host:]port\n", argv[0]);
+    exit(1);
+  }
+
+  make_sockaddr(argv[1], &dst);
+  rpcc cl(dst);
+  if (cl.bind() < 0) {
+    fprintf(stderr, "%s: bind %s failed\n", argv[0], argv[1]);
+    exit(1);
+  }
+  int ret = cl.call(rpc_const::stats, 0, r);
+  if (ret != 0) {
+    fprintf(stderr, "%s: stats %s failed %d\n", argv[0], argv[1], ret);
+    exit(1);
+  }
+  printf("%s", r.c_str());
+  return 0;
+}
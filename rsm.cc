@@ -80,9 +80,11 @@
 
 #include <fstream>
 #include <iostream>
+#include <string.h>
 
 #include "handle.h"
 #include "rsm.h"
+#include "jsl_log.h"
 
 static void *
 recoverythread(void *x)
@@ -95,7 +97,7 @@ recoverythread(void *x)
 
 
 rsm::rsm(std::string _first, std::string _me) 
-  : stf(0), primary(_first), insync (false), inviewchange (false), nbackup (0), partitioned (false), dopartition(false), break1(false), break2(false)
+  : stf(0), ninflight(0), skipped(false), primary(_first), insync (false), inviewchange (false), nbackup (0), partitioned (false), dopartition(false), break1(false), break2(false)
 {
   pthread_t th;
 
@@ -103,14 +105,18 @@ rsm::rsm(std::string _first, std::string _me)
   last_myvs.seqno = 0;
   myvs = last_myvs;
   myvs.seqno = 1;
+  nextexec = myvs;
+  memset(&bstats, 0, sizeof(bstats));
 
   pthread_mutex_init(&rsm_mutex, NULL);
   pthread_mutex_init(&invoke_mutex, NULL);
   pthread_cond_init(&recovery_cond, NULL);
   pthread_cond_init(&sync_cond, NULL);
   pthread_cond_init(&join_cond, NULL);
+  pthread_cond_init(&exec_cond, NULL);
 
   cfg = new config(_first, _me, this);
+  cfg->set_leaseholder(primary);
 
   rsmrpc = cfg->get_rpcs();
   rsmrpc->reg(rsm_client_protocol::invoke, this, &rsm::client_invoke);
@@ -146,6 +152,8 @@ rsm::recovery()
             printf("rsm::recovery: we are not in the list of members, starting join\n");
             if (join(primary)) {
                 printf("rsm::recovery: join succeeded\n");
+                // the new member has to get the state from the primary
+                inviewchange = true;
             } else {
                 printf("rsm::recovery: failed to join, sleeping for 30 seconds\n");
                 assert(pthread_mutex_unlock(&rsm_mutex)==0);
@@ -154,18 +162,68 @@ rsm::recovery()
             }
         }
 
-        if (r) inviewchange = false;
+        if (inviewchange) {
+            printf("rsm::recovery: syncing in view %d\n", cfg->vid());
+            if (primary == cfg->myaddr())
+                r = sync_with_backups();
+            else
+                r = sync_with_primary();
+            printf("rsm::recovery: sync done %d\n", r);
+
+            if (r) {
+                inviewchange = false;
+            } else {
+                // the view changed or the primary was not ready yet
+                assert(pthread_mutex_unlock(&rsm_mutex)==0);
+                usleep(100000);
+                assert(pthread_mutex_lock(&rsm_mutex)==0);
+                continue;
+            }
+        }
+
         printf("rsm::recovery: go to sleep %d %d\n", insync, inviewchange);
-        pthread_cond_wait(&recovery_cond, &rsm_mutex);
+        while (!inviewchange && cfg->ismember(cfg->myaddr()))
+            pthread_cond_wait(&recovery_cond, &rsm_mutex);
         printf("rsm::recovery: got signal to check if recovery is needed\n");
     }
     assert(pthread_mutex_unlock(&rsm_mutex)==0);
 }
 
+// Starts numbering requests of the new view from 1.
+// Assumes that rsm_mutex is already held.
+void
+rsm::reset_seqno_wo()
+{
+  // requests which arrived in order are already part of the state
+  execute_buffered_wo();
+  reorderbuf.clear();
+
+  myvs.vid = cfg->vid();
+  myvs.seqno = 1;
+  nextexec = myvs;
+  skipped = false;
+}
+
 bool
 rsm::sync_with_backups()
 {
-  // For lab 8
+  unsigned vid = cfg->vid();
+
+  // let requests of the previous view finish, no new ones are accepted
+  // while inviewchange is set
+  while (ninflight > 0)
+    pthread_cond_wait(&exec_cond, &rsm_mutex);
+
+  insync = true;
+  nbackup = cfg->get_curview().size() - 1;
+  while (nbackup > 0 && vid == cfg->vid())
+    pthread_cond_wait(&sync_cond, &rsm_mutex);
+  insync = false;
+
+  if (vid != cfg->vid())
+    return false;
+
+  reset_seqno_wo();
   return true;
 }
 
@@ -173,26 +231,97 @@ rsm::sync_with_backups()
 bool
 rsm::sync_with_primary()
 {
-  // For lab 8
+  unsigned vid = cfg->vid();
+  std::string m = primary;
+
+  insync = true;
+  bool r = statetransfer(m) && statetransferdone(m);
+  insync = false;
+
+  if (!r || vid != cfg->vid())
+    return false;
+
+  reset_seqno_wo();
   return true;
 }
 
 
 /**
  * Call to transfer state from m to the local node.
+ * The state comes in pages of about maxpage bytes. m sends only what
+ * changed since our last_myvs if its state passed through that
+ * viewstamp, the whole state otherwise.
  * Assumes that rsm_mutex is already held.
  */
 bool
 rsm::statetransfer(std::string m)
 {
-  // For lab 8
+  rsm_protocol::transferres r;
+  handle h(m);
+  int ret;
+  unsigned pages = 0, bytes = 0;
+  viewstamp prevlast;
+  struct timeval start, end;
+  printf("rsm::statetransfer: contact %s w. my last_myvs(%d,%d)\n", 
+	 m.c_str(), last_myvs.vid, last_myvs.seqno);
+  gettimeofday(&start, NULL);
+  r.done = 0;
+  while (!r.done) {
+    if (h.get_rpcc()) {
+      viewstamp last = last_myvs;
+      std::string cursor = r.cursor;
+      assert(pthread_mutex_unlock(&rsm_mutex)==0);
+      ret = h.get_rpcc()->call(rsm_protocol::transferreq, cfg->myaddr(), 
+			       last, cursor, r, rpcc::to(1000));
+      assert(pthread_mutex_lock(&rsm_mutex)==0);
+    }
+    // pages must come from one state of m
+    if (ret == rsm_protocol::OK && pages > 0 && r.last != prevlast)
+      ret = rsm_protocol::BUSY;
+    if (h.get_rpcc() == 0 || ret != rsm_protocol::OK) {
+      printf("rsm::statetransfer: couldn't reach %s %p %d\n", m.c_str(), 
+	     h.get_rpcc(), ret);
+      if (pages > 0) {
+	// the state is partly updated and matches no viewstamp, ask for
+	// all of it next time
+	last_myvs = viewstamp();
+	histbase = viewstamp();
+	history.clear();
+      }
+      return false;
+    }
+    if (stf && !r.state.empty())
+      stf->unmarshal_page(r.state, r.full && pages == 0);
+    prevlast = r.last;
+    pages++;
+    bytes += r.state.size();
+  }
+  last_myvs = r.last;
+  histbase = r.last;
+  if (r.full)
+    history.clear();
+  reorderbuf.clear();
+  gettimeofday(&end, NULL);
+  printf("rsm::statetransfer transfer from %s success, vs(%d,%d) %s "
+	 "%u pages %u bytes %ld ms\n", m.c_str(), last_myvs.vid,
+	 last_myvs.seqno, r.full ? "full" : "incremental", pages, bytes,
+	 (end.tv_sec - start.tv_sec) * 1000 +
+	 (end.tv_usec - start.tv_usec) / 1000);
   return true;
 }
 
 bool
 rsm::statetransferdone(std::string m) {
-  // For lab 8
-  return true;
+  handle h(m);
+  int ret = rsm_protocol::ERR;
+  int r;
+  if (h.get_rpcc()) {
+    assert(pthread_mutex_unlock(&rsm_mutex)==0);
+    ret = h.get_rpcc()->call(rsm_protocol::transferdonereq, cfg->myaddr(), r,
+			     rpcc::to(1000));
+    assert(pthread_mutex_lock(&rsm_mutex)==0);
+  }
+  return ret == rsm_protocol::OK;
 }
 
 
@@ -215,7 +344,7 @@ rsm::join(std::string m) {
 	   h.get_rpcc(), ret);
     return false;
   }
-  printf("rsm::join: succeeded %s\n", r.log.c_str());
+  printf("rsm::join: succeeded, log %u bytes\n", (unsigned) r.log.size());
   cfg->restore(r.log);
   return true;
 }
@@ -229,7 +358,7 @@ rsm::join(std::string m) {
 void 
 rsm::commit_change() 
 {
-    //pthread_mutex_lock(&rsm_mutex);
+    assert(pthread_mutex_lock(&rsm_mutex)==0);
 
     // check if the primary is not in the current view
     // and set the node with lowest id as the primary if
@@ -237,11 +366,100 @@ rsm::commit_change()
     printf("rsm::commit_change: updating primary if needed\n");
     set_primary();
 
-    //pthread_mutex_unlock(&rsm_mutex);
+    // members have to sync before requests are accepted again
+    inviewchange = true;
+    fail_pending_wo(rsm_client_protocol::BUSY);
 
     // signal to recovery thread to check if we need to join the current view
     printf("rsm::commit_change: signal to recovery thread\n");
     pthread_cond_signal(&recovery_cond);
+    pthread_cond_broadcast(&sync_cond);
+    pthread_cond_broadcast(&exec_cond);
+
+    assert(pthread_mutex_unlock(&rsm_mutex)==0);
+}
+
+void
+rsm::reg1(int proc, handler *h)
+{
+  assert(pthread_mutex_lock(&rsm_mutex)==0);
+  procs[proc] = h;
+  assert(pthread_mutex_unlock(&rsm_mutex)==0);
+}
+
+// Marks a registered proc as read-only: it does not change the state, so
+// the primary may answer it from its own state without the backups.
+void
+rsm::set_readonly(int proc)
+{
+  assert(pthread_mutex_lock(&rsm_mutex)==0);
+  roprocs.insert(proc);
+  assert(pthread_mutex_unlock(&rsm_mutex)==0);
+}
+
+// Runs the handler registered for procno on the marshalled arguments and
+// marshals its return value together with its reply.
+void
+rsm::execute(int procno, std::string req, std::string &r)
+{
+  jsl_log(JSL_DBG_4, "rsm::execute: proc %x\n", procno);
+  handler *h = procs[procno];
+  assert(h);
+  unmarshall args(req);
+  marshall rep;
+  std::string reps;
+  rsm_protocol::status ret = h->fn(args, rep);
+  marshall rep1;
+  rep1 << ret;
+  rep1 << rep.str();
+  r = rep1.str();
+}
+
+// Executes buffered requests as long as the next one in order is there.
+// Assumes that rsm_mutex is already held.
+void
+rsm::execute_buffered_wo()
+{
+  std::map<unsigned, std::vector<rsm_protocol::request> >::iterator it;
+  while ((it = reorderbuf.find(myvs.seqno)) != reorderbuf.end()) {
+    std::string r;
+    if (stf)
+      stf->set_viewstamp(myvs);
+    for (unsigned i = 0; i < it->second.size(); i++)
+      execute(it->second[i].proc, it->second[i].req, r);
+    executed_wo(myvs);
+    myvs.seqno++;
+    reorderbuf.erase(it);
+  }
+}
+
+// Records that the requests of vs are part of the local state.
+// Assumes that rsm_mutex is already held.
+void
+rsm::executed_wo(viewstamp vs)
+{
+  last_myvs = vs;
+  if (history.find(vs.vid) == history.end())
+    history[vs.vid].first = vs.seqno;
+  history[vs.vid].second = vs.seqno;
+}
+
+// Returns true if the local state was at some point exactly the state
+// after vs. Members execute the same requests in a view, so a member
+// whose last executed viewstamp is vs lacks just the entries changed here
+// since then.
+// Assumes that rsm_mutex is already held.
+bool
+rsm::inhistory_wo(viewstamp vs)
+{
+  if (vs.vid == 0)
+    return false;
+  if (vs == histbase)
+    return true;
+  std::map<unsigned, std::pair<unsigned, unsigned> >::iterator it =
+    history.find(vs.vid);
+  return it != history.end() && vs.seqno >= it->second.first &&
+    vs.seqno <= it->second.second;
 }
 
 
@@ -252,12 +470,188 @@ rsm::commit_change()
 // number, and invokes it on all members of the replicated state
 // machine.
 //
+// Requests are batched: a request is queued in pendingq and the thread
+// that finds fewer than maxinflight batches on their way to the backups
+// takes everything queued (up to maxbatch) and sends it under a single
+// viewstamp. The batch size adapts to the load: an idle primary sends
+// each request right away, a busy one collects the requests that arrive
+// while the earlier batches are in flight. The primary executes batches
+// strictly in viewstamp order, and only once all backups have them.
+//
+// Read-only procs are answered right away from the primary's state while
+// it holds the read lease from config: no other primary can exist then,
+// and every request the primary has executed is known to all backups.
+// Without the lease they take the ordered path like any other request.
+//
 rsm_client_protocol::status
 rsm::client_invoke(int procno, std::string req, std::string &r)
 {
-  int ret = rsm_protocol::OK;
-  // For lab 8
-  return ret;
+  pending_t p;
+  p.r.proc = procno;
+  p.r.req = req;
+  p.ret = rsm_client_protocol::OK;
+  p.done = false;
+  gettimeofday(&p.start, NULL);
+
+  assert(pthread_mutex_lock(&rsm_mutex)==0);
+  if (inviewchange || insync) {
+    assert(pthread_mutex_unlock(&rsm_mutex)==0);
+    return rsm_client_protocol::BUSY;
+  }
+  if (primary != cfg->myaddr()) {
+    assert(pthread_mutex_unlock(&rsm_mutex)==0);
+    return rsm_client_protocol::NOTPRIMARY;
+  }
+  if (roprocs.count(procno) && cfg->haslease()) {
+    execute(procno, req, r);
+    assert(pthread_mutex_unlock(&rsm_mutex)==0);
+    return rsm_client_protocol::OK;
+  }
+  pendingq.push_back(&p);
+  while (!p.done) {
+    if (ninflight < maxinflight && !pendingq.empty())
+      send_batch_wo();
+    else
+      pthread_cond_wait(&exec_cond, &rsm_mutex);
+  }
+  assert(pthread_mutex_unlock(&rsm_mutex)==0);
+
+  r = p.rep;
+  return p.ret;
+}
+
+// Sends the queued requests to the backups as one batch and executes
+// them once every backup has the batch. Releases rsm_mutex while the
+// batch is on the wire.
+// Assumes that rsm_mutex is already held.
+void
+rsm::send_batch_wo()
+{
+  std::vector<pending_t *> batch;
+  std::vector<rsm_protocol::request> reqs;
+  while (!pendingq.empty() && batch.size() < maxbatch) {
+    batch.push_back(pendingq.front());
+    reqs.push_back(pendingq.front()->r);
+    pendingq.pop_front();
+  }
+
+  viewstamp vs = myvs;
+  myvs.seqno++;
+  ninflight++;
+  assert(pthread_mutex_unlock(&rsm_mutex)==0);
+
+  bool ok = send_to_backups(vs, reqs);
+
+  // execute in viewstamp order
+  assert(pthread_mutex_lock(&rsm_mutex)==0);
+  while (nextexec != vs && nextexec.vid == vs.vid)
+    pthread_cond_wait(&exec_cond, &rsm_mutex);
+
+  int ret = rsm_client_protocol::OK;
+  if (nextexec != vs) {
+    // a view change reset the sequence, the backups will get our state
+    ret = rsm_client_protocol::BUSY;
+  } else {
+    if (ok && !skipped) {
+      if (stf)
+	stf->set_viewstamp(vs);
+      for (unsigned i = 0; i < batch.size(); i++)
+	execute(batch[i]->r.proc, batch[i]->r.req, batch[i]->rep);
+      executed_wo(vs);
+      batchstats_wo(batch);
+    } else {
+      // the view changed while the batch was sent; members which did
+      // get it are brought back to the primary's state by the state
+      // transfer of the new view. Later batches of the view are not
+      // executed either, so the history has no gaps.
+      skipped = true;
+      ret = rsm_client_protocol::BUSY;
+    }
+    nextexec.seqno++;
+  }
+  for (unsigned i = 0; i < batch.size(); i++) {
+    batch[i]->ret = ret;
+    batch[i]->done = true;
+  }
+  ninflight--;
+  pthread_cond_broadcast(&exec_cond);
+}
+
+// Forwards a batch to all backups. A backup that does not answer is
+// retried until the heartbeater removes it from the view: giving up
+// earlier would let the members that did get the batch diverge from the
+// primary within the view. Backups ignore batches they already executed,
+// so resending is harmless.
+// Returns false if the view changed before all backups had the batch.
+bool
+rsm::send_to_backups(viewstamp vs, std::vector<rsm_protocol::request> &reqs)
+{
+  std::vector<std::string> m = cfg->get_curview();
+  unsigned nsent = 0;
+  for (unsigned i = 0; i < m.size(); i++) {
+    if (m[i] == cfg->myaddr())
+      continue;
+    while (1) {
+      handle h(m[i]);
+      int dummy;
+      if (h.get_rpcc() != 0 &&
+	  h.get_rpcc()->call(rsm_protocol::invoke, vs, reqs, dummy, 
+			     rpcc::to(1000)) == rsm_protocol::OK)
+	break;
+      printf("rsm::send_to_backups: backup %s failed on (%d,%d)\n", 
+	     m[i].c_str(), vs.vid, vs.seqno);
+      if (cfg->vid() != vs.vid)
+	return false;
+      usleep(100000);
+    }
+    if (nsent++ == 0)
+      breakpoint1();
+  }
+  breakpoint2();
+  return true;
+}
+
+// Fails the requests which were not sent yet, e.g. on a view change.
+// Assumes that rsm_mutex is already held.
+void
+rsm::fail_pending_wo(int ret)
+{
+  while (!pendingq.empty()) {
+    pendingq.front()->ret = ret;
+    pendingq.front()->done = true;
+    pendingq.pop_front();
+  }
+  pthread_cond_broadcast(&exec_cond);
+}
+
+// Accounts an executed batch and prints the batch size and the request
+// latency (queued to executed) every 1000 batches.
+// Assumes that rsm_mutex is already held.
+void
+rsm::batchstats_wo(std::vector<pending_t *> &batch)
+{
+  struct timeval now;
+  gettimeofday(&now, NULL);
+
+  bstats.batches++;
+  bstats.requests += batch.size();
+  if (batch.size() > bstats.maxsize)
+    bstats.maxsize = batch.size();
+  for (unsigned i = 0; i < batch.size(); i++) {
+    unsigned long long l = (now.tv_sec - batch[i]->start.tv_sec) * 1000000ULL
+      + now.tv_usec - batch[i]->start.tv_usec;
+    bstats.latency += l;
+    if (l > bstats.maxlatency)
+      bstats.maxlatency = l;
+  }
+
+  if (bstats.batches == 1000) {
+    printf("rsm::batchstats: %u batches, size avg %.1f max %u, "
+	   "latency avg %llu max %llu usec\n", bstats.batches,
+	   (double) bstats.requests / bstats.batches, bstats.maxsize,
+	   bstats.latency / bstats.requests, bstats.maxlatency);
+    memset(&bstats, 0, sizeof(bstats));
+  }
 }
 
 // 
@@ -266,12 +660,33 @@ rsm::client_invoke(int procno, std::string req, std::string &r)
 //
 // the replica must execute requests in order (with no gaps) 
 // according to requests' seqno 
+//
+// A batch that arrives ahead of a missing one is kept in reorderbuf and
+// acknowledged right away; it is executed when the gap is filled.
 
 rsm_protocol::status
-rsm::invoke(int proc, viewstamp vs, std::string req, int &dummy)
+rsm::invoke(viewstamp vs, std::vector<rsm_protocol::request> batch, 
+	    int &dummy)
 {
   rsm_protocol::status ret = rsm_protocol::OK;
-  // For lab 8
+
+  assert(pthread_mutex_lock(&rsm_mutex)==0);
+  if (insync || primary == cfg->myaddr() || vs.vid != myvs.vid) {
+    printf("rsm::invoke: reject (%d,%d), expecting (%d,%d)\n", vs.vid, 
+	   vs.seqno, myvs.vid, myvs.seqno);
+    ret = rsm_protocol::ERR;
+  } else if (vs.seqno >= myvs.seqno) {
+    reorderbuf[vs.seqno] = batch;
+    execute_buffered_wo();
+    breakpoint1();
+
+    if (dopartition) {
+      net_repair_wo(false);
+      dopartition = false;
+      partitioned = true;
+    }
+  }
+  assert(pthread_mutex_unlock(&rsm_mutex)==0);
   return ret;
 }
 
@@ -279,11 +694,26 @@ rsm::invoke(int proc, viewstamp vs, std::string req, int &dummy)
  * RPC handler: Send back the local node's state to the caller
  */
 rsm_protocol::status
-rsm::transferreq(std::string src, viewstamp last, rsm_protocol::transferres &r)
+rsm::transferreq(std::string src, viewstamp last, std::string cursor,
+		 rsm_protocol::transferres &r)
 {
   assert(pthread_mutex_lock(&rsm_mutex)==0);
   int ret = rsm_protocol::OK;
-  // For lab 8
+  printf("transferreq from %s (%d,%d) vs (%d,%d)\n", src.c_str(), 
+	 last.vid, last.seqno, last_myvs.vid, last_myvs.seqno);
+  if (!insync || primary != cfg->myaddr()) {
+    ret = rsm_protocol::BUSY;
+  } else {
+    // nothing executes while insync is set, so the pages of one transfer
+    // all come from the same state. After a skipped request the
+    // members of the view may have executed requests we have not.
+    r.full = skipped || !inhistory_wo(last);
+    r.cursor = cursor;
+    r.done = 1;
+    if (stf && (r.full || last != last_myvs))
+      r.done = stf->marshal_page(r.full, last, r.cursor, maxpage, r.state);
+    r.last = last_myvs;
+  }
   assert(pthread_mutex_unlock(&rsm_mutex)==0);
   return ret;
 }
@@ -296,7 +726,12 @@ rsm::transferdonereq(std::string m, int &r)
 {
   int ret = rsm_client_protocol::OK;
   assert (pthread_mutex_lock(&rsm_mutex) == 0);
-  // For lab 8
+  if (!insync || primary != cfg->myaddr()) {
+    ret = rsm_client_protocol::BUSY;
+  } else {
+    nbackup--;
+    pthread_cond_broadcast(&sync_cond);
+  }
   assert (pthread_mutex_unlock(&rsm_mutex) == 0);
   return ret;
 }
@@ -316,13 +751,17 @@ rsm::joinreq(std::string m, viewstamp last, rsm_protocol::joinres &r)
     printf("joinreq: busy\n");
     ret = rsm_client_protocol::BUSY;
   } else {
-    // Lab 7: invoke config to create a new view that contains m
+    // Lab 7: invoke config to create a new view that contains m.
+    // add() upcalls commit_change, which takes rsm_mutex
     printf("rsm::joinreq: adding node %s to the list", m.c_str());
-    if (cfg->add(m))
+    assert (pthread_mutex_unlock(&rsm_mutex) == 0);
+    bool added = cfg->add(m);
+    assert (pthread_mutex_lock(&rsm_mutex) == 0);
+    if (added)
     {
       printf("rsm::joinreq: added %s\n", m.c_str());
       r.log=cfg->dump();
-      printf("rsm::joinreq: r.log=%s\n", r.log.c_str());
+      printf("rsm::joinreq: r.log %u bytes\n", (unsigned) r.log.size());
     }
     else
     {
@@ -373,6 +812,7 @@ rsm::set_primary()
     if (isamember(p[i], c)) {
       primary = p[i];
       printf("set_primary: primary is %s\n", primary.c_str());
+      cfg->set_leaseholder(primary);
       return;
     }
   }
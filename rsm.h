@@ -5,6 +5,9 @@
 
 #include <string>
 #include <vector>
+#include <list>
+#include <set>
+#include <sys/time.h>
 #include "rsm_protocol.h"
 #include "rsm_state_transfer.h"
 #include "rpc.h"
@@ -15,11 +18,47 @@
 class rsm : public config_view_change {
  protected:
   std::map<int, handler *> procs;
+  std::set<int> roprocs;  // procs answered by the primary alone
   config *cfg;
   class rsm_state_transfer *stf;
   rpcs *rsmrpc;
-  viewstamp myvs;
-  viewstamp last_myvs;
+  viewstamp myvs;       // primary: next viewstamp to assign, backup: next to execute
+  viewstamp last_myvs;  // last executed viewstamp
+  viewstamp nextexec;   // primary: next viewstamp to execute locally
+  unsigned ninflight;   // primary: batches sent to backups, not executed yet
+  bool skipped;         // primary: a request was not executed in this view
+  // Viewstamps the local state has passed through: the state got from the
+  // last full transfer, then per view the first and last seqno executed
+  // since. Entries changed after any of them are enough to bring a member
+  // with that last viewstamp up to date.
+  viewstamp histbase;
+  std::map<unsigned, std::pair<unsigned, unsigned> > history;
+  // bytes of state per transfer page
+  static const unsigned maxpage = 1 << 20;
+  // backup: batches which arrived ahead of a missing viewstamp
+  std::map<unsigned, std::vector<rsm_protocol::request> > reorderbuf;
+
+  // primary: client request waiting to be sent to the backups in a batch
+  struct pending_t {
+    rsm_protocol::request r;
+    std::string rep;
+    int ret;
+    bool done;
+    struct timeval start;
+  };
+  std::list<pending_t *> pendingq;
+  // batches in flight at once, and requests per batch
+  static const unsigned maxinflight = 2;
+  static const unsigned maxbatch = 64;
+
+  // batching metrics since the last report
+  struct batchstats_t {
+    unsigned batches;
+    unsigned long long requests;
+    unsigned maxsize;
+    unsigned long long latency;     // usec, summed over requests
+    unsigned long long maxlatency;
+  } bstats;
   std::string primary;
   bool insync; 
   bool inviewchange;
@@ -35,9 +74,11 @@ class rsm : public config_view_change {
 
   rsm_client_protocol::status client_members(int i, 
 					     std::vector<std::string> &r);
-  rsm_protocol::status invoke(int proc, viewstamp vs, std::string mreq, 
+  rsm_protocol::status invoke(viewstamp vs, 
+			      std::vector<rsm_protocol::request> batch,
 			      int &dummy);
   rsm_protocol::status transferreq(std::string src, viewstamp last,
+				   std::string cursor,
 				   rsm_protocol::transferres &r);
   rsm_protocol::status transferdonereq(std::string m, int &r);
   rsm_protocol::status joinreq(std::string src, viewstamp last, 
@@ -50,9 +91,19 @@ class rsm : public config_view_change {
   pthread_cond_t recovery_cond;
   pthread_cond_t sync_cond;
   pthread_cond_t join_cond;
+  pthread_cond_t exec_cond;
 
   rsm_client_protocol::status client_invoke(int procno, std::string req, 
               std::string &r);
+  void execute(int procno, std::string req, std::string &r);
+  void execute_buffered_wo();
+  void executed_wo(viewstamp vs);
+  bool inhistory_wo(viewstamp vs);
+  void send_batch_wo();
+  bool send_to_backups(viewstamp vs, std::vector<rsm_protocol::request> &reqs);
+  void fail_pending_wo(int ret);
+  void batchstats_wo(std::vector<pending_t *> &batch);
+  void reset_seqno_wo();
   bool statetransfer(std::string m);
   bool statetransferdone(std::string m);
   bool join(std::string m);
@@ -70,9 +121,99 @@ class rsm : public config_view_change {
 
   bool amiprimary();
   void set_state_transfer(rsm_state_transfer *_stf) { stf = _stf; };
+  void set_readonly(int proc);
   void recovery();
   void commit_change();
 
+  // Lets the service on the primary submit a request of its own. It is
+  // ordered and executed on every replica like a client request.
+  rsm_client_protocol::status submit(int procno, std::string req,
+              std::string &r) { return client_invoke(procno, req, r); }
+
+  void reg1(int proc, handler *);
+  template<class S, class A1, class R>
+    void reg(int proc, S*, int (S::*meth)(const A1 a1, R &));
+  template<class S, class A1, class A2, class R>
+    void reg(int proc, S*, int (S::*meth)(const A1 a1, const A2 a2, R &));
+  template<class S, class A1, class A2, class A3, class R>
+    void reg(int proc, S*, int (S::*meth)(const A1 a1, const A2 a2, 
+					  const A3 a3, R &));
 };
 
+template<class S, class A1, class R> void
+rsm::reg(int proc, S*sob, int (S::*meth)(const A1 a1, R & r))
+{
+  class h1 : public handler {
+  private:
+    S * sob;
+    int (S::*meth)(const A1 a1, R & r);
+  public:
+  h1(S *xsob, int (S::*xmeth)(const A1 a1, R & r))
+    : sob(xsob), meth(xmeth) { }
+    int fn(unmarshall &args, marshall &ret) {
+      A1 a1;
+      R r;
+      args >> a1;
+      assert(args.okdone());
+      int b = (sob->*meth)(a1,r);
+      ret << r;
+      return b;
+    }
+  };
+  reg1(proc, new h1(sob, meth));
+}
+
+template<class S, class A1, class A2, class R> void
+rsm::reg(int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2, R & r))
+{
+  class h1 : public handler {
+  private:
+    S * sob;
+    int (S::*meth)(const A1 a1, const A2 a2, R & r);
+  public:
+  h1(S *xsob, int (S::*xmeth)(const A1 a1, const A2 a2, R & r))
+    : sob(xsob), meth(xmeth) { }
+    int fn(unmarshall &args, marshall &ret) {
+      A1 a1;
+      A2 a2;
+      R r;
+      args >> a1;
+      args >> a2;
+      assert(args.okdone());
+      int b = (sob->*meth)(a1,a2,r);
+      ret << r;
+      return b;
+    }
+  };
+  reg1(proc, new h1(sob, meth));
+}
+
+template<class S, class A1, class A2, class A3, class R> void
+rsm::reg(int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2, 
+					 const A3 a3, R & r))
+{
+  class h1 : public handler {
+  private:
+    S * sob;
+    int (S::*meth)(const A1 a1, const A2 a2, const A3 a3, R & r);
+  public:
+  h1(S *xsob, int (S::*xmeth)(const A1 a1, const A2 a2, const A3 a3, R & r))
+    : sob(xsob), meth(xmeth) { }
+    int fn(unmarshall &args, marshall &ret) {
+      A1 a1;
+      A2 a2;
+      A3 a3;
+      R r;
+      args >> a1;
+      args >> a2;
+      args >> a3;
+      assert(args.okdone());
+      int b = (sob->*meth)(a1,a2,a3,r);
+      ret << r;
+      return b;
+    }
+  };
+  reg1(proc, new h1(sob, meth));
+}
+
 #endif /* rsm_h */
@@ -2,6 +2,7 @@
 #include <vector>
 #include <arpa/inet.h>
 #include <stdio.h>
+#include "jsl_log.h"
 
 
 rsm_client::rsm_client(std::string dst)
@@ -31,6 +32,22 @@ rsm_client::rsm_client(std::string dst)
 void
 rsm_client::primary_failure()
 {
+  // try the other members of the last view in turn. One that is not the
+  // primary answers NOTPRIMARY, and invoke then asks it for the members
+  while (!known_mems.empty()) {
+    if (init_members(false))
+      return;
+  }
+
+  // every member was tried: ask the one bound last for the current view,
+  // or go through the last view again after a while if it can't answer
+  if (!init_members(true)) {
+    printf("rsm_client::primary_failure: no member answers, retrying\n");
+    known_mems = view_mems;
+    assert(pthread_mutex_unlock(&rsm_client_mutex)==0);
+    sleep(1);
+    assert(pthread_mutex_lock(&rsm_client_mutex)==0);
+  }
 }
 
 rsm_protocol::status
@@ -40,15 +57,15 @@ rsm_client::invoke(int proc, std::string req, std::string &rep)
   rpcc *cl;
   assert(pthread_mutex_lock(&rsm_client_mutex)==0);
   while (1) {
-    printf("rsm_client::invoke proc %x primary %s\n", proc, primary.id.c_str());
+    jsl_log(JSL_DBG_4, "rsm_client::invoke proc %x primary %s\n", proc, primary.id.c_str());
     cl = primary.cl;
     primary.nref++;
     assert(pthread_mutex_unlock(&rsm_client_mutex)==0);
-    ret = primary.cl->call(rsm_client_protocol::invoke, proc, req, 
+    ret = cl->call(rsm_client_protocol::invoke, proc, req, 
         rep, rpcc::to(5000));
     assert(pthread_mutex_lock(&rsm_client_mutex)==0);
     primary.nref--;
-    printf("rsm_client::invoke proc %x primary %s ret %d\n", proc, 
+    jsl_log(JSL_DBG_4, "rsm_client::invoke proc %x primary %s ret %d\n", proc,
      primary.id.c_str(), ret);
     if (ret == rsm_client_protocol::OK) {
       break;
@@ -64,6 +81,9 @@ rsm_client::invoke(int proc, std::string req, std::string &rep)
       if (init_members(true))
         continue;
     }
+    // another thread may have moved to a new primary already
+    if (primary.cl != cl)
+      continue;
     printf("primary %s failed ret %d\n", primary.id.c_str(), ret);
     primary_failure();
     printf ("rsm_client::invoke: retry new primary %s\n", primary.id.c_str());
@@ -77,12 +97,19 @@ rsm_client::init_members(bool send_member_rpc)
 {
   if (send_member_rpc) {
     printf("rsm_client::init_members get members!\n");
+    // the connection is counted as in use, so that no other thread
+    // deletes it while the mutex is released
+    std::vector<std::string> mems;
+    rpcc *cl = primary.cl;
+    primary.nref++;
     assert(pthread_mutex_unlock(&rsm_client_mutex)==0);
-    int ret = primary.cl->call(rsm_client_protocol::members, 0, known_mems, 
+    int ret = cl->call(rsm_client_protocol::members, 0, mems, 
             rpcc::to(1000)); 
     assert(pthread_mutex_lock(&rsm_client_mutex)==0);
+    primary.nref--;
     if (ret != rsm_protocol::OK)
       return false;
+    known_mems = view_mems = mems;
   }
   if (known_mems.size() < 1) {
     printf("rsm_client::init_members do not know any members!\n");
@@ -98,10 +125,10 @@ rsm_client::init_members(bool send_member_rpc)
     sockaddr_in dstsock;
     make_sockaddr(new_primary.c_str(), &dstsock);
     primary.id = new_primary;
-    if (primary.cl) {
-      assert(primary.nref == 0);  // XXX fix: delete cl only when refcnt=0
+    // calls of other threads may still be using the old connection, it
+    // is left alone then; failovers are rare
+    if (primary.cl && primary.nref == 0)
       delete primary.cl; 
-    }
     primary.cl = new rpcc(dstsock);
 
     if (primary.cl->bind(rpcc::to(1000)) < 0) {
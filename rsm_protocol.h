@@ -35,9 +35,19 @@ class rsm_protocol {
     joinreq,
   };
 
+  // one client request inside a batch sent to the backups
+  struct request {
+    int proc;
+    std::string req;
+  };
+
+  // one page of a state transfer
   struct transferres {
     std::string state;
     viewstamp last;
+    std::string cursor;  // where the next page starts
+    int full;            // whole state, not just the changes since last
+    int done;            // no pages left
   };
   
   struct joinres {
@@ -70,11 +80,30 @@ inline unmarshall& operator>>(unmarshall &u, viewstamp &v) {
   return u;
 }
 
+inline marshall &
+operator<<(marshall &m, rsm_protocol::request r)
+{
+  m << r.proc;
+  m << r.req;
+  return m;
+}
+
+inline unmarshall &
+operator>>(unmarshall &u, rsm_protocol::request &r)
+{
+  u >> r.proc;
+  u >> r.req;
+  return u;
+}
+
 inline marshall &
 operator<<(marshall &m, rsm_protocol::transferres r)
 {
   m << r.state;
   m << r.last;
+  m << r.cursor;
+  m << r.full;
+  m << r.done;
   return m;
 }
 
@@ -83,6 +112,9 @@ operator>>(unmarshall &u, rsm_protocol::transferres &r)
 {
   u >> r.state;
   u >> r.last;
+  u >> r.cursor;
+  u >> r.full;
+  u >> r.done;
   return u;
 }
 
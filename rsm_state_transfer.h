@@ -1,10 +1,37 @@
 #ifndef rsm_state_transfer_h
 #define rsm_state_transfer_h
 
+#include <string>
+#include "rsm_protocol.h"
+
 class rsm_state_transfer {
  public:
   virtual std::string marshal_state() = 0;
   virtual void unmarshal_state(std::string) = 0;
+
+  // Paged and incremental transfer. Before executing requests the rsm
+  // tells the service their viewstamp; a service that records it per
+  // entry can send just the entries changed after a given viewstamp.
+  // The defaults send the whole state as a single page.
+  virtual void set_viewstamp(viewstamp vs) {};
+
+  // Marshals into page the entries that come after cursor, all of them
+  // if full is set and otherwise only those changed after since, until
+  // page holds about maxsize bytes. Advances cursor (empty at the start)
+  // and returns true once no entries are left. Called while the state
+  // does not change.
+  virtual bool marshal_page(bool full, viewstamp since, std::string &cursor,
+			    unsigned maxsize, std::string &page) {
+    page = marshal_state();
+    return true;
+  };
+
+  // Applies a page from marshal_page. replace is set for the first page
+  // of a full transfer: entries missing from the transfer are reset.
+  virtual void unmarshal_page(std::string page, bool replace) {
+    unmarshal_state(page);
+  };
+
   virtual ~rsm_state_transfer() {};
 };
 
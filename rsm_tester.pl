@@ -20,6 +20,12 @@ sub paxos_log {
   return "paxos-$port.log";
 }
 
+# binary snapshot and records next to the view list
+sub paxos_state {
+  my $port = shift;
+  return ("paxos-$port.snap", "paxos-$port.wal");
+}
+
 sub mydie {
   my ($s) = @_;
   killprocess() if ($always_kill);
@@ -44,10 +50,10 @@ sub spawn {
 # parent
     push( @logs, "$p-$aa.log" );
     if( $p =~ /config_server/ ) {
-      push( @logs, paxos_log($a[1]) );
+      push( @logs, paxos_log($a[1]), paxos_state($a[1]) );
     }
     if( $p =~ /lock_server/ ) {
-      push( @logs, paxos_log($a[1]) );
+      push( @logs, paxos_log($a[1]), paxos_state($a[1]) );
     }
     return $pid;
   } elsif (defined $pid) {
@@ -65,6 +71,21 @@ sub spawn {
   }
 }
 
+# the time the proposer on one of the given ports took to decide instance
+# $i, in ms, or -1 if none of them decided it
+sub decide_latency {
+  my $i = shift;
+  my @ports = @_;
+  my $best = -1;
+  foreach my $port (@ports) {
+    my $ms = `grep -a "decided i=$i in" lock_server-$p[0]-$port.log | tail -n 1`;
+    if ($ms =~ /in (\d+) ms/ and ($best < 0 or $1 < $best)) {
+      $best = $1;
+    }
+  }
+  return $best;
+}
+
 sub randports {
 
   my $num = shift;
@@ -258,7 +279,7 @@ if (defined($options{k})) {
 print_config( @p[0..4] );
 
 my @do_run = ();
-my $NUM_TESTS = 17;
+my $NUM_TESTS = 18;
 
 # see which tests are set
 if( $#ARGV > -1 ) {
@@ -907,6 +928,52 @@ if ($do_run[16]) {
   sleep 2;
 }
 
+if ($do_run[17]) {
+
+  print "test17: start 3-process rsm, partition a slave, measure the view change\n";
+
+  start_nodes(3, "ls");
+
+  print "Start lock_tester $p[0]\n";
+  $t = spawn("./lock_tester", $p[0]);
+
+  sleep 1;
+
+  print "Partition slave (PID: $pid[2]) on port $p[2] at breakpoint\n";
+  spawn("./rsm_tester", $p[2]+1, "partition", 0);
+
+  print "view change wait\n";
+  my @lastv = ($p[0],$p[1]);
+  foreach my $port (@lastv) {
+    wait_for_view_change(paxos_log($port), $in_views{$port}+1, $port, 20);
+  }
+
+  # the view without the partitioned node must not have waited for it
+  my $log = paxos_log($p[0]);
+  my $lastv = `grep -a "done " $log | tail -n 1`;
+  if( $lastv !~ /^done (\d+) / or $lastv =~ /$p[2]/ ) {
+    mydie( "Failed: $p[2] still in the last view ($lastv)" );
+  }
+  my $ms = decide_latency($1, @lastv);
+  print "   View $1 decided in $ms ms with $p[2] partitioned\n";
+  if( $ms < 0 or $ms >= 1000 ) {
+    mydie( "Failed: view change took $ms ms with one node partitioned" );
+  }
+
+  print "Heal partition slave (PID: $pid[2]) on port $p[2]\n";
+  spawn("./rsm_tester", $p[2]+1, "partition", 1);
+
+  print "   Wait for lock_tester to finish (waitpid $t)\n";
+  waitpid_to($t, 600);
+
+  if( system( "grep \"passed all tests successfully\" lock_tester-$p[0].log" ) ) {
+    mydie( "Failed lock tester for test 17" );
+  }
+
+  cleanup();
+  sleep 2;
+}
+
 print "tests done OK\n";
 
 unlink("config");
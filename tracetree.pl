@@ -0,0 +1,79 @@
+#!/usr/bin/perl -w
+
+# Merges the trace-<pid>.log files written by processes run with
+# RPC_TRACE set (see rpc/trace.h) and prints every trace as a tree of
+# spans: start relative to the root, duration, process, return value
+# and name. A * marks the critical path, the chain of spans that each
+# finished last among their siblings.
+#
+# usage: tracetree.pl [-t trace] [-s min_ms] trace-*.log
+
+use Getopt::Std;
+use strict;
+
+my %opts;
+getopts('t:s:', \%opts) or die "usage: $0 [-t trace] [-s min_ms] trace-*.log\n";
+my $min_us = ($opts{s} || 0) * 1000;
+
+my %spans;	# trace -> span -> record
+foreach my $f (@ARGV) {
+  my $pid = ($f =~ /trace-(\d+)\.log$/) ? $1 : $f;
+  open(F, "<", $f) or die "$0: cannot open $f\n";
+  while (<F>) {
+    chomp;
+    my ($trace, $span, $parent, $start, $dur, $ret, $name) = split(/ /, $_, 7);
+    next unless defined $name;
+    next if defined $opts{t} && $trace ne $opts{t};
+    $spans{$trace}{$span} = { span => $span, parent => $parent,
+      start => $start, end => $start + $dur, ret => $ret, name => $name,
+      pid => $pid, kids => [] };
+  }
+  close(F);
+}
+
+sub critical {
+  my ($s) = @_;
+  $s->{crit} = 1;
+  my $last;
+  foreach my $k (@{$s->{kids}}) {
+    $last = $k if !defined $last || $k->{end} > $last->{end};
+  }
+  critical($last) if defined $last;
+}
+
+sub show {
+  my ($s, $t0, $depth) = @_;
+  printf("%s%-*s %8.3f %8.3f ms  %6s %4d  %s\n", $s->{crit} ? "*" : " ",
+	 2 * $depth, "", ($s->{start} - $t0) / 1000,
+	 ($s->{end} - $s->{start}) / 1000, $s->{pid}, $s->{ret}, $s->{name});
+  foreach my $k (sort { $a->{start} <=> $b->{start} } @{$s->{kids}}) {
+    show($k, $t0, $depth + 1);
+  }
+}
+
+foreach my $trace (keys %spans) {
+  my $h = $spans{$trace};
+  # spans whose parent was not recorded, e.g. the root of a trace whose
+  # process did not exit yet, are shown at the top
+  my @roots;
+  foreach my $s (values %$h) {
+    if ($s->{parent} ne "0" && defined $h->{$s->{parent}}) {
+      push(@{$h->{$s->{parent}}{kids}}, $s);
+    } else {
+      push(@roots, $s);
+    }
+  }
+  @roots = sort { $a->{start} <=> $b->{start} } @roots;
+  my $t0 = $roots[0]{start};
+  my $end = 0;
+  foreach my $r (@roots) {
+    $end = $r->{end} if $r->{end} > $end;
+  }
+  next if $end - $t0 < $min_us;
+  print "trace $trace\n";
+  foreach my $r (@roots) {
+    critical($r);
+    show($r, $t0, 0);
+  }
+  print "\n";
+}
@@ -2,6 +2,7 @@
 #include "yfs_client.h"
 #include "extent_client.h"
 #include "lock_client.h"
+#include "jsl_log.h"
 #include <sstream>
 #include <iostream>
 #include <stdio.h>
@@ -38,7 +39,7 @@ yfs_client::filename(inum inum)
 bool
 yfs_client::isfile(inum inum)
 {
-  if(inum & 0x80000000)
+  if(inum & extent_protocol::inumtype)
     return true;
   return false;
 }
@@ -49,13 +50,26 @@ yfs_client::isdir(inum inum)
   return ! isfile(inum);
 }
 
+int
+yfs_client::newinum(bool file, inum &inum)
+{
+    // Get unique number from the range leased from extent server
+    extent_protocol::extentid_t id;
+    if (ec->allocate(id) != extent_protocol::OK)
+        return IOERR;
+
+    // Mark files with the type bit
+    inum = file ? (id | extent_protocol::inumtype) : id;
+    return OK;
+}
+
 int
 yfs_client::getfile(inum inum, fileinfo &fin)
 {
   int r = OK;
 
 
-  printf("getfile %016llx\n", inum);
+  jsl_log(JSL_DBG_3, "getfile %016llx\n", inum);
   extent_protocol::attr a;
   if (ec->getattr(inum, a) != extent_protocol::OK) {
     r = IOERR;
@@ -66,6 +80,7 @@ yfs_client::getfile(inum inum, fileinfo &fin)
   fin.mtime = a.mtime;
   fin.ctime = a.ctime;
   fin.size = a.size;
+  fin.nlink = a.nlink;
 
  release:
 
@@ -78,7 +93,7 @@ yfs_client::getdir(inum inum, dirinfo &din)
   int r = OK;
 
 
-  printf("getdir %016llx\n", inum);
+  jsl_log(JSL_DBG_3, "getdir %016llx\n", inum);
   extent_protocol::attr a;
   if (ec->getattr(inum, a) != extent_protocol::OK) {
     r = IOERR;
@@ -94,62 +109,33 @@ yfs_client::getdir(inum inum, dirinfo &din)
 
 yfs_client::inum yfs_client::ilookup(inum di, std::string name)
 {
-    // read listing for the dir
-    std::vector<yfs_client::dirent> dirEntries;
-    int res = listing(di, dirEntries);
-    
-    // check whether listing was retrieved successfully
-    if (res != OK)
+    // search for the file in the directory index
+    extent_protocol::extentid_t fileINum;
+    if (ec->dirlookup(di, name, fileINum) != extent_protocol::OK)
         return 0;
-    
-    // search for the file
-    for (std::vector<dirent>::const_iterator it = dirEntries.begin(); it != dirEntries.end(); it++)
-        if (it->name.compare(name) == 0)
-            return it->inum;
-            
-    return 0;
+
+    return fileINum;
 }
 
 int
 yfs_client::listing(inum inum, std::vector<dirent> & entries)
 {
-    printf("yfs_client::listing %016llx\n", inum);
+    jsl_log(JSL_DBG_3, "yfs_client::listing %016llx\n", inum);
 
-    // Get directory content
-    std::string buf;
-    if (ec->retrieveAll(inum, buf) != extent_protocol::OK)
+    // Get directory entries
+    std::map<std::string, extent_protocol::extentid_t> dirEntries;
+    if (ec->dirlist(inum, dirEntries) != extent_protocol::OK)
         // failed to read dir
         return IOERR;
 
-    /* Dir structure format:
-     *   filename1:inum1:filename2:inum2:filename3:inum3...
-     */
-
-    // Create mutable copy of the string as needed by strtok
-    char dirContent[buf.length()];
-    strcpy(dirContent, buf.c_str());
-
-    // Read until there are more files
-    const char * filenameStr = strtok(dirContent, ":");
-    const char * inumStr;
-    while (filenameStr != NULL)
+    for (std::map<std::string, extent_protocol::extentid_t>::const_iterator it = dirEntries.begin(); it != dirEntries.end(); it++)
     {
-        // get inum for the file
-        inumStr = strtok(NULL, ":");
-
-        // check that inum for the file exists
-        assert(inumStr != NULL);
-
         dirent e;
-        e.name = filenameStr;
-        e.inum = n2i(inumStr);
+        e.name = it->first;
+        e.inum = it->second;
 
         // add new entry
         entries.push_back(e);
-
-        // get next file
-        filenameStr = strtok(NULL, ":");
-
     }
 
     return OK;
@@ -157,34 +143,23 @@ yfs_client::listing(inum inum, std::vector<dirent> & entries)
 
 int yfs_client::create(inum parentINum, inum fileINum, const char * fileName)
 {
-    printf("yfs_client::create %016llx in directory %016llx\n", fileINum, parentINum);
+    jsl_log(JSL_DBG_3, "yfs_client::create %016llx in directory %016llx\n", fileINum, parentINum);
 
     // Add file with inum to server
     if (ec->create(fileINum) != extent_protocol::OK)
         return IOERR;
 
-    // Get directory content from server
-    std::string dirContent;
-    if (ec->retrieveAll(parentINum, dirContent) != extent_protocol::OK)
-        // failed to read dir content
-        return NOENT;
-
-    // Append information about file to directory information
-    if (!dirContent.empty())
-        dirContent.append(":");
-    dirContent.append(fileName).append(":").append(filename(fileINum));
-
-    // Update directory content on the server
-    if (ec->updateAll(parentINum, dirContent) != extent_protocol::OK)
-        // failed to update dir
+    // Directories know their parent, so that rename can check for cycles
+    if (isdir(fileINum) && ec->setparent(fileINum, parentINum) != extent_protocol::OK)
         return IOERR;
 
-    return OK;
+    // Add entry for the file to the directory
+    return dirinsert(parentINum, fileName, fileINum);
 }
 
-int yfs_client::update(inum fileINum, std::string content, int offset, int size, int & bytesWritten)
+int yfs_client::update(inum fileINum, std::string content, unsigned long long offset, int size, int & bytesWritten)
 {
-    printf("yfs_client::update %016llx\n", fileINum);
+    jsl_log(JSL_DBG_3, "yfs_client::update %016llx\n", fileINum);
 
     // Update file content
     if (ec->update(fileINum, content, offset, size, bytesWritten) != extent_protocol::OK)
@@ -194,9 +169,9 @@ int yfs_client::update(inum fileINum, std::string content, int offset, int size,
     return OK;
 }
 
-int yfs_client::retrieve(inum fileINum, int offset, int size, std::string &content)
+int yfs_client::retrieve(inum fileINum, unsigned long long offset, int size, std::string &content)
 {
-    printf("yfs_client::update %016llx\n", fileINum);
+    jsl_log(JSL_DBG_3, "yfs_client::update %016llx\n", fileINum);
 
     // Retrieve file content
     if (ec->retrieve(fileINum, offset, size, content) != extent_protocol::OK)
@@ -206,9 +181,9 @@ int yfs_client::retrieve(inum fileINum, int offset, int size, std::string &conte
     return OK;
 }
 
-int yfs_client::setsize(inum fileINum, int newSize)
+int yfs_client::setsize(inum fileINum, unsigned long long newSize)
 {
-    printf("yfs_client::setattr %016llx\n", fileINum);
+    jsl_log(JSL_DBG_3, "yfs_client::setattr %016llx\n", fileINum);
 
     // Get current attr
     extent_protocol::attr attr;
@@ -229,42 +204,205 @@ int yfs_client::setsize(inum fileINum, int newSize)
 
 int yfs_client::remove(inum parentINum, const char * fileName)
 {
-    printf("yfs_client::remove %s in %016llx", fileName, parentINum);
-    
-    // Getting directory listing
-    std::vector<dirent> dirEntries;
-    if (listing(parentINum, dirEntries)!=OK)
+    jsl_log(JSL_DBG_3, "yfs_client::remove %s in %016llx\n", fileName, parentINum);
+
+    // Removing entry from the directory
+    inum res;
+    int r = direrase(parentINum, fileName, res);
+    if (r != OK)
+        return r;
+
+    // Removing the file itself when last link to it is gone
+    return unlink(res);
+}
+
+int yfs_client::link(inum fileINum, inum parentINum, const char * fileName)
+{
+    jsl_log(JSL_DBG_3, "yfs_client::link %016llx as %s in %016llx\n", fileINum, fileName, parentINum);
+
+    // Check that there is no such entry already
+    if (ilookup(parentINum, fileName) != 0)
+        return EXIST;
+
+    // Increase link count of the file
+    extent_protocol::attr attr;
+    if (ec->getattr(fileINum, attr) != extent_protocol::OK)
+        return IOERR;
+    attr.nlink++;
+    if (ec->setattr(fileINum, attr) != extent_protocol::OK)
+        return IOERR;
+
+    // Add new name to the directory
+    return dirinsert(parentINum, fileName, fileINum);
+}
+
+int yfs_client::rename(inum srcParentINum, const char * srcName, inum dstParentINum, const char * dstName)
+{
+    jsl_log(JSL_DBG_3, "yfs_client::rename %s in %016llx to %s in %016llx\n", srcName, srcParentINum, dstName, dstParentINum);
+
+    // Find entry to move
+    inum fileINum = ilookup(srcParentINum, srcName);
+    if (fileINum == 0)
+        return NOENT;
+
+    // Renaming an entry onto another name of the same file does nothing
+    inum oldINum = ilookup(dstParentINum, dstName);
+    if (oldINum == fileINum)
+        return OK;
+
+    // A directory can't be moved into its own subtree, that would cut it off
+    // from the root and make a cycle
+    if (isdir(fileINum) && isancestor(fileINum, dstParentINum))
+        return INVAL;
+
+    // Replaced entry must be of the same kind, and an empty one for directories
+    if (oldINum != 0)
+    {
+        if (isdir(fileINum) && !isdir(oldINum))
+            return NOTDIR;
+        if (!isdir(fileINum) && isdir(oldINum))
+            return ISDIR;
+        if (isdir(oldINum) && !isempty(oldINum))
+            return NOTEMPTY;
+    }
+
+    // Move the entry, the file itself stays untouched apart from the parent
+    // of a directory. Every step puts back what the previous ones changed
+    // if it fails
+    bool reparent = isdir(fileINum) && srcParentINum != dstParentINum;
+    if (reparent && ec->setparent(fileINum, dstParentINum) != extent_protocol::OK)
         return IOERR;
 
     inum res;
-    // search for entry to delete
-    std::string dirContent;
-    for (std::vector<dirent>::const_iterator it = dirEntries.begin(); it != dirEntries.end(); it++)
+    int r = direrase(srcParentINum, srcName, res);
+    if (r != OK)
     {
-        if (it->name.compare(fileName) != 0)
-        {
-            if (!dirContent.empty())
-                dirContent.append(":");
-            dirContent.append(it->name).append(":").append(filename(it->inum));
-        }
-        else
+        if (reparent)
+            ec->setparent(fileINum, srcParentINum);
+        return r;
+    }
+
+    if (oldINum != 0)
+    {
+        r = direrase(dstParentINum, dstName, res);
+        if (r != OK)
         {
-            res=it->inum;
+            dirinsert(srcParentINum, srcName, fileINum);
+            if (reparent)
+                ec->setparent(fileINum, srcParentINum);
+            return r;
         }
     }
 
-    // Updating directory content
-    if (ec->updateAll(parentINum,dirContent)!=extent_protocol::OK)
+    r = dirinsert(dstParentINum, dstName, fileINum);
+    if (r != OK)
+    {
+        if (oldINum != 0)
+            dirinsert(dstParentINum, dstName, oldINum);
+        dirinsert(srcParentINum, srcName, fileINum);
+        if (reparent)
+            ec->setparent(fileINum, srcParentINum);
+        return r;
+    }
+
+    // Drop the replaced file once nothing refers to it by this name
+    if (oldINum != 0)
+        return unlink(oldINum);
+
+    return OK;
+}
+
+int yfs_client::rmdir(inum parentINum, const char * dirName)
+{
+    jsl_log(JSL_DBG_3, "yfs_client::rmdir %s in %016llx\n", dirName, parentINum);
+
+    // Check that the entry is an empty directory
+    inum dirINum = ilookup(parentINum, dirName);
+    if (dirINum == 0)
+        return NOENT;
+    if (!isdir(dirINum))
+        return NOTDIR;
+    if (!isempty(dirINum))
+        return NOTEMPTY;
+
+    return remove(parentINum, dirName);
+}
+
+bool yfs_client::isempty(inum dirINum)
+{
+    std::vector<dirent> dirEntries;
+    if (listing(dirINum, dirEntries) != OK)
+        return false;
+    return dirEntries.empty();
+}
+
+bool yfs_client::isancestor(inum ancestorINum, inum dirINum)
+{
+    // Walk up through the parents kept on the extent server, which are read
+    // without the directories' locks and without caching the directories.
+    // The root has no parent. The walk is bounded in case another client's
+    // rename is half done
+    for (int depth = 0; depth < 4096; depth++)
+    {
+        if (dirINum == ancestorINum)
+            return true;
+        extent_protocol::extentid_t parentINum;
+        if (ec->getparent(dirINum, parentINum) != extent_protocol::OK)
+            return false;
+        dirINum = parentINum;
+    }
+
+    // too deep to tell, refuse the move
+    return true;
+}
+
+int yfs_client::unlink(inum fileINum)
+{
+    // Directories have exactly one link
+    extent_protocol::attr attr;
+    if (ec->getattr(fileINum, attr) != extent_protocol::OK)
         return IOERR;
 
-    if (res == 0)
+    if (isdir(fileINum) || attr.nlink <= 1)
+    {
+        if (ec->remove(fileINum) != extent_protocol::OK)
+            return IOERR;
+        return OK;
+    }
+
+    attr.nlink--;
+    if (ec->setattr(fileINum, attr) != extent_protocol::OK)
+        return IOERR;
+
+    return OK;
+}
+
+int yfs_client::dirinsert(inum parentINum, const char * fileName, inum fileINum)
+{
+    // Append the entry to the directory operation log
+    extent_protocol::status ret = ec->dirinsert(parentINum, fileName, fileINum);
+    if (ret == extent_protocol::NOENT)
+        // failed to read dir content
         return NOENT;
-        
-    if (ec->remove(res) != extent_protocol::OK)
+    if (ret != extent_protocol::OK)
+        // failed to update dir
         return IOERR;
 
     return OK;
-    
+}
+
+int yfs_client::direrase(inum parentINum, const char * fileName, inum & fileINum)
+{
+    // Record removal of the entry in the directory operation log
+    extent_protocol::extentid_t res;
+    extent_protocol::status ret = ec->direrase(parentINum, fileName, res);
+    if (ret == extent_protocol::NOENT)
+        return NOENT;
+    if (ret != extent_protocol::OK)
+        return IOERR;
+
+    fileINum = res;
+    return OK;
 }
 
 lock_protocol::status yfs_client::acquire(lock_protocol::lockid_t lockID)
@@ -276,3 +414,13 @@ lock_protocol::status yfs_client::release(lock_protocol::lockid_t lockID)
 {
     return lc->release(lockID);
 }
+
+lock_protocol::status yfs_client::acquire(lock_protocol::lockid_t lockID1, lock_protocol::lockid_t lockID2)
+{
+    return lc->acquire(lockID1, lockID2);
+}
+
+lock_protocol::status yfs_client::release(lock_protocol::lockid_t lockID1, lock_protocol::lockid_t lockID2)
+{
+    return lc->release(lockID1, lockID2);
+}
@@ -19,8 +19,15 @@ public:
             ec(excl)
     {;}
 
-    void dorelease(lock_protocol::lockid_t id){
-        ec->flush(id);
+    lock_protocol::status dorelease(lock_protocol::lockid_t id){
+        if (ec->flush(id) != extent_protocol::OK)
+            return lock_protocol::RPCERR;
+        return lock_protocol::OK;
+    }
+
+    // Write the extent back in the background, flush then sends only what changes until the release
+    void dorevoke(lock_protocol::lockid_t id){
+        ec->writeback(id);
     }
 
 };
@@ -31,11 +38,12 @@ public:
  public:
 
   typedef unsigned long long inum;
-  enum xxstatus { OK, RPCERR, NOENT, IOERR, FBIG };
+  enum xxstatus { OK, RPCERR, NOENT, IOERR, FBIG, EXIST, NOTDIR, NOTEMPTY, ISDIR, INVAL };
   typedef int status;
 
   struct fileinfo {
     unsigned long long size;
+    unsigned long nlink;
     unsigned long atime;
     unsigned long mtime;
     unsigned long ctime;
@@ -53,26 +61,38 @@ public:
  private:
   static std::string filename(inum);
   static inum n2i(std::string);
+
+  bool isempty(inum);
+  bool isancestor(inum ancestorINum, inum dirINum);
+  int unlink(inum fileINum);
+  int dirinsert(inum parentINum, const char * fileName, inum fileINum);
+  int direrase(inum parentINum, const char * fileName, inum & fileINum);
  public:
 
   yfs_client(std::string, std::string);
 
   bool isfile(inum);
   bool isdir(inum);
+  int newinum(bool file, inum &);
   inum ilookup(inum di, std::string name);
 
   lock_protocol::status acquire(lock_protocol::lockid_t);
   lock_protocol::status release(lock_protocol::lockid_t);
+  lock_protocol::status acquire(lock_protocol::lockid_t, lock_protocol::lockid_t);
+  lock_protocol::status release(lock_protocol::lockid_t, lock_protocol::lockid_t);
 
   int getfile(inum, fileinfo &);
   int getdir(inum, dirinfo &);
 
   int listing(inum, std::vector<dirent> &);
   int create(inum parentINum, inum fileINum, const char * fileName);
-  int update(inum fileINum, std::string content, int offset, int size, int & bytesWritten);
-  int retrieve(inum fileINum, int offset, int size, std::string &content);
-  int setsize(inum fileINum, int newSize);
+  int update(inum fileINum, std::string content, unsigned long long offset, int size, int & bytesWritten);
+  int retrieve(inum fileINum, unsigned long long offset, int size, std::string &content);
+  int setsize(inum fileINum, unsigned long long newSize);
   int remove(inum parentINum, const char * fileName);
+  int link(inum fileINum, inum parentINum, const char * fileName);
+  int rename(inum srcParentINum, const char * srcName, inum dstParentINum, const char * dstName);
+  int rmdir(inum parentINum, const char * dirName);
 };
 
 #endif 